@@ -35,9 +35,46 @@ test_server_local() {
     done
 }
 
+# pipelined keep-alive requests on a few connections at once, more than one
+# connection may serve per wakeup, so they take turns through the yield queue
+test_pipelining() {
+    local request reqs out i c pids
+    request=$'GET / HTTP/1.1\r\nHost: localhost\r\nConnection: keep-alive\r\n\r\n'
+    reqs=""
+    for i in $(seq 1 99); do
+        reqs+=$request
+    done
+    reqs+=$'GET / HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n'
+
+    out=$(mktemp -d)
+    pids=""
+    for c in 1 2 3 4; do
+        (
+            exec 3<>/dev/tcp/127.0.0.1/$LOCAL_PORT || exit 1
+            printf '%s' "$reqs" >&3
+            timeout 5 cat <&3 | grep -c '^HTTP/1.1 200' >$out/$c
+        ) &
+        pids+=" $!"
+    done
+    wait $pids
+
+    for c in 1 2 3 4; do
+        if [ "$(cat $out/$c)" != "100" ]; then
+            printf "\npipelining: connection %d got %s of 100 responses\n" \
+                $c "$(cat $out/$c)"
+            rm -rf $out
+            return 1
+        fi
+    done
+    rm -rf $out
+}
+
 pkill -9 sehttpd >/dev/null 2>/dev/null
 
 start_http_server
 test_server_local
+test_pipelining
+status=$?
 stop_http_server
 printf "\n"
+exit $status
@@ -0,0 +1,270 @@
+#include <arpa/inet.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "access_log.h"
+#include "cycles.h"
+#include "logger.h"
+#include "stats.h"
+
+/* records per worker ring, must be a power of 2 */
+#define ACCESS_LOG_RING_SIZE 4096
+#define ACCESS_LOG_MAX_WORKERS 64
+
+/* the writer formats into this buffer and flushes it with one write */
+#define ACCESS_LOG_BUFSIZE (64 * 1024)
+#define ACCESS_LOG_LINE_MAX 256
+
+/* how long the writer sleeps when every ring is empty */
+#define ACCESS_LOG_IDLE_NS (20 * 1000 * 1000)
+
+/* how long access_log_flush() waits for a writer that makes no progress */
+#define ACCESS_LOG_FLUSH_NS (1000 * 1000 * 1000)
+
+typedef struct {
+    /* written by the worker only */
+    _Atomic size_t head __attribute__((aligned(64)));
+    size_t seen;
+
+    /* written by the writer thread only */
+    _Atomic size_t tail __attribute__((aligned(64)));
+
+    access_record_t rec[ACCESS_LOG_RING_SIZE];
+} log_ring_t;
+
+bool access_log_enabled = false;
+
+static int log_fd = -1;
+static unsigned log_sample = 1;
+static int64_t realtime_offset; /* CLOCK_REALTIME - CLOCK_MONOTONIC, in ns */
+
+static log_ring_t *rings[ACCESS_LOG_MAX_WORKERS];
+static _Atomic int nrings;
+static _Atomic unsigned idle_passes; /* passes that found every ring empty */
+static _Atomic bool writer_running;
+static __thread log_ring_t *local_ring;
+
+static const char *method_name(int method)
+{
+    switch (method) {
+    case HTTP_GET:
+        return "GET";
+    case HTTP_HEAD:
+        return "HEAD";
+    case HTTP_POST:
+        return "POST";
+    default:
+        return "UNKNOWN";
+    }
+}
+
+static void write_all(const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(log_fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return; /* nowhere left to report it */
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+static size_t format_record(char *buf, const access_record_t *rec)
+{
+    /* strftime only when the second changes */
+    static time_t last_sec = -1;
+    static char date[64];
+
+    time_t sec = rec->time_ns / 1000000000ULL;
+    if (sec != last_sec) {
+        struct tm tm;
+        gmtime_r(&sec, &tm);
+        strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S +0000", &tm);
+        last_sec = sec;
+    }
+
+    char addr[INET_ADDRSTRLEN];
+    struct in_addr in = {.s_addr = rec->addr};
+    inet_ntop(AF_INET, &in, addr, sizeof(addr));
+
+    int n = snprintf(buf, ACCESS_LOG_LINE_MAX,
+                     "%s:%u [%s] \"%s %.*s\" %u %" PRIu64 " %uus %08x\n", addr,
+                     ntohs(rec->port), date, method_name(rec->method),
+                     (int) rec->path_len, rec->path, rec->status, rec->bytes,
+                     rec->latency_us, rec->path_hash);
+    if (n < 0)
+        return 0;
+    return (size_t) n < ACCESS_LOG_LINE_MAX ? (size_t) n
+                                            : ACCESS_LOG_LINE_MAX - 1;
+}
+
+static void *access_log_writer(void *arg UNUSED)
+{
+    char *buf = malloc(ACCESS_LOG_BUFSIZE);
+    if (!buf) {
+        log_err("access_log_writer: malloc");
+        atomic_store(&writer_running, false);
+        return NULL;
+    }
+
+    for (;;) {
+        size_t len = 0;
+        int n = atomic_load_explicit(&nrings, memory_order_acquire);
+
+        for (int i = 0; i < n; i++) {
+            log_ring_t *ring = rings[i];
+            size_t tail =
+                atomic_load_explicit(&ring->tail, memory_order_relaxed);
+            size_t head =
+                atomic_load_explicit(&ring->head, memory_order_acquire);
+
+            for (; tail != head; tail++) {
+                if (len > ACCESS_LOG_BUFSIZE - ACCESS_LOG_LINE_MAX) {
+                    write_all(buf, len);
+                    len = 0;
+                }
+                len += format_record(
+                    buf + len, &ring->rec[tail & (ACCESS_LOG_RING_SIZE - 1)]);
+            }
+            atomic_store_explicit(&ring->tail, tail, memory_order_release);
+        }
+
+        if (len) {
+            write_all(buf, len);
+            continue;
+        }
+
+        atomic_fetch_add_explicit(&idle_passes, 1, memory_order_release);
+        struct timespec idle = {.tv_sec = 0, .tv_nsec = ACCESS_LOG_IDLE_NS};
+        nanosleep(&idle, NULL);
+    }
+
+    return NULL;
+}
+
+/* wait until the writer has written every record appended so far. The second
+ * idle pass is the first one guaranteed to have started after the call. A
+ * writer that is gone, or stuck in write(2), is not waited for.
+ */
+void access_log_flush()
+{
+    if (!access_log_enabled)
+        return;
+
+    uint64_t deadline = now_ns() + ACCESS_LOG_FLUSH_NS;
+    unsigned start = atomic_load_explicit(&idle_passes, memory_order_acquire);
+    while (atomic_load_explicit(&idle_passes, memory_order_acquire) - start <
+           2) {
+        if (!atomic_load(&writer_running) || now_ns() >= deadline) {
+            log_err("access_log_flush: the writer is not draining the log");
+            return;
+        }
+        struct timespec idle = {.tv_sec = 0, .tv_nsec = ACCESS_LOG_IDLE_NS};
+        nanosleep(&idle, NULL);
+    }
+}
+
+/* open the log ("-" for stdout) and start the writer thread. One request in
+ * every 'sample' is logged.
+ */
+bool access_log_open(const char *path, unsigned sample)
+{
+    if (!strcmp(path, "-"))
+        log_fd = STDOUT_FILENO;
+    else
+        log_fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (log_fd < 0) {
+        log_err("access_log_open: %s", path);
+        return false;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    realtime_offset =
+        (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec - (int64_t) now_ns();
+    log_sample = sample ? sample : 1;
+
+    pthread_t writer;
+    atomic_store(&writer_running, true);
+    if (pthread_create(&writer, NULL, access_log_writer, NULL)) {
+        log_err("access_log_open: pthread_create");
+        return false;
+    }
+    pthread_detach(writer);
+
+    access_log_enabled = true;
+    return true;
+}
+
+/* give the calling worker its own ring */
+void access_log_register()
+{
+    if (!access_log_enabled || local_ring)
+        return;
+
+    int n = atomic_load(&nrings);
+    if (n >= ACCESS_LOG_MAX_WORKERS)
+        return;
+
+    log_ring_t *ring = calloc(1, sizeof(log_ring_t));
+    if (!ring) {
+        log_err("access_log_register: calloc");
+        return;
+    }
+
+    rings[n] = ring;
+    atomic_store_explicit(&nrings, n + 1, memory_order_release);
+    local_ring = ring;
+}
+
+void access_log_append(const http_request_t *r,
+                       int status,
+                       ssize_t bytes,
+                       uint64_t start_ns)
+{
+    log_ring_t *ring = local_ring;
+    if (!ring || ++ring->seen % log_sample)
+        return;
+
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >=
+        ACCESS_LOG_RING_SIZE) {
+        stats_inc(log_dropped);
+        return;
+    }
+
+    uint64_t end = now_ns();
+    access_record_t *rec = &ring->rec[head & (ACCESS_LOG_RING_SIZE - 1)];
+    rec->time_ns = end + realtime_offset;
+    rec->bytes = bytes > 0 ? bytes : 0;
+    rec->addr = r->addr;
+    rec->port = r->port;
+    rec->latency_us = (end - start_ns) / 1000;
+    rec->status = status;
+    rec->method = r->method;
+
+    const char *uri = r->uri_start;
+    ptrdiff_t len = (const char *) r->uri_end - uri;
+    assert(len >= 0 && "the mirrored request buffer keeps the URI contiguous");
+
+    uint32_t hash = 2166136261u;
+    for (ptrdiff_t i = 0; i < len; i++)
+        hash = (hash ^ (uint8_t) uri[i]) * 16777619u;
+    rec->path_hash = hash;
+    rec->path_len = len < ACCESS_LOG_PATH_LEN ? len : ACCESS_LOG_PATH_LEN;
+    memcpy(rec->path, uri, rec->path_len);
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    stats_inc(log_records);
+}
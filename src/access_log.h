@@ -0,0 +1,43 @@
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "http.h"
+
+/* Asynchronous access log.
+ *
+ * The event loop only copies a fixed-size binary record into a per-worker
+ * single-producer single-consumer ring. A background thread drains all rings,
+ * formats the records and writes them out in batches. When a ring is full
+ * the record is dropped and counted instead of blocking the worker.
+ */
+
+#define ACCESS_LOG_PATH_LEN 30
+
+typedef struct {
+    uint64_t time_ns;    /* wall clock at the end of the response */
+    uint64_t bytes;      /* bytes sent, headers included */
+    uint32_t addr;       /* client IPv4 address, network byte order */
+    uint32_t latency_us; /* from request parse to response sent */
+    uint32_t path_hash;  /* FNV-1a of the full request path */
+    uint16_t port;       /* client port, network byte order */
+    uint16_t status;
+    uint8_t method;
+    uint8_t path_len; /* bytes kept in path, at most ACCESS_LOG_PATH_LEN */
+    char path[ACCESS_LOG_PATH_LEN];
+} access_record_t;
+
+extern bool access_log_enabled;
+
+bool access_log_open(const char *path, unsigned sample);
+void access_log_register();
+void access_log_flush();
+void access_log_append(const http_request_t *r,
+                       int status,
+                       ssize_t bytes,
+                       uint64_t start_ns);
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for the sake of sched_getaffinity(2) */
+#endif
+
+#include <errno.h>
+#include <linux/filter.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "affinity.h"
+#include "logger.h"
+
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+
+/* the CPUs the process may run on, in ascending order, at most max */
+int affinity_cpus(int *cpus, int max)
+{
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) < 0) {
+        log_err("sched_getaffinity");
+        return 0;
+    }
+
+    int n = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE && n < max; cpu++) {
+        if (CPU_ISSET(cpu, &set))
+            cpus[n++] = cpu;
+    }
+    return n;
+}
+
+/* keep the calling thread on cpu */
+bool affinity_pin(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (rc) {
+        log_err("pthread_setaffinity_np: CPU %d", cpu);
+        return false;
+    }
+    return true;
+}
+
+/* hand a connection to the socket of the reuseport group fd belongs to whose
+ * worker runs on the CPU that received it. Sockets are numbered in the order
+ * they joined the group, so cpus[i] is the CPU of socket i. Connections
+ * arriving on other CPUs are spread by CPU number.
+ */
+bool affinity_steer(int fd, const int *cpus, int n)
+{
+    struct sock_filter *code = calloc(2 * n + 3, sizeof(struct sock_filter));
+    if (!code)
+        return false;
+
+    int len = 0;
+    code[len++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                                                SKF_AD_OFF + SKF_AD_CPU);
+    for (int i = 0; i < n; i++) {
+        code[len++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                                    cpus[i], 0, 1);
+        code[len++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, i);
+    }
+    code[len++] = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, n);
+    code[len++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_A, 0);
+
+    struct sock_fprog prog = {.len = len, .filter = code};
+    int rc = setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+                        sizeof(prog));
+    free(code);
+    if (rc < 0) {
+        log_err("setsockopt(SO_ATTACH_REUSEPORT_CBPF)");
+        return false;
+    }
+    return true;
+}
+
+/* the CPU that processed the packets of a connection, -1 if unknown */
+int affinity_incoming_cpu(int fd)
+{
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+    if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0)
+        return -1;
+    return cpu;
+}
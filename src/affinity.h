@@ -0,0 +1,21 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <stdbool.h>
+
+/* CPU placement of the workers, with --cpu-affinity.
+ *
+ * Worker i is pinned to the i-th CPU the process may run on and accepts
+ * from a listening socket of its own, one of a SO_REUSEPORT group. A classic
+ * BPF program on the group picks the socket of the worker pinned to the CPU
+ * that processed the SYN, which is the CPU the NIC queue of the flow
+ * interrupts (RSS, or RPS/RFS in software). The connection is then served
+ * where its packets arrive. Whatever a worker allocates after being pinned
+ * is placed on its own NUMA node by the kernel's first-touch policy.
+ */
+int affinity_cpus(int *cpus, int max);
+bool affinity_pin(int cpu);
+bool affinity_steer(int fd, const int *cpus, int n);
+int affinity_incoming_cpu(int fd);
+
+#endif
@@ -0,0 +1,267 @@
+/*
+ * bench_parser - microbenchmark for http_parse_request_line() and
+ * http_parse_request_body()
+ *
+ * Every request of the corpus is parsed once in one piece and then once per
+ * split point, placed so that the ring buffer wraps exactly at the split.
+ * The buffer is mapped twice in a row, so the parser has to see no seam
+ * there: any mismatch with the piece parsed away from the wrap is counted.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cycles.h"
+#include "http.h"
+
+typedef struct {
+    const char *name;
+    const char *data;
+} capture_t;
+
+/* request captures taken from common clients */
+static const capture_t corpus[] = {
+    {"htstress", "GET / HTTP/1.0\r\nHost: localhost\r\n\r\n"},
+    {"wget",
+     "GET /index.html HTTP/1.1\r\n"
+     "User-Agent: Wget/1.21.3\r\n"
+     "Accept: */*\r\n"
+     "Accept-Encoding: identity\r\n"
+     "Host: 127.0.0.1:8081\r\n"
+     "Connection: Keep-Alive\r\n\r\n"},
+    {"curl",
+     "GET /images/logo.png HTTP/1.1\r\n"
+     "Host: 127.0.0.1:8081\r\n"
+     "User-Agent: curl/7.88.1\r\n"
+     "Accept: */*\r\n\r\n"},
+    {"ab",
+     "HEAD /index.html HTTP/1.0\r\n"
+     "Host: localhost:8081\r\n"
+     "User-Agent: ApacheBench/2.3\r\n"
+     "Accept: */*\r\n\r\n"},
+    {"firefox",
+     "GET /css/site.css?v=20201015 HTTP/1.1\r\n"
+     "Host: www.example.com\r\n"
+     "User-Agent: Mozilla/5.0 (X11; Ubuntu; Linux x86_64; rv:81.0) "
+     "Gecko/20100101 Firefox/81.0\r\n"
+     "Accept: text/css,*/*;q=0.1\r\n"
+     "Accept-Language: en-US,en;q=0.5\r\n"
+     "Accept-Encoding: gzip, deflate\r\n"
+     "Connection: keep-alive\r\n"
+     "Referer: http://www.example.com/\r\n"
+     "If-Modified-Since: Thu, 15 Oct 2020 08:12:31 GMT\r\n"
+     "Cache-Control: max-age=0\r\n\r\n"},
+    {"chrome",
+     "GET /docs/api/reference.html HTTP/1.1\r\n"
+     "Host: www.example.com\r\n"
+     "Connection: keep-alive\r\n"
+     "Upgrade-Insecure-Requests: 1\r\n"
+     "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) "
+     "AppleWebKit/537.36 (KHTML, like Gecko) Chrome/86.0.4240.75 "
+     "Safari/537.36\r\n"
+     "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+     "image/avif,image/webp,image/apng,*/*;q=0.8,"
+     "application/signed-exchange;v=b3;q=0.9\r\n"
+     "Sec-Fetch-Site: same-origin\r\n"
+     "Sec-Fetch-Mode: navigate\r\n"
+     "Sec-Fetch-User: ?1\r\n"
+     "Sec-Fetch-Dest: document\r\n"
+     "Referer: http://www.example.com/docs/\r\n"
+     "Accept-Encoding: gzip, deflate, br\r\n"
+     "Accept-Language: en-US,en;q=0.9,zh-TW;q=0.8\r\n"
+     "Cookie: _ga=GA1.2.1234567890.1602748800; session=8f14e45fceea167a\r\n"
+     "\r\n"},
+    {"post",
+     "POST /form HTTP/1.1\r\n"
+     "Host: localhost\r\n"
+     "Content-Type: application/x-www-form-urlencoded\r\n"
+     "Content-Length: 0\r\n\r\n"},
+    {NULL, NULL}};
+
+typedef struct {
+    int method;
+    int http_major, http_minor;
+    size_t uri_len;
+    int nheaders;
+} parse_result_t;
+
+static int iterations = 2000;
+
+static size_t ring_len(void *start, void *end)
+{
+    return ((char *) end - (char *) start) & (MAX_BUF - 1);
+}
+
+static void ring_fill(http_request_t *r, size_t start, const char *s, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        r->buf[(start + i) & (MAX_BUF - 1)] = s[i];
+}
+
+static void reset_request(http_request_t *r, size_t start)
+{
+    r->pos = r->last = start;
+    r->state = 0;
+    r->request_end = NULL;
+    INIT_LIST_HEAD(&r->list);
+}
+
+static int free_headers(http_request_t *r)
+{
+    int n = 0;
+    while (!list_empty(&r->list)) {
+        list_head *pos = r->list.next;
+        list_del(pos);
+        free(list_entry(pos, http_header_t, list));
+        n++;
+    }
+    return n;
+}
+
+/* feed the request in chunks ending at each of ends[], the way do_request
+ * would after successive reads. Returns 0 once both the request line and
+ * the headers are parsed.
+ */
+static int parse_chunks(http_request_t *r, const size_t *ends, int nends)
+{
+    bool line_done = false;
+
+    for (int i = 0; i < nends; i++) {
+        r->last = ends[i];
+        if (!line_done) {
+            int rc = http_parse_request_line(r);
+            if (rc == EAGAIN)
+                continue;
+            if (rc != 0)
+                return rc;
+            line_done = true;
+        }
+
+        int rc = http_parse_request_body(r);
+        if (rc == EAGAIN)
+            continue;
+        return rc;
+    }
+    return EAGAIN;
+}
+
+static bool same_result(const parse_result_t *a, const parse_result_t *b)
+{
+    return a->method == b->method && a->http_major == b->http_major &&
+           a->http_minor == b->http_minor && a->uri_len == b->uri_len &&
+           a->nheaders == b->nheaders;
+}
+
+static void collect_result(http_request_t *r, parse_result_t *res)
+{
+    res->method = r->method;
+    res->http_major = r->http_major;
+    res->http_minor = r->http_minor;
+    res->uri_len = ring_len(r->uri_start, r->uri_end);
+    res->nheaders = free_headers(r);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "n:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        default:
+            printf("Usage: bench_parser [-n iterations]\n");
+            return 0;
+        }
+    }
+    if (iterations <= 0)
+        iterations = 1;
+
+    http_request_t *r = http_request_alloc(MAX_BUF);
+    if (!r)
+        return 1;
+    init_http_request(r, -1, -1, NULL);
+
+    printf("%-10s %6s %12s %12s %12s %9s\n", "capture", "bytes", "whole ns/op",
+           "split ns/op", "cycles/byte", "mismatch");
+
+    uint64_t total_bytes = 0, total_cycles = 0, total_ns = 0, total_ops = 0;
+    int total_mismatch = 0;
+
+    for (const capture_t *c = corpus; c->name; c++) {
+        size_t len = strlen(c->data);
+        parse_result_t ref, res;
+
+        /* reference parse: contiguous, away from the wrap point */
+        memset(r->buf, 0, MAX_BUF);
+        ring_fill(r, 0, c->data, len);
+        reset_request(r, 0);
+        size_t end = len;
+        if (parse_chunks(r, &end, 1) != 0) {
+            fprintf(stderr, "%s: reference parse failed\n", c->name);
+            return 1;
+        }
+        collect_result(r, &ref);
+
+        uint64_t t0 = now_ns(), c0 = read_cycles();
+        for (int it = 0; it < iterations; it++) {
+            reset_request(r, 0);
+            parse_chunks(r, &end, 1);
+            free_headers(r);
+        }
+        uint64_t whole_cycles = read_cycles() - c0;
+        uint64_t whole_ns = now_ns() - t0;
+
+        /* one case per split point, with the wrap at the split */
+        uint64_t split_ns = 0, split_cycles = 0;
+        int mismatch = 0;
+        for (size_t s = 1; s < len; s++) {
+            size_t start = MAX_BUF - s;
+            size_t ends[2] = {MAX_BUF, start + len};
+
+            memset(r->buf, 0, MAX_BUF);
+            ring_fill(r, start, c->data, len);
+            reset_request(r, start);
+            if (parse_chunks(r, ends, 2) != 0) {
+                free_headers(r);
+                mismatch++;
+            } else {
+                collect_result(r, &res);
+                if (!same_result(&ref, &res))
+                    mismatch++;
+            }
+
+            t0 = now_ns();
+            c0 = read_cycles();
+            for (int it = 0; it < iterations; it++) {
+                reset_request(r, start);
+                parse_chunks(r, ends, 2);
+                free_headers(r);
+            }
+            split_cycles += read_cycles() - c0;
+            split_ns += now_ns() - t0;
+        }
+
+        uint64_t nsplit = (uint64_t) (len - 1) * iterations;
+        printf("%-10s %6zu %12.1f %12.1f %12.2f %9d\n", c->name, len,
+               (double) whole_ns / iterations, (double) split_ns / nsplit,
+               (double) (whole_cycles + split_cycles) /
+                   ((double) len * (iterations + nsplit)),
+               mismatch);
+
+        total_bytes += (uint64_t) len * (iterations + nsplit);
+        total_cycles += whole_cycles + split_cycles;
+        total_ns += whole_ns + split_ns;
+        total_ops += iterations + nsplit;
+        total_mismatch += mismatch;
+    }
+
+    printf("%-10s %6s %12.1f %12s %12.2f %9d\n", "total", "",
+           (double) total_ns / total_ops, "",
+           (double) total_cycles / total_bytes, total_mismatch);
+
+    http_request_free(r);
+    return 0;
+}
@@ -0,0 +1,108 @@
+/*
+ * bench_timer - microbenchmark for the timer heap
+ *
+ * Drives add_timer(), del_timer(), find_timer() and handle_expired_timers()
+ * directly, without sockets. The "churn" phase mimics do_request(): every
+ * wakeup deletes the pending timer of a live connection and arms a new one,
+ * leaving the stale node in the heap for lazy removal.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cycles.h"
+#include "timer.h"
+
+static size_t expired;
+
+static int count_expired(http_request_t *r UNUSED)
+{
+    expired++;
+    return 0;
+}
+
+static void report(const char *phase, size_t ops, uint64_t ns, uint64_t cycles)
+{
+    printf("%-16s %10zu %10.1f %12.1f\n", phase, ops, (double) ns / ops,
+           (double) cycles / ops);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t n = 1000000, conns = 1000;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:c:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            n = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            conns = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            printf("Usage: bench_timer [-n timers] [-c connections]\n");
+            return 0;
+        }
+    }
+    if (!n || !conns)
+        return 1;
+
+    /* timers only touch r->timer, so one request per connection is enough
+     * to back any number of timer nodes.
+     */
+    http_request_t *reqs = malloc(sizeof(http_request_t) * conns);
+    void **nodes = malloc(sizeof(void *) * n);
+    if (!reqs || !nodes)
+        return 1;
+
+    timer_init();
+    printf("%-16s %10s %10s %12s\n", "phase", "ops", "ns/op", "cycles/op");
+
+    /* fill the heap with already expired timers */
+    uint64_t t0 = now_ns(), c0 = read_cycles();
+    for (size_t i = 0; i < n; i++) {
+        http_request_t *r = &reqs[i % conns];
+        add_timer(r, 0, count_expired);
+        nodes[i] = r->timer;
+    }
+    report("add_timer", n, now_ns() - t0, read_cycles() - c0);
+
+    /* cancel every other one, as closed connections do */
+    t0 = now_ns(), c0 = read_cycles();
+    for (size_t i = 0; i < n; i += 2) {
+        http_request_t *r = &reqs[i % conns];
+        r->timer = nodes[i];
+        del_timer(r);
+    }
+    report("del_timer", (n + 1) / 2, now_ns() - t0, read_cycles() - c0);
+
+    /* pop everything: half fire, half are skipped as deleted */
+    t0 = now_ns(), c0 = read_cycles();
+    handle_expired_timers();
+    report("expire", n, now_ns() - t0, read_cycles() - c0);
+    if (expired != n / 2) {
+        fprintf(stderr, "expired %zu timers, expected %zu\n", expired, n / 2);
+        return 1;
+    }
+
+    /* keep-alive churn: re-arm a live connection on every request */
+    for (size_t i = 0; i < conns; i++)
+        add_timer(&reqs[i], TIMEOUT_DEFAULT, count_expired);
+    t0 = now_ns(), c0 = read_cycles();
+    for (size_t i = 0; i < n; i++) {
+        http_request_t *r = &reqs[i % conns];
+        del_timer(r);
+        add_timer(r, TIMEOUT_DEFAULT, count_expired);
+    }
+    report("churn", n, now_ns() - t0, read_cycles() - c0);
+
+    /* the next lookup drains the n stale nodes churn left behind */
+    t0 = now_ns(), c0 = read_cycles();
+    find_timer();
+    report("find_timer", n, now_ns() - t0, read_cycles() - c0);
+
+    free(nodes);
+    free(reqs);
+    return 0;
+}
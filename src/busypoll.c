@@ -0,0 +1,131 @@
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "busypoll.h"
+#include "cycles.h"
+#include "logger.h"
+
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
+/* from linux/eventpoll.h, Linux 6.9 */
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+    uint32_t busy_poll_usecs;
+    uint16_t busy_poll_budget;
+    uint8_t prefer_busy_poll;
+    uint8_t __pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+/* packets the kernel takes from the queue per poll, its own default */
+#define BUSY_POLL_BUDGET 8
+
+/* how far the spin window may grow, in multiples of --busy-poll */
+#define SPIN_GROWTH_MAX 16
+
+static unsigned poll_usecs;
+static uint64_t cycles_per_ms;
+static uint64_t spin_min, spin_max; /* cycles */
+
+static __thread uint64_t spin_window;
+
+/* measure the cycle counter against the monotonic clock, timers are then
+ * checked without a system call while spinning
+ */
+void busy_poll_init(unsigned usecs)
+{
+    uint64_t t0 = now_ns(), c0 = read_cycles();
+    usleep(20000);
+    uint64_t ns = now_ns() - t0, cycles = read_cycles() - c0;
+
+    cycles_per_ms = ns ? cycles * 1000000 / ns : 1000000;
+    poll_usecs = usecs;
+    spin_min = cycles_per_ms * usecs / 1000;
+    if (!spin_min)
+        spin_min = 1;
+    spin_max = spin_min * SPIN_GROWTH_MAX;
+}
+
+/* accepted sockets inherit it from the listener */
+void busy_poll_socket(int fd)
+{
+    int usecs = poll_usecs, one = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) < 0)
+        log_err("setsockopt(SO_BUSY_POLL), raising it needs CAP_NET_ADMIN");
+    /* Linux 5.11; without it the interrupts only compete with the polling */
+    setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(one));
+}
+
+/* older kernels busy poll epoll sets after the net.core.busy_poll sysctl
+ * only, and fail this with ENOTTY
+ */
+void busy_poll_epoll(int epfd)
+{
+    struct epoll_params params = {
+        .busy_poll_usecs = poll_usecs,
+        .busy_poll_budget = BUSY_POLL_BUDGET,
+        .prefer_busy_poll = 1,
+    };
+    ioctl(epfd, EPIOCSPARAMS, &params);
+}
+
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/* epoll_wait(2) that spins before it blocks. timeout is in milliseconds, as
+ * find_timer() returns it.
+ */
+int busy_poll_wait(int epfd, struct epoll_event *events, int max, int timeout)
+{
+    if (!spin_window)
+        spin_window = spin_min;
+
+    uint64_t start = read_cycles();
+    uint64_t deadline =
+        timeout < 0 ? UINT64_MAX : start + (uint64_t) timeout * cycles_per_ms;
+    for (;;) {
+        int n = epoll_wait(epfd, events, max, 0);
+        if (n != 0)
+            return n;
+        uint64_t now = read_cycles();
+        if (now >= deadline)
+            return 0;
+        if (now - start >= spin_window)
+            break;
+        cpu_relax();
+    }
+
+    /* idle: block for the rest of the timeout */
+    uint64_t blocked = read_cycles();
+    int left = timeout;
+    if (timeout > 0) {
+        uint64_t spun = (blocked - start) / cycles_per_ms;
+        left = spun < (uint64_t) timeout ? timeout - (int) spun : 0;
+    }
+    int n = epoll_wait(epfd, events, max, left);
+
+    /* an event soon after giving up would have been caught spinning longer */
+    uint64_t waited = read_cycles() - blocked;
+    if (n > 0 && waited < spin_window)
+        spin_window = spin_window * 2 < spin_max ? spin_window * 2 : spin_max;
+    else if (spin_window / 2 >= spin_min)
+        spin_window /= 2;
+    return n;
+}
@@ -0,0 +1,21 @@
+#ifndef BUSYPOLL_H
+#define BUSYPOLL_H
+
+#include <stdbool.h>
+#include <sys/epoll.h>
+
+/* Busy polling, with --busy-poll. A worker that would block in epoll_wait
+ * spins on it with a zero timeout instead, for as long as events keep
+ * arriving within the spin window, and the kernel polls the NIC queue of the
+ * sockets (SO_BUSY_POLL, and the epoll parameters where the kernel has them)
+ * rather than waiting for its interrupt. A worker idle for a whole window
+ * blocks as usual; the window grows while events keep turning up right after
+ * it gave up and shrinks back when they do not. It costs a busy core per
+ * worker for lower latency.
+ */
+void busy_poll_init(unsigned usecs);
+void busy_poll_socket(int fd);
+void busy_poll_epoll(int epfd);
+int busy_poll_wait(int epfd, struct epoll_event *events, int max, int timeout);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef CYCLES_H
+#define CYCLES_H
+
+#include <stdint.h>
+#include <time.h>
+
+/* monotonic wall clock in nanoseconds */
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* cheap cycle counter. On x86 this is the TSC, which ticks at a constant
+ * rate on any CPU built in the last decade; other architectures fall back to
+ * their virtual counter or to the monotonic clock.
+ */
+static inline uint64_t read_cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t) hi << 32) | lo;
+#elif defined(__aarch64__)
+    uint64_t val;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(val));
+    return val;
+#else
+    return now_ns();
+#endif
+}
+
+#endif
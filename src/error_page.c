@@ -0,0 +1,178 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for the sake of asprintf(3) */
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "error_page.h"
+#include "logger.h"
+#include "stats.h"
+
+/* custom pages larger than this are not loaded */
+#define ERROR_PAGE_MAX (64 * 1024)
+
+#define DATE_LEN (sizeof("Sun, 06 Nov 1994 08:49:37 GMT") - 1)
+
+static const struct {
+    int status;
+    const char *reason;
+    const char *detail;
+    const char *extra; /* header lines of this status */
+} pages[] = {
+    {400, "Bad Request", "The request is malformed", ""},
+    {403, "Forbidden", "Access to the resource is denied", ""},
+    {404, "Not Found", "Can't find the file", ""},
+    {413, "Payload Too Large", "The request body is too large", ""},
+    {414, "URI Too Long", "The request line is too long", ""},
+    {417, "Expectation Failed", "Unsupported expectation", ""},
+    {431, "Request Header Fields Too Large", "The request header is too long",
+     ""},
+    {500, "Internal Server Error", "The request could not be served", ""},
+    {501, "Not Implemented", "Unsupported transfer coding", ""},
+    {502, "Bad Gateway", "The upstream failed", ""},
+    {503, "Service Unavailable", "The server is overloaded",
+     "Retry-After: 1\r\n"},
+    {504, "Gateway Timeout", "The upstream timed out", ""},
+};
+
+#define NPAGES (sizeof(pages) / sizeof(pages[0]))
+
+/* the response up to the Date value, and what follows it */
+static struct {
+    char *head, *tail;
+    size_t head_len, tail_len;
+} canned[NPAGES];
+
+static __thread char date[DATE_LEN + 1];
+static __thread time_t date_time = -1;
+
+/* the body of DIR/N.html, NULL if there is none */
+static char *load_page(const char *dir, int status, size_t *len)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%d.html", dir, status);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    char *body = NULL;
+    struct stat st;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size > ERROR_PAGE_MAX) {
+        log_err("error_page_init: %s", path);
+    } else if ((body = malloc(st.st_size + 1)) &&
+               read(fd, body, st.st_size) != st.st_size) {
+        log_err("error_page_init: %s", path);
+        free(body);
+        body = NULL;
+    } else if (body) {
+        *len = st.st_size;
+    }
+    close(fd);
+    return body;
+}
+
+/* build every response, with the pages found in dir if it is not NULL */
+bool error_page_init(const char *dir)
+{
+    for (size_t i = 0; i < NPAGES; i++) {
+        size_t body_len = 0;
+        char *body = dir ? load_page(dir, pages[i].status, &body_len) : NULL;
+        const char *type = "text/html";
+        if (!body) {
+            type = "text/html; charset=ISO-8859-1";
+            body_len = asprintf(&body,
+                                "<html><title>Server Error</title>"
+                                "<body>\n%d: %s\n<p>%s\n</p>"
+                                "<hr><em>web server</em>\n</body></html>",
+                                pages[i].status, pages[i].reason,
+                                pages[i].detail);
+            if ((int) body_len < 0)
+                return false;
+        }
+
+        int head_len = asprintf(&canned[i].head,
+                                "HTTP/1.1 %d %s\r\n"
+                                "Server: seHTTPd\r\n"
+                                "Content-type: %s\r\n"
+                                "Connection: close\r\n"
+                                "%s"
+                                "Content-length: %zu\r\n"
+                                "Date: ",
+                                pages[i].status, pages[i].reason, type,
+                                pages[i].extra, body_len);
+        char *tail = malloc(4 + body_len);
+        if (head_len < 0 || !tail) {
+            free(body);
+            return false;
+        }
+        memcpy(tail, "\r\n\r\n", 4);
+        memcpy(tail + 4, body, body_len);
+        canned[i].head_len = head_len;
+        canned[i].tail = tail;
+        canned[i].tail_len = 4 + body_len;
+        free(body);
+    }
+    return true;
+}
+
+/* write the response for status, 500 for one without a page. Returns the
+ * bytes sent, or -1 if the socket did not take it all.
+ */
+ssize_t error_page_send(int fd, int status)
+{
+    size_t i, fallback = 0;
+    for (i = 0; i < NPAGES && pages[i].status != status; i++) {
+        if (pages[i].status == 500)
+            fallback = i;
+    }
+    if (i == NPAGES)
+        i = fallback;
+    if (!canned[i].tail)
+        return -1;
+
+    time_t now = time(NULL);
+    if (now != date_time) {
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        date_time = now;
+    }
+
+    struct iovec iov[3] = {
+        {.iov_base = canned[i].head, .iov_len = canned[i].head_len},
+        {.iov_base = date, .iov_len = DATE_LEN},
+        {.iov_base = canned[i].tail, .iov_len = canned[i].tail_len},
+    };
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 3};
+    size_t sent = 0;
+
+    /* one call unless the socket buffer is short of a large custom page */
+    while (msg.msg_iovlen) {
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        sent += n;
+        while (msg.msg_iovlen && (size_t) n >= msg.msg_iov->iov_len) {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen) {
+            msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+    stats_add(bytes_sent, sent);
+    return msg.msg_iovlen ? -1 : (ssize_t) sent;
+}
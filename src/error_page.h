@@ -0,0 +1,19 @@
+#ifndef ERROR_PAGE_H
+#define ERROR_PAGE_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* Prebuilt error responses.
+ *
+ * Every error status the server answers with has its whole response built
+ * at startup, except for the Date value, which each worker formats once per
+ * second. Sending one is a single sendmsg(2). With --error-pages DIR the
+ * body of status N is DIR/N.html when that file exists, read once at
+ * startup, and the built-in page otherwise. The connection is always closed
+ * after an error.
+ */
+bool error_page_init(const char *dir);
+ssize_t error_page_send(int fd, int status);
+
+#endif
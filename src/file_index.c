@@ -0,0 +1,407 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "file_index.h"
+#include "http.h"
+#include "logger.h"
+
+#define FILE_INDEX_MAX_WORKERS 64
+
+/* descriptors all indexes together keep open, old and new tables during a
+ * refresh included: a quarter of RLIMIT_NOFILE, at most this many. The
+ * current tables take half of it, so the ones a refresh retires fit the other.
+ * Files beyond are served by path.
+ */
+#define FILE_INDEX_MAX_FDS 16384
+
+#define FILE_INDEX_PATH_MAX 4096
+#define FILE_INDEX_WATCH_MASK                                            \
+    (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_FROM | \
+     IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF)
+
+typedef struct {
+    file_entry_t file;
+    char etag[48];
+} file_rec_t;
+
+typedef struct {
+    uint32_t hash;
+    uint32_t file; /* index into files, 0 marks an empty slot */
+    size_t uri_len;
+    char *uri;
+} slot_t;
+
+typedef struct {
+    file_rec_t *files; /* files[0] is unused */
+    size_t nfiles, files_cap;
+    slot_t *keys;
+    size_t nkeys, keys_cap;
+    slot_t *slots;
+    size_t mask;
+    size_t nfds, max_fds; /* descriptors kept open, and allowed */
+} index_table_t;
+
+struct file_index {
+    const char *root;
+    _Atomic(index_table_t *) cur;
+    file_index_t *next;
+};
+
+/* a table replaced by a refresh, with the worker epochs at that moment */
+typedef struct retired {
+    index_table_t *table;
+    uint64_t seen[FILE_INDEX_MAX_WORKERS];
+    struct retired *next;
+} retired_t;
+
+static file_index_t *indexes;
+static int inotify_fd = -1;
+static size_t fd_budget;
+static size_t fds_current; /* held by the current tables */
+
+/* Other workers may be serving from a table while it is replaced. Every
+ * worker bumps its epoch around epoll_wait, odd while waiting, so a retired
+ * table is freed once each worker has waited or gone around since.
+ */
+static _Atomic uint64_t *epochs[FILE_INDEX_MAX_WORKERS];
+static _Atomic int nepochs;
+static __thread _Atomic uint64_t local_epoch;
+static __thread retired_t *retired; /* of the refreshing worker */
+
+static uint32_t hash_uri(const char *uri, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ (uint8_t) uri[i]) * 16777619u;
+    return hash;
+}
+
+static void index_free(index_table_t *idx)
+{
+    if (!idx)
+        return;
+
+    for (size_t i = 1; i < idx->nfiles; i++) {
+        if (idx->files[i].file.fd >= 0)
+            close(idx->files[i].file.fd);
+        free((char *) idx->files[i].file.path);
+    }
+    for (size_t i = 0; i < idx->nkeys; i++)
+        free(idx->keys[i].uri);
+    free(idx->files);
+    free(idx->keys);
+    free(idx->slots);
+    free(idx);
+}
+
+static bool add_key(index_table_t *idx, const char *uri, uint32_t file)
+{
+    if (idx->nkeys == idx->keys_cap) {
+        size_t cap = idx->keys_cap ? idx->keys_cap * 2 : 64;
+        slot_t *keys = realloc(idx->keys, cap * sizeof(slot_t));
+        if (!keys)
+            return false;
+        idx->keys = keys;
+        idx->keys_cap = cap;
+    }
+
+    slot_t *key = &idx->keys[idx->nkeys];
+    key->uri = strdup(uri);
+    if (!key->uri)
+        return false;
+    key->uri_len = strlen(uri);
+    key->hash = hash_uri(uri, key->uri_len);
+    key->file = file;
+    idx->nkeys++;
+    return true;
+}
+
+static uint32_t add_file(index_table_t *idx, const char *path, struct stat *st)
+{
+    if (idx->nfiles == idx->files_cap) {
+        size_t cap = idx->files_cap * 2;
+        file_rec_t *files = realloc(idx->files, cap * sizeof(file_rec_t));
+        if (!files)
+            return 0;
+        idx->files = files;
+        idx->files_cap = cap;
+    }
+
+    file_rec_t *rec = &idx->files[idx->nfiles];
+    memset(&rec->file, 0, sizeof(rec->file));
+    rec->file.path = strdup(path);
+    if (!rec->file.path)
+        return 0;
+    rec->file.fd = -1;
+    if (idx->nfds < idx->max_fds &&
+        (rec->file.fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0)
+        idx->nfds++;
+    rec->file.size = st->st_size;
+    rec->file.mtime = st->st_mtime;
+    rec->file.mime = http_mime_type(path);
+    snprintf(rec->etag, sizeof(rec->etag), "\"%lx-%lx\"",
+             (unsigned long) st->st_mtime, (unsigned long) st->st_size);
+    return idx->nfiles++;
+}
+
+/* index the directory 'path', which is served under 'uri' (ending in '/') */
+static bool walk(index_table_t *idx, char *path, char *uri)
+{
+    DIR *dir = opendir(path);
+    if (!dir)
+        return true; /* unreadable directories are simply not served */
+
+    if (inotify_fd >= 0 &&
+        inotify_add_watch(inotify_fd, path, FILE_INDEX_WATCH_MASK) < 0)
+        log_err("inotify_add_watch: %s", path);
+
+    size_t path_len = strlen(path), uri_len = strlen(uri);
+    bool ok = true;
+    struct dirent *de;
+    while (ok && (de = readdir(dir))) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+
+        size_t name_len = strlen(de->d_name);
+        if (path_len + name_len + 2 >= FILE_INDEX_PATH_MAX ||
+            uri_len + name_len + 2 >= FILE_INDEX_PATH_MAX)
+            continue;
+        sprintf(path + path_len, "/%s", de->d_name);
+        sprintf(uri + uri_len, "%s", de->d_name);
+
+        struct stat st;
+        if (stat(path, &st) < 0) {
+            continue;
+        } else if (S_ISDIR(st.st_mode)) {
+            strcat(uri, "/");
+            ok = walk(idx, path, uri);
+        } else if (S_ISREG(st.st_mode) && (st.st_mode & S_IRUSR) &&
+                   strchr(de->d_name, '.')) {
+            /* do_request appends "/index.html" to names without a dot, so
+             * such files can never be requested
+             */
+            uint32_t file = add_file(idx, path, &st);
+            ok = file && add_key(idx, uri, file);
+
+            if (ok && !strcmp(de->d_name, "index.html")) {
+                uri[uri_len] = '\0';
+                ok = add_key(idx, uri, file);
+                if (ok && uri_len > 1) {
+                    uri[uri_len - 1] = '\0';
+                    ok = add_key(idx, uri, file);
+                    uri[uri_len - 1] = '/';
+                }
+            }
+        }
+
+        path[path_len] = '\0';
+        uri[uri_len] = '\0';
+    }
+
+    closedir(dir);
+    return ok;
+}
+
+/* index root, keeping up to max_fds files open */
+static index_table_t *index_build(const char *root, size_t max_fds)
+{
+    index_table_t *idx = calloc(1, sizeof(index_table_t));
+    char *path = malloc(FILE_INDEX_PATH_MAX);
+    char *uri = malloc(FILE_INDEX_PATH_MAX);
+    if (!idx || !path || !uri)
+        goto fail;
+    idx->max_fds = max_fds;
+
+    idx->files_cap = 64;
+    idx->files = malloc(idx->files_cap * sizeof(file_rec_t));
+    if (!idx->files)
+        goto fail;
+    idx->nfiles = 1;
+
+    snprintf(path, FILE_INDEX_PATH_MAX, "%s", root);
+    strcpy(uri, "/");
+    if (!walk(idx, path, uri))
+        goto fail;
+
+    /* files may have moved while the array grew */
+    for (size_t i = 1; i < idx->nfiles; i++)
+        idx->files[i].file.etag = idx->files[i].etag;
+
+    /* open addressing, kept at most half full */
+    size_t size = 16;
+    while (size < idx->nkeys * 2)
+        size <<= 1;
+    idx->slots = calloc(size, sizeof(slot_t));
+    if (!idx->slots)
+        goto fail;
+    idx->mask = size - 1;
+
+    for (size_t i = 0; i < idx->nkeys; i++) {
+        size_t s = idx->keys[i].hash & idx->mask;
+        while (idx->slots[s].file)
+            s = (s + 1) & idx->mask;
+        idx->slots[s] = idx->keys[i];
+    }
+
+    free(path);
+    free(uri);
+    return idx;
+
+fail:
+    log_err("file_index: failed to index %s", root);
+    free(path);
+    free(uri);
+    index_free(idx);
+    return NULL;
+}
+
+/* called by each worker before it serves, one worker at a time */
+void file_index_register()
+{
+    int n = atomic_load(&nepochs);
+    if (n >= FILE_INDEX_MAX_WORKERS)
+        return;
+    epochs[n] = &local_epoch;
+    atomic_store_explicit(&nepochs, n + 1, memory_order_release);
+}
+
+static void reclaim()
+{
+    int n = atomic_load_explicit(&nepochs, memory_order_acquire);
+    for (retired_t **pp = &retired; *pp;) {
+        retired_t *old = *pp;
+        bool busy = false;
+        for (int w = 0; w < n && !busy; w++) {
+            if (epochs[w] == &local_epoch)
+                continue;
+            uint64_t now = atomic_load(epochs[w]);
+            busy = now == old->seen[w] && !(now & 1);
+        }
+        if (busy) {
+            pp = &old->next;
+            continue;
+        }
+        *pp = old->next;
+        index_free(old->table);
+        free(old);
+    }
+}
+
+void file_index_wait()
+{
+    atomic_fetch_add(&local_epoch, 1);
+}
+
+void file_index_wake()
+{
+    atomic_fetch_add(&local_epoch, 1);
+    if (retired)
+        reclaim();
+}
+
+/* index 'root'. The first index also sets up the inotify descriptor that
+ * every later one shares.
+ */
+file_index_t *file_index_init(const char *root)
+{
+    if (!indexes) {
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_fd < 0)
+            log_err("inotify_init1, the file index will not be refreshed");
+
+        struct rlimit nofile;
+        fd_budget = FILE_INDEX_MAX_FDS;
+        if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 &&
+            nofile.rlim_cur != RLIM_INFINITY &&
+            nofile.rlim_cur / 4 < fd_budget)
+            fd_budget = nofile.rlim_cur / 4;
+    }
+
+    file_index_t *index = calloc(1, sizeof(file_index_t));
+    if (!index)
+        return NULL;
+    index->root = root;
+    index->cur = index_build(root, fd_budget / 2 - fds_current);
+    if (!index->cur) {
+        free(index);
+        return NULL;
+    }
+    fds_current += index->cur->nfds;
+
+    index->next = indexes;
+    indexes = index;
+    return index;
+}
+
+/* the descriptors the indexes may keep open at most, 0 without any index */
+size_t file_index_max_fds()
+{
+    return indexes ? fd_budget : 0;
+}
+
+/* the inotify descriptor to poll, -1 if changes are not tracked */
+int file_index_fd()
+{
+    return inotify_fd;
+}
+
+/* called when inotify_fd is readable: drop the events and rebuild. A burst of
+ * changes arriving together costs a single rebuild of each index.
+ */
+void file_index_refresh()
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (read(inotify_fd, buf, sizeof(buf)) > 0)
+        ;
+
+    int n = atomic_load_explicit(&nepochs, memory_order_acquire);
+    for (file_index_t *index = indexes; index; index = index->next) {
+        /* the new table may take what the one it replaces holds */
+        size_t held = atomic_load(&index->cur)->nfds;
+        index_table_t *idx =
+            index_build(index->root, fd_budget / 2 - (fds_current - held));
+        retired_t *old = malloc(sizeof(retired_t));
+        if (!idx || !old) {
+            index_free(idx);
+            free(old);
+            continue; /* keep serving the old table */
+        }
+
+        fds_current += idx->nfds - held;
+        old->table = atomic_exchange(&index->cur, idx);
+        for (int w = 0; w < n; w++)
+            old->seen[w] = atomic_load(epochs[w]);
+        old->next = retired;
+        retired = old;
+    }
+    reclaim();
+}
+
+const file_entry_t *file_index_lookup(const file_index_t *index,
+                                      const char *uri,
+                                      size_t len)
+{
+    const char *query = memchr(uri, '?', len);
+    if (query)
+        len = query - uri;
+
+    const index_table_t *idx =
+        atomic_load_explicit(&index->cur, memory_order_acquire);
+    uint32_t hash = hash_uri(uri, len);
+    for (size_t s = hash & idx->mask; idx->slots[s].file;
+         s = (s + 1) & idx->mask) {
+        const slot_t *slot = &idx->slots[s];
+        if (slot->hash == hash && slot->uri_len == len &&
+            !memcmp(slot->uri, uri, len))
+            return &idx->files[slot->file].file;
+    }
+    return NULL;
+}
@@ -0,0 +1,53 @@
+#ifndef FILE_INDEX_H
+#define FILE_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* a file that can be served, either looked up in the index or the pack file,
+ * or described by do_request after a stat(2)
+ */
+typedef struct {
+    const char *path; /* on-disk path, opened on demand when fd < 0 */
+    int fd;           /* descriptor kept open by the index, or -1 */
+    size_t size;
+    time_t mtime;
+    const char *mime;
+    const char *etag; /* NULL when unknown */
+
+    /* set for files inside a pack: the body starts at 'offset' in fd and is
+     * mapped at 'data', and 'header' holds its prebuilt header lines
+     */
+    off_t offset;
+    const void *data;
+    const char *header;
+    size_t header_len;
+} file_entry_t;
+
+/* Startup-built index of a webroot.
+ *
+ * Maps every URI the server would resolve to a file (including the "/dir"
+ * and "/dir/" aliases of "dir/index.html") to its metadata, so a request is
+ * a single hash lookup on the raw URI. Each virtual host may have its own
+ * index; all of them are rebuilt whenever inotify reports a change below any
+ * indexed root. Workers call file_index_wait() and file_index_wake() around
+ * epoll_wait, so a replaced table is only freed once no worker can be using
+ * it.
+ */
+typedef struct file_index file_index_t;
+
+file_index_t *file_index_init(const char *root);
+size_t file_index_max_fds();
+int file_index_fd();
+void file_index_refresh();
+void file_index_register();
+void file_index_wait();
+void file_index_wake();
+const file_entry_t *file_index_lookup(const file_index_t *index,
+                                      const char *uri,
+                                      size_t len);
+
+#endif
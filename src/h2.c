@@ -0,0 +1,1247 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for the sake of memmem(3) */
+#endif
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "access_log.h"
+#include "cycles.h"
+#include "h2.h"
+#include "hotset.h"
+#include "hpack.h"
+#include "latency.h"
+#include "logger.h"
+#include "perf_counters.h"
+#include "probe.h"
+#include "proxy.h"
+#include "stats.h"
+#include "timer.h"
+#include "tls.h"
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN (sizeof(H2_PREFACE) - 1)
+
+#define FRAME_HEADER 9
+
+/* SETTINGS_MAX_FRAME_SIZE of both sides; this server never raises it */
+#define FRAME_MAX 16384
+
+/* concurrent streams a client may open */
+#define H2_MAX_STREAMS 100
+
+/* the initial flow control window of connections and streams */
+#define H2_WINDOW 65535
+#define H2_WINDOW_MAX 0x7fffffff
+
+/* DATA frames are queued until this much waits for the socket, and the
+ * connection is dropped if control frames alone pile up beyond H2_OUT_MAX
+ */
+#define H2_OUT_HIGH (64 * 1024)
+#define H2_OUT_MAX (1024 * 1024)
+
+/* longest wait for the client while responses are pending (ms) */
+#define H2_SEND_TIMEOUT 10000
+
+/* the longest path parse_uri() accepts */
+#define H2_PATH_MAX 256
+#define H2_FIELD_MAX 256
+
+/* response header block of one stream, and an error page */
+#define H2_HEADER_MAX 2048
+#define H2_ERROR_MAX 512
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+enum {
+    FRAME_DATA,
+    FRAME_HEADERS,
+    FRAME_PRIORITY,
+    FRAME_RST_STREAM,
+    FRAME_SETTINGS,
+    FRAME_PUSH_PROMISE,
+    FRAME_PING,
+    FRAME_GOAWAY,
+    FRAME_WINDOW_UPDATE,
+    FRAME_CONTINUATION,
+};
+
+enum {
+    FLAG_END_STREAM = 0x1,
+    FLAG_ACK = 0x1,
+    FLAG_END_HEADERS = 0x4,
+    FLAG_PADDED = 0x8,
+    FLAG_PRIORITY = 0x20,
+};
+
+enum {
+    H2_NO_ERROR,
+    H2_PROTOCOL_ERROR,
+    H2_INTERNAL_ERROR,
+    H2_FLOW_CONTROL_ERROR,
+    H2_SETTINGS_TIMEOUT,
+    H2_STREAM_CLOSED,
+    H2_FRAME_SIZE_ERROR,
+    H2_REFUSED_STREAM,
+    H2_CANCEL,
+    H2_COMPRESSION_ERROR,
+    H2_CONNECT_ERROR,
+    H2_ENHANCE_YOUR_CALM,
+};
+
+enum {
+    SETTINGS_HEADER_TABLE_SIZE = 1,
+    SETTINGS_ENABLE_PUSH,
+    SETTINGS_MAX_CONCURRENT_STREAMS,
+    SETTINGS_INITIAL_WINDOW_SIZE,
+    SETTINGS_MAX_FRAME_SIZE,
+    SETTINGS_MAX_HEADER_LIST_SIZE,
+};
+
+typedef struct {
+    uint32_t id;
+    bool responding; /* the request is complete and being answered */
+    bool bad;        /* a pseudo-header was unknown or too long */
+    int method;
+    int64_t window; /* send window */
+    size_t path_len;
+    char path[H2_PATH_MAX + 1]; /* parse_uri() terminates it */
+    size_t authority_len;
+    char authority[H2_FIELD_MAX];
+    char since[H2_FIELD_MAX]; /* If-Modified-Since, NUL terminated */
+
+    /* the response body, in memory or in fd at offset */
+    const char *data;
+    char *owned; /* data, when it belongs to the stream */
+    int fd;
+    off_t offset;
+    size_t left;
+
+    int status;
+    ssize_t sent;
+    uint64_t start_ns;
+    list_head list;
+} h2_stream_t;
+
+typedef struct {
+    http_request_t *r;
+    hpack_table_t hpack;
+    list_head streams; /* the next to send a DATA frame first */
+    unsigned nstreams;
+    uint32_t last_id;       /* highest stream opened by the client */
+    int64_t window;         /* connection send window */
+    int64_t initial_window; /* of new streams */
+    bool preface;           /* the client preface is still due */
+    bool goaway;            /* no new streams, close once they are done */
+    bool closing;           /* after a connection error, flush and close */
+
+    /* a header block being put together from CONTINUATION frames */
+    uint32_t block_id;
+    uint8_t block_flags;
+    size_t block_len;
+    uint8_t block[FRAME_MAX];
+
+    size_t in_len;
+    uint8_t in[FRAME_HEADER + FRAME_MAX];
+
+    /* frames waiting for the socket. The payload of the last one, a DATA
+     * frame of 'file_left' bytes, then follows from file_stream's file.
+     */
+    uint8_t *out;
+    size_t out_off, out_len, out_cap;
+    h2_stream_t *file_stream;
+    size_t file_left;
+} h2_conn_t;
+
+static inline uint32_t get_u32(const uint8_t *p)
+{
+    return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static inline void put_u32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24, p[1] = v >> 16, p[2] = v >> 8, p[3] = v;
+}
+
+/* room for 'len' more bytes of output, NULL if the client does not read */
+static uint8_t *reserve(h2_conn_t *c, size_t len)
+{
+    if (c->out_len + len <= c->out_cap)
+        return c->out + c->out_len;
+
+    if (c->out_off) {
+        memmove(c->out, c->out + c->out_off, c->out_len - c->out_off);
+        c->out_len -= c->out_off;
+        c->out_off = 0;
+        if (c->out_len + len <= c->out_cap)
+            return c->out + c->out_len;
+    }
+
+    size_t cap = c->out_cap ? c->out_cap : H2_OUT_HIGH;
+    while (cap < c->out_len + len)
+        cap *= 2;
+    uint8_t *out = cap <= H2_OUT_MAX ? realloc(c->out, cap) : NULL;
+    if (!out) {
+        c->closing = true;
+        return NULL;
+    }
+    c->out = out;
+    c->out_cap = cap;
+    return c->out + c->out_len;
+}
+
+static void send_frame(h2_conn_t *c,
+                       int type,
+                       int flags,
+                       uint32_t id,
+                       const void *payload,
+                       size_t len)
+{
+    uint8_t *p = reserve(c, FRAME_HEADER + len);
+    if (!p)
+        return;
+
+    p[0] = len >> 16, p[1] = len >> 8, p[2] = len;
+    p[3] = type;
+    p[4] = flags;
+    put_u32(p + 5, id);
+    if (len)
+        memcpy(p + FRAME_HEADER, payload, len);
+    c->out_len += FRAME_HEADER + len;
+}
+
+static void send_goaway(h2_conn_t *c, uint32_t code)
+{
+    uint8_t payload[8];
+    put_u32(payload, c->last_id);
+    put_u32(payload + 4, code);
+    send_frame(c, FRAME_GOAWAY, 0, 0, payload, sizeof(payload));
+    c->goaway = true;
+}
+
+/* the connection is unusable; tell the client and close once flushed */
+static void conn_error(h2_conn_t *c, uint32_t code)
+{
+    if (!c->closing)
+        send_goaway(c, code);
+    c->closing = true;
+}
+
+static void send_rst(h2_conn_t *c, uint32_t id, uint32_t code)
+{
+    uint8_t payload[4];
+    put_u32(payload, code);
+    send_frame(c, FRAME_RST_STREAM, 0, id, payload, sizeof(payload));
+}
+
+static void send_window_update(h2_conn_t *c, uint32_t id, uint32_t inc)
+{
+    uint8_t payload[4];
+    put_u32(payload, inc);
+    send_frame(c, FRAME_WINDOW_UPDATE, 0, id, payload, sizeof(payload));
+}
+
+static h2_stream_t *find_stream(h2_conn_t *c, uint32_t id)
+{
+    list_head *pos;
+    list_for_each (pos, &c->streams) {
+        h2_stream_t *s = list_entry(pos, h2_stream_t, list);
+        if (s->id == id)
+            return s;
+    }
+    return NULL;
+}
+
+static h2_stream_t *new_stream(h2_conn_t *c, uint32_t id)
+{
+    h2_stream_t *s = calloc(1, sizeof(h2_stream_t));
+    if (!s)
+        return NULL;
+    s->id = id;
+    s->method = HTTP_UNKNOWN;
+    s->window = c->initial_window;
+    s->fd = -1;
+    s->start_ns = access_log_enabled ? now_ns() : 0;
+    list_add_tail(&s->list, &c->streams);
+    c->nstreams++;
+    return s;
+}
+
+static void close_stream(h2_conn_t *c, h2_stream_t *s)
+{
+    if (s->responding) {
+        http_request_t *r = c->r;
+        probe_response_done(r->fd, s->status, s->sent);
+        if (access_log_enabled) {
+            r->method = s->method;
+            r->uri_start = s->path;
+            r->uri_end = s->path + s->path_len;
+            access_log_append(r, s->status, s->sent, s->start_ns);
+        }
+    }
+
+    if (s->fd >= 0)
+        close(s->fd);
+    free(s->owned);
+    list_del(&s->list);
+    c->nstreams--;
+    free(s);
+}
+
+static void free_conn(h2_conn_t *c)
+{
+    http_request_t *r = c->r;
+    while (!list_empty(&c->streams))
+        close_stream(c, list_entry(c->streams.next, h2_stream_t, list));
+    hpack_free(&c->hpack);
+    free(c->out);
+    free(c);
+    r->h2 = NULL;
+}
+
+static void close_conn(h2_conn_t *c)
+{
+    http_request_t *r = c->r;
+    free_conn(c);
+    http_close_conn(r);
+}
+
+/* a timer callback: say goodbye to an idle client, or drop a stuck one */
+static int h2_expire(http_request_t *r)
+{
+    h2_conn_t *c = r->h2;
+    if (!c->nstreams && !c->closing) {
+        send_goaway(c, H2_NO_ERROR);
+        ssize_t n UNUSED =
+            write(r->fd, c->out + c->out_off, c->out_len - c->out_off);
+    }
+    close_conn(c);
+    return 0;
+}
+
+/* apply a SETTINGS payload of the client; false on a connection error */
+static bool apply_settings(h2_conn_t *c, const uint8_t *p, size_t len)
+{
+    for (; len >= 6; p += 6, len -= 6) {
+        uint32_t value = get_u32(p + 2);
+        switch (p[0] << 8 | p[1]) {
+        case SETTINGS_ENABLE_PUSH:
+            if (value > 1) {
+                conn_error(c, H2_PROTOCOL_ERROR);
+                return false;
+            }
+            break;
+        case SETTINGS_INITIAL_WINDOW_SIZE: {
+            if (value > H2_WINDOW_MAX) {
+                conn_error(c, H2_FLOW_CONTROL_ERROR);
+                return false;
+            }
+            int64_t delta = (int64_t) value - c->initial_window;
+            list_head *pos;
+            list_for_each (pos, &c->streams)
+                list_entry(pos, h2_stream_t, list)->window += delta;
+            c->initial_window = value;
+            break;
+        }
+        case SETTINGS_MAX_FRAME_SIZE:
+            /* frames are never sent larger than the default anyway */
+            if (value < FRAME_MAX || value > 0xffffff) {
+                conn_error(c, H2_PROTOCOL_ERROR);
+                return false;
+            }
+            break;
+        default:
+            /* the encoder keeps no table, so HEADER_TABLE_SIZE is moot */
+            break;
+        }
+    }
+    return true;
+}
+
+static void send_settings(h2_conn_t *c)
+{
+    uint8_t payload[6] = {0, SETTINGS_MAX_CONCURRENT_STREAMS};
+    put_u32(payload + 2, H2_MAX_STREAMS);
+    send_frame(c, FRAME_SETTINGS, 0, 0, payload, sizeof(payload));
+}
+
+static bool field_is(const char *name,
+                     size_t len,
+                     const char *s,
+                     size_t s_len)
+{
+    return len == s_len && !memcmp(name, s, len);
+}
+
+#define FIELD_IS(name, len, literal) \
+    field_is(name, len, literal, sizeof(literal) - 1)
+
+static bool copy_field(char *dst, size_t size, const char *s, size_t len)
+{
+    if (len >= size)
+        return false;
+    memcpy(dst, s, len);
+    dst[len] = '\0';
+    return true;
+}
+
+/* a request header field; 'arg' is NULL for trailers and refused streams,
+ * which are decoded only to keep the table in step
+ */
+static bool on_field(void *arg,
+                     const char *name,
+                     size_t name_len,
+                     const char *value,
+                     size_t value_len)
+{
+    h2_stream_t *s = arg;
+    if (!s)
+        return true;
+
+    if (FIELD_IS(name, name_len, ":method")) {
+        if (FIELD_IS(value, value_len, "GET"))
+            s->method = HTTP_GET;
+        else if (FIELD_IS(value, value_len, "HEAD"))
+            s->method = HTTP_HEAD;
+        else if (FIELD_IS(value, value_len, "POST"))
+            s->method = HTTP_POST;
+    } else if (FIELD_IS(name, name_len, ":path")) {
+        s->bad |= !copy_field(s->path, sizeof(s->path), value, value_len);
+        s->path_len = value_len;
+    } else if (FIELD_IS(name, name_len, ":authority") ||
+               (FIELD_IS(name, name_len, "host") && !s->authority_len)) {
+        if (copy_field(s->authority, sizeof(s->authority), value, value_len))
+            s->authority_len = value_len;
+    } else if (FIELD_IS(name, name_len, "if-modified-since")) {
+        copy_field(s->since, sizeof(s->since), value, value_len);
+    } else if (name_len && name[0] == ':' &&
+               !FIELD_IS(name, name_len, ":scheme")) {
+        s->bad = true;
+    }
+    return true;
+}
+
+static bool add_field(uint8_t *block,
+                      size_t *len,
+                      int index,
+                      const char *name,
+                      size_t name_len,
+                      const char *value,
+                      size_t value_len)
+{
+    if (*len + name_len + value_len + 12 > H2_HEADER_MAX)
+        return false;
+    *len += hpack_encode_field(block + *len, index, name, name_len, value,
+                               value_len);
+    return true;
+}
+
+/* the header lines a pack file keeps for HTTP/1.1, as HPACK fields */
+static bool add_lines(uint8_t *block,
+                      size_t *len,
+                      const char *lines,
+                      size_t lines_len)
+{
+    const char *p = lines, *end = lines + lines_len;
+    while (p < end) {
+        const char *eol = memmem(p, end - p, "\r\n", 2);
+        const char *colon = memchr(p, ':', (eol ? eol : end) - p);
+        if (!eol || !colon)
+            break;
+
+        char name[64];
+        size_t name_len = colon - p;
+        if (name_len >= sizeof(name))
+            return false;
+        for (size_t i = 0; i < name_len; i++)
+            name[i] = tolower((unsigned char) p[i]);
+
+        const char *value = colon + 1;
+        while (value < eol && *value == ' ')
+            value++;
+        if (!add_field(block, len, hpack_static_name(name, name_len), name,
+                       name_len, value, eol - value))
+            return false;
+        p = eol + 2;
+    }
+    return true;
+}
+
+static size_t format_date(char *buf, size_t size, time_t t)
+{
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    return strftime(buf, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+/* queue the HEADERS frame of a response; the body, if any, follows */
+static void send_headers(h2_conn_t *c,
+                         h2_stream_t *s,
+                         const uint8_t *block,
+                         size_t len)
+{
+    bool body = s->left > 0;
+    int flags = FLAG_END_HEADERS | (body ? 0 : FLAG_END_STREAM);
+    send_frame(c, FRAME_HEADERS, flags, s->id, block, len);
+    s->sent += len;
+    probe_response_start(c->r->fd, s->status);
+    stats_count_status(s->status);
+    if (!body)
+        close_stream(c, s);
+}
+
+/* a response generated here: an error page or the metrics */
+static void send_owned(h2_conn_t *c,
+                       h2_stream_t *s,
+                       int status,
+                       const char *type,
+                       char *body,
+                       size_t body_len)
+{
+    uint8_t block[H2_HEADER_MAX];
+    size_t len = hpack_encode_status(block, status);
+    char value[64];
+    size_t n = snprintf(value, sizeof(value), "%zu", body_len);
+
+    add_field(block, &len, HPACK_CONTENT_TYPE, NULL, 0, type, strlen(type));
+    add_field(block, &len, HPACK_CONTENT_LENGTH, NULL, 0, value, n);
+    add_field(block, &len, HPACK_CACHE_CONTROL, NULL, 0, "no-cache", 8);
+    add_field(block, &len, HPACK_SERVER, NULL, 0, "seHTTPd", 7);
+
+    s->status = status;
+    s->owned = body;
+    s->data = body;
+    s->left = s->method == HTTP_HEAD ? 0 : body_len;
+    send_headers(c, s, block, len);
+}
+
+static void send_error(h2_conn_t *c,
+                       h2_stream_t *s,
+                       int status,
+                       const char *shortmsg,
+                       const char *longmsg)
+{
+    char *body = malloc(H2_ERROR_MAX);
+    if (!body) {
+        send_rst(c, s->id, H2_INTERNAL_ERROR);
+        close_stream(c, s);
+        return;
+    }
+    size_t len = snprintf(body, H2_ERROR_MAX,
+                          "<html><title>Server Error</title>"
+                          "<body>\n%d: %s\n<p>%s\n</p>"
+                          "<hr><em>web server</em>\n</body></html>",
+                          status, shortmsg, longmsg);
+    send_owned(c, s, status, "text/html; charset=ISO-8859-1", body, len);
+}
+
+static void send_stats(h2_conn_t *c, h2_stream_t *s)
+{
+    char *body = malloc(STATS_BUFSIZE);
+    if (!body) {
+        send_rst(c, s->id, H2_INTERNAL_ERROR);
+        close_stream(c, s);
+        return;
+    }
+    size_t len = stats_render(body, STATS_BUFSIZE);
+    len += latency_render(body + len, STATS_BUFSIZE - len);
+    len += perf_render(body + len, STATS_BUFSIZE - len);
+    send_owned(c, s, HTTP_OK, "text/plain; version=0.0.4", body, len);
+}
+
+static void send_file(h2_conn_t *c, h2_stream_t *s, const file_entry_t *file)
+{
+    bool modified = true;
+    if (s->since[0])
+        modified = http_modified_since(file->mtime, s->since);
+    s->status = modified ? HTTP_OK : HTTP_NOT_MODIFIED;
+
+    uint8_t block[H2_HEADER_MAX];
+    size_t len = hpack_encode_status(block, s->status);
+    char value[H2_FIELD_MAX];
+    size_t n;
+    bool ok = true;
+
+    if (modified && file->header) {
+        ok = add_lines(block, &len, file->header, file->header_len);
+    } else if (modified) {
+        n = snprintf(value, sizeof(value), "%s; charset=ISO-8859-1",
+                     file->mime);
+        ok = add_field(block, &len, HPACK_CONTENT_TYPE, NULL, 0, value, n);
+        n = snprintf(value, sizeof(value), "%zu", file->size);
+        ok = ok &&
+             add_field(block, &len, HPACK_CONTENT_LENGTH, NULL, 0, value, n);
+        n = format_date(value, sizeof(value), file->mtime);
+        ok = ok &&
+             add_field(block, &len, HPACK_LAST_MODIFIED, NULL, 0, value, n);
+    }
+    if (ok && file->etag)
+        ok = add_field(block, &len, HPACK_ETAG, NULL, 0, file->etag,
+                       strlen(file->etag));
+    n = format_date(value, sizeof(value), time(NULL));
+    ok = ok && add_field(block, &len, HPACK_DATE, NULL, 0, value, n) &&
+         add_field(block, &len, HPACK_SERVER, NULL, 0, "seHTTPd", 7);
+    if (!ok) {
+        log_err("h2: response header too long");
+        send_rst(c, s->id, H2_INTERNAL_ERROR);
+        close_stream(c, s);
+        return;
+    }
+
+    /* the body is taken now: an index entry may be freed by a refresh while
+     * the stream waits for its window
+     */
+    if (modified && s->method != HTTP_HEAD && file->size) {
+        if (file->data) {
+            s->data = file->data;
+        } else {
+            s->fd = file->fd >= 0 ? dup(file->fd)
+                                  : open(file->path, O_RDONLY | O_CLOEXEC);
+            s->offset = file->offset;
+            if (s->fd < 0) {
+                log_err("h2: open %s", file->path);
+                send_rst(c, s->id, H2_INTERNAL_ERROR);
+                close_stream(c, s);
+                return;
+            }
+        }
+        s->left = file->size;
+    }
+    send_headers(c, s, block, len);
+}
+
+/* answer a complete request, resolved like an HTTP/1.1 one */
+static void respond(h2_conn_t *c, h2_stream_t *s)
+{
+    http_request_t *r = c->r;
+    s->responding = true;
+    probe_request_parsed(r->fd, s->method, s->path, s->path_len);
+
+    /* the last request of a draining server, or over --max-requests */
+    if (http_last_request(r) && !c->goaway)
+        send_goaway(c, H2_NO_ERROR);
+
+    if (s->bad || !s->path_len || s->method == HTTP_UNKNOWN) {
+        stats_inc(parse_errors);
+        send_error(c, s, 400, "Bad Request", "Malformed request");
+        return;
+    }
+
+    if (proxy_match(s->path, s->path_len) >= 0) {
+        send_error(c, s, 421, "Misdirected Request",
+                   "Proxied over HTTP/1.1 only");
+        return;
+    }
+
+    if (stats_match(s->path, s->path_len)) {
+        send_stats(c, s);
+        return;
+    }
+
+    char filename[HTTP_FILENAME_MAX];
+    file_entry_t st_file;
+    const file_entry_t *file;
+    const vhost_t *host =
+        vhost_lookup(s->authority_len ? s->authority : NULL, s->authority_len);
+    int status =
+        http_find_file(host, s->path, s->path_len, filename, &st_file, &file);
+    if (status == HTTP_NOT_FOUND)
+        send_error(c, s, HTTP_NOT_FOUND, "Not Found", "Can't find the file");
+    else if (status == HTTP_FORBIDDEN)
+        send_error(c, s, HTTP_FORBIDDEN, "Forbidden", "Can't read the file");
+    else if (status == HTTP_URI_TOO_LONG)
+        send_error(c, s, HTTP_URI_TOO_LONG, "URI Too Long",
+                   "The request line is too long");
+    else {
+        if (hotset_enabled)
+            hotset_hit(file, s->path, s->path_len);
+        send_file(c, s, file);
+    }
+}
+
+static void on_header_block(h2_conn_t *c)
+{
+    uint32_t id = c->block_id;
+    bool end_stream = c->block_flags & FLAG_END_STREAM;
+    c->block_id = 0;
+
+    h2_stream_t *s = find_stream(c, id);
+    if (s) {
+        /* trailers, which must end the request */
+        if (s->responding || !end_stream) {
+            conn_error(c, H2_PROTOCOL_ERROR);
+            return;
+        }
+        if (!hpack_decode(&c->hpack, c->block, c->block_len, on_field, NULL)) {
+            conn_error(c, H2_COMPRESSION_ERROR);
+            return;
+        }
+        respond(c, s);
+        return;
+    }
+
+    if (!(id & 1) || id <= c->last_id) {
+        conn_error(c, id & 1 ? H2_STREAM_CLOSED : H2_PROTOCOL_ERROR);
+        return;
+    }
+
+    /* after GOAWAY new streams are ignored, beyond the limit refused */
+    bool refused = !c->goaway && c->nstreams >= H2_MAX_STREAMS;
+    if (!c->goaway)
+        c->last_id = id;
+    if (!c->goaway && !refused && !(s = new_stream(c, id)))
+        refused = true;
+
+    if (!hpack_decode(&c->hpack, c->block, c->block_len, on_field, s)) {
+        conn_error(c, H2_COMPRESSION_ERROR);
+        return;
+    }
+    if (refused)
+        send_rst(c, id, H2_REFUSED_STREAM);
+    else if (s && end_stream)
+        respond(c, s);
+}
+
+/* request bodies are not used: the window is handed straight back */
+static void on_data(h2_conn_t *c, uint32_t id, int flags, size_t frame_len)
+{
+    if (frame_len)
+        send_window_update(c, 0, frame_len);
+
+    h2_stream_t *s = find_stream(c, id);
+    if (!s) {
+        if (id > c->last_id)
+            conn_error(c, H2_PROTOCOL_ERROR);
+        return;
+    }
+    if (s->responding) {
+        send_rst(c, id, H2_STREAM_CLOSED);
+        if (s != c->file_stream)
+            close_stream(c, s);
+        else
+            s->left = 0;
+        return;
+    }
+
+    if (flags & FLAG_END_STREAM)
+        respond(c, s);
+    else if (frame_len)
+        send_window_update(c, id, frame_len);
+}
+
+/* strip the padding of DATA and HEADERS; false if it is malformed */
+static bool unpad(int flags, const uint8_t **p, size_t *len)
+{
+    if (!(flags & FLAG_PADDED))
+        return true;
+    if (*len < 1 || **p >= *len)
+        return false;
+    *len -= 1 + **p;
+    (*p)++;
+    return true;
+}
+
+static void on_frame(h2_conn_t *c,
+                     int type,
+                     int flags,
+                     uint32_t id,
+                     const uint8_t *p,
+                     size_t len)
+{
+    size_t frame_len = len;
+
+    /* nothing may come between HEADERS and its CONTINUATION frames */
+    if (c->block_id && type != FRAME_CONTINUATION) {
+        conn_error(c, H2_PROTOCOL_ERROR);
+        return;
+    }
+
+    switch (type) {
+    case FRAME_DATA:
+        if (!id || !unpad(flags, &p, &len)) {
+            conn_error(c, H2_PROTOCOL_ERROR);
+            return;
+        }
+        on_data(c, id, flags, frame_len);
+        break;
+    case FRAME_HEADERS:
+        if (!id || !unpad(flags, &p, &len)) {
+            conn_error(c, H2_PROTOCOL_ERROR);
+            return;
+        }
+        if (flags & FLAG_PRIORITY) {
+            if (len < 5) {
+                conn_error(c, H2_FRAME_SIZE_ERROR);
+                return;
+            }
+            p += 5, len -= 5;
+        }
+        c->block_id = id;
+        c->block_flags = flags;
+        c->block_len = 0;
+        /* fall through */
+    case FRAME_CONTINUATION:
+        if (!c->block_id || id != c->block_id) {
+            conn_error(c, H2_PROTOCOL_ERROR);
+            return;
+        }
+        if (c->block_len + len > sizeof(c->block)) {
+            conn_error(c, H2_ENHANCE_YOUR_CALM);
+            return;
+        }
+        memcpy(c->block + c->block_len, p, len);
+        c->block_len += len;
+        if (flags & FLAG_END_HEADERS)
+            on_header_block(c);
+        break;
+    case FRAME_RST_STREAM: {
+        if (len != 4) {
+            conn_error(c, H2_FRAME_SIZE_ERROR);
+            return;
+        }
+        h2_stream_t *s = find_stream(c, id);
+        if (s && s == c->file_stream)
+            s->left = 0; /* closed once its frame is out */
+        else if (s)
+            close_stream(c, s);
+        break;
+    }
+    case FRAME_SETTINGS:
+        if (id || (flags & FLAG_ACK ? len : len % 6)) {
+            conn_error(c, id ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+            return;
+        }
+        if (!(flags & FLAG_ACK) && apply_settings(c, p, len))
+            send_frame(c, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+        break;
+    case FRAME_PUSH_PROMISE:
+        conn_error(c, H2_PROTOCOL_ERROR);
+        break;
+    case FRAME_PING:
+        if (id || len != 8) {
+            conn_error(c, id ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+            return;
+        }
+        if (!(flags & FLAG_ACK))
+            send_frame(c, FRAME_PING, FLAG_ACK, 0, p, len);
+        break;
+    case FRAME_GOAWAY:
+        /* finish what was asked, then close */
+        c->goaway = true;
+        break;
+    case FRAME_WINDOW_UPDATE: {
+        if (len != 4) {
+            conn_error(c, H2_FRAME_SIZE_ERROR);
+            return;
+        }
+        uint32_t inc = get_u32(p) & H2_WINDOW_MAX;
+        if (!id) {
+            c->window += inc;
+            if (!inc || c->window > H2_WINDOW_MAX)
+                conn_error(c, inc ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR);
+            return;
+        }
+        h2_stream_t *s = find_stream(c, id);
+        if (s && (!inc || s->window + inc > H2_WINDOW_MAX)) {
+            send_rst(c, id, inc ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR);
+            if (s != c->file_stream)
+                close_stream(c, s);
+            else
+                s->left = 0;
+        } else if (s) {
+            s->window += inc;
+        }
+        break;
+    }
+    default:
+        /* PRIORITY is advice, unknown types must be ignored */
+        break;
+    }
+}
+
+/* handle the complete frames read so far */
+static void on_input(h2_conn_t *c)
+{
+    size_t off = 0;
+    if (c->preface) {
+        if (c->in_len < H2_PREFACE_LEN)
+            return;
+        if (memcmp(c->in, H2_PREFACE, H2_PREFACE_LEN)) {
+            conn_error(c, H2_PROTOCOL_ERROR);
+            return;
+        }
+        c->preface = false;
+        off = H2_PREFACE_LEN;
+    }
+
+    while (!c->closing && c->in_len - off >= FRAME_HEADER) {
+        const uint8_t *p = c->in + off;
+        size_t len = p[0] << 16 | p[1] << 8 | p[2];
+        if (len > FRAME_MAX) {
+            conn_error(c, H2_FRAME_SIZE_ERROR);
+            return;
+        }
+        if (c->in_len - off < FRAME_HEADER + len)
+            break;
+        on_frame(c, p[3], p[4], get_u32(p + 5) & H2_WINDOW_MAX,
+                 p + FRAME_HEADER, len);
+        off += FRAME_HEADER + len;
+    }
+
+    memmove(c->in, c->in + off, c->in_len - off);
+    c->in_len -= off;
+}
+
+/* false once the client is gone */
+static bool read_input(h2_conn_t *c)
+{
+    while (!c->closing) {
+        ssize_t n =
+            tls_read(c->r, c->in + c->in_len, sizeof(c->in) - c->in_len);
+        if (n == 0)
+            return false;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN;
+        }
+        c->in_len += n;
+        on_input(c);
+    }
+    return true;
+}
+
+/* queue DATA frames round-robin, one per stream and turn, until the windows
+ * or the buffer run out. A file body ends the batch: its payload is sent by
+ * sendfile(2) after everything queued before it.
+ */
+static void queue_data(h2_conn_t *c)
+{
+    bool progress = true;
+    while (progress && !c->closing && !c->file_stream && c->window > 0 &&
+           c->out_len - c->out_off < H2_OUT_HIGH) {
+        progress = false;
+        for (unsigned i = c->nstreams; i > 0 && !c->file_stream; i--) {
+            h2_stream_t *s = list_entry(c->streams.next, h2_stream_t, list);
+            list_del(&s->list);
+            list_add_tail(&s->list, &c->streams);
+            if (!s->left || s->window <= 0 || c->window <= 0 ||
+                c->out_len - c->out_off >= H2_OUT_HIGH)
+                continue;
+
+            size_t len = MIN(s->left, FRAME_MAX);
+            len = MIN(len, (size_t) MIN(s->window, c->window));
+            bool end = len == s->left;
+            uint8_t *p = reserve(c, FRAME_HEADER + (s->data ? len : 0));
+            if (!p)
+                return;
+
+            p[0] = len >> 16, p[1] = len >> 8, p[2] = len;
+            p[3] = FRAME_DATA;
+            p[4] = end ? FLAG_END_STREAM : 0;
+            put_u32(p + 5, s->id);
+            c->out_len += FRAME_HEADER;
+            if (s->data) {
+                memcpy(p + FRAME_HEADER, s->data, len);
+                s->data += len;
+                c->out_len += len;
+            } else {
+                c->file_stream = s;
+                c->file_left = len;
+            }
+
+            s->left -= len;
+            s->window -= len;
+            c->window -= len;
+            s->sent += FRAME_HEADER + len;
+            progress = true;
+            if (end && s != c->file_stream)
+                close_stream(c, s);
+        }
+    }
+}
+
+/* write as much as the socket takes; false on a write error */
+static bool flush(h2_conn_t *c)
+{
+    int fd = c->r->fd;
+    for (;;) {
+        /* a file payload follows the queued frames without a gap */
+        int flags = MSG_NOSIGNAL | (c->file_stream ? MSG_MORE : 0);
+        while (c->out_off < c->out_len) {
+            ssize_t n =
+                send(fd, c->out + c->out_off, c->out_len - c->out_off, flags);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                return errno == EAGAIN;
+            }
+            c->out_off += n;
+            stats_add(bytes_sent, n);
+        }
+        c->out_off = c->out_len = 0;
+
+        h2_stream_t *s = c->file_stream;
+        while (s && c->file_left) {
+            ssize_t n = sendfile(fd, s->fd, &s->offset, c->file_left);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && errno == EAGAIN)
+                return true;
+            if (n <= 0) /* the frame length is promised already */
+                return false;
+            c->file_left -= n;
+            stats_add(bytes_sent, n);
+        }
+        if (s) {
+            c->file_stream = NULL;
+            if (!s->left)
+                close_stream(c, s);
+        }
+
+        queue_data(c);
+        if (c->out_off == c->out_len && !c->file_stream)
+            return true;
+    }
+}
+
+/* send what can be sent, then wait for the client or close */
+static void progress(h2_conn_t *c)
+{
+    http_request_t *r = c->r;
+    if (!flush(c)) {
+        close_conn(c);
+        return;
+    }
+
+    bool pending = c->out_off < c->out_len || c->file_stream;
+    if (!pending && (c->closing || (c->goaway && !c->nstreams))) {
+        close_conn(c);
+        return;
+    }
+
+    struct epoll_event event = {
+        .data.ptr = r,
+        .events = EPOLLIN | (pending ? EPOLLOUT : 0) | EPOLLET | EPOLLONESHOT,
+    };
+    epoll_ctl(r->epfd, EPOLL_CTL_MOD, r->fd, &event);
+    add_timer(r, c->nstreams || pending ? H2_SEND_TIMEOUT
+                                        : http_keepalive_timeout(),
+              h2_expire);
+}
+
+/* take over a connection whose buffered input starts at r->pos */
+static h2_conn_t *new_conn(http_request_t *r)
+{
+    size_t n = r->last - r->pos;
+    h2_conn_t *c = calloc(1, sizeof(h2_conn_t));
+    if (!c || n > sizeof(c->in)) {
+        free(c);
+        return NULL;
+    }
+
+    /* frames are written whole, Nagle would only hold the last one back */
+    int one = 1;
+    setsockopt(r->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    c->r = r;
+    hpack_init(&c->hpack);
+    INIT_LIST_HEAD(&c->streams);
+    c->window = H2_WINDOW;
+    c->initial_window = H2_WINDOW;
+    c->preface = true;
+    memcpy(c->in, &r->buf[r->pos & (r->buf_size - 1)], n);
+    c->in_len = n;
+    r->pos = r->last;
+    r->h2 = c;
+    return c;
+}
+
+/* 0 when the buffered input is the client preface, EAGAIN while it may
+ * still become it and -1 when it is something else
+ */
+int h2_preface(http_request_t *r)
+{
+    size_t n = MIN(r->last - r->pos, H2_PREFACE_LEN);
+    if (memcmp(&r->buf[r->pos & (r->buf_size - 1)], H2_PREFACE, n))
+        return -1;
+    return n == H2_PREFACE_LEN ? 0 : EAGAIN;
+}
+
+/* a client with prior knowledge */
+void h2_start(http_request_t *r)
+{
+    h2_conn_t *c = new_conn(r);
+    if (!c) {
+        http_close_conn(r);
+        return;
+    }
+
+    send_settings(c);
+    on_input(c);
+    progress(c);
+}
+
+/* the value of HTTP2-Settings, a SETTINGS payload in base64url */
+static bool decode_settings(const char *in,
+                            size_t len,
+                            uint8_t *out,
+                            size_t size,
+                            size_t *n)
+{
+    uint32_t acc = 0;
+    int bits = 0;
+    *n = 0;
+    for (size_t i = 0; i < len && in[i] != '='; i++) {
+        int v;
+        char ch = in[i];
+        if (ch >= 'A' && ch <= 'Z')
+            v = ch - 'A';
+        else if (ch >= 'a' && ch <= 'z')
+            v = ch - 'a' + 26;
+        else if (ch >= '0' && ch <= '9')
+            v = ch - '0' + 52;
+        else if (ch == '-' || ch == '+')
+            v = 62;
+        else if (ch == '_' || ch == '/')
+            v = 63;
+        else
+            return false;
+
+        acc = acc << 6 | v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            if (*n == size)
+                return false;
+            out[(*n)++] = acc >> bits;
+        }
+    }
+    return *n % 6 == 0;
+}
+
+static bool has_token(const char *value, size_t len, const char *token)
+{
+    size_t n = strlen(token);
+    for (const char *p = value, *end = value + len; p + n <= end; p++) {
+        if (!strncasecmp(p, token, n) && (p == value || p[-1] == ' ' ||
+                                          p[-1] == ',') &&
+            (p + n == end || p[n] == ' ' || p[n] == ','))
+            return true;
+    }
+    return false;
+}
+
+/* answer "Upgrade: h2c" with 101 and this request as stream 1. Returns false,
+ * leaving the request alone, if it does not ask for HTTP/2.
+ */
+bool h2_upgrade(http_request_t *r, uint64_t start_ns)
+{
+    /* over TLS, HTTP/2 is chosen by ALPN */
+    if (r->tls || (r->method != HTTP_GET && r->method != HTTP_HEAD))
+        return false;
+
+    const char *upgrade = NULL, *settings = NULL, *host = NULL, *since = NULL;
+    size_t upgrade_len = 0, settings_len = 0, host_len = 0, since_len = 0;
+    int nsettings = 0;
+    list_head *pos;
+    list_for_each (pos, &r->list) {
+        http_header_t *h = list_entry(pos, http_header_t, list);
+        const char *key = h->key_start, *value = h->value_start;
+        size_t key_len = (char *) h->key_end - key;
+        size_t len = (char *) h->value_end - value;
+        if (key_len == 7 && !strncasecmp(key, "Upgrade", 7))
+            upgrade = value, upgrade_len = len;
+        else if (key_len == 14 && !strncasecmp(key, "HTTP2-Settings", 14))
+            settings = value, settings_len = len, nsettings++;
+        else if (key_len == 4 && !strncasecmp(key, "Host", 4))
+            host = value, host_len = len;
+        else if (key_len == 17 && !strncasecmp(key, "If-Modified-Since", 17))
+            since = value, since_len = len;
+    }
+
+    uint8_t payload[96];
+    size_t payload_len;
+    if (!upgrade || !has_token(upgrade, upgrade_len, "h2c") ||
+        nsettings != 1 ||
+        !decode_settings(settings, settings_len, payload, sizeof(payload),
+                         &payload_len))
+        return false;
+
+    h2_stream_t *s = NULL;
+    h2_conn_t *c = new_conn(r);
+    if (c && apply_settings(c, payload, payload_len))
+        s = new_stream(c, 1);
+    if (s) {
+        c->last_id = 1;
+        s->method = r->method;
+        s->start_ns = start_ns;
+        size_t len = (char *) r->uri_end - (char *) r->uri_start;
+        s->bad = !copy_field(s->path, sizeof(s->path), r->uri_start, len);
+        s->path_len = len;
+        if (host && copy_field(s->authority, sizeof(s->authority), host,
+                               host_len))
+            s->authority_len = host_len;
+        if (since)
+            copy_field(s->since, sizeof(s->since), since, since_len);
+    }
+
+    /* the header fields are consumed, as by http_handle_header() */
+    while (!list_empty(&r->list)) {
+        pos = r->list.next;
+        list_del(pos);
+        free(list_entry(pos, http_header_t, list));
+    }
+
+    if (!s) {
+        if (c)
+            free_conn(c);
+        http_close_conn(r);
+        return true;
+    }
+
+    static const char switching[] =
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Connection: Upgrade\r\n"
+        "Upgrade: h2c\r\n\r\n";
+    uint8_t *p = reserve(c, sizeof(switching) - 1);
+    if (p) {
+        memcpy(p, switching, sizeof(switching) - 1);
+        c->out_len += sizeof(switching) - 1;
+    }
+    send_settings(c);
+    respond(c, s);
+    on_input(c);
+    progress(c);
+    return true;
+}
+
+void h2_event(http_request_t *r, uint32_t events)
+{
+    h2_conn_t *c = r->h2;
+    del_timer(r);
+
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        close_conn(c);
+        return;
+    }
+    if ((events & EPOLLIN) && !read_input(c)) {
+        close_conn(c);
+        return;
+    }
+    progress(c);
+}
@@ -0,0 +1,25 @@
+#ifndef H2_H
+#define H2_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "http.h"
+
+/* HTTP/2 over cleartext TCP.
+ *
+ * A connection becomes HTTP/2 when it opens with the client preface (prior
+ * knowledge) or when an HTTP/1.1 GET or HEAD asks for "Upgrade: h2c"; that
+ * request is answered as stream 1. Requests are resolved like HTTP/1.1 ones,
+ * through the pack file, the file indexes or the webroot. Responses of all
+ * streams are sent round-robin, one DATA frame at a time within the flow
+ * control windows, with file bodies moved by sendfile(2). Request bodies are
+ * read and discarded. Paths served by the reverse proxy get 421, so clients
+ * retry them over HTTP/1.1.
+ */
+int h2_preface(http_request_t *r);
+void h2_start(http_request_t *r);
+bool h2_upgrade(http_request_t *r, uint64_t start_ns);
+void h2_event(http_request_t *r, uint32_t events);
+
+#endif
@@ -0,0 +1,287 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for the sake of strndup(3) */
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cycles.h"
+#include "hotset.h"
+#include "logger.h"
+#include "pack.h"
+
+/* slots of a table, a power of 2; keys beyond 3/4 of them are not counted */
+#define HOTSET_SLOTS 2048
+#define HOTSET_FILL (HOTSET_SLOTS / 4 * 3)
+
+/* files written out, the hottest first */
+#define HOTSET_KEEP 1024
+
+/* how often the workers add up their counts (ms) */
+#define HOTSET_INTERVAL 60000
+
+typedef struct {
+    uint64_t hits;
+    uint32_t hash;
+    bool pack;
+    char *key; /* NULL for a free slot */
+} hot_entry_t;
+
+typedef struct {
+    hot_entry_t slot[HOTSET_SLOTS];
+    unsigned used;
+} hot_table_t;
+
+bool hotset_enabled = false;
+
+static const char *save_path;
+static pthread_mutex_t merged_lock = PTHREAD_MUTEX_INITIALIZER;
+static hot_table_t merged;
+
+static __thread hot_table_t *local;
+static __thread uint64_t next_tick_ns;
+
+static uint32_t hash_key(const char *key, size_t len)
+{
+    uint32_t h = 2166136261u; /* FNV-1a */
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (uint8_t) key[i]) * 16777619u;
+    return h;
+}
+
+static hot_entry_t *find(hot_table_t *t,
+                         uint32_t hash,
+                         bool pack,
+                         const char *key,
+                         size_t len)
+{
+    for (size_t i = hash;; i++) {
+        hot_entry_t *e = &t->slot[i & (HOTSET_SLOTS - 1)];
+        if (!e->key) {
+            if (t->used >= HOTSET_FILL || !(e->key = strndup(key, len)))
+                return NULL;
+            e->hits = 0;
+            e->hash = hash;
+            e->pack = pack;
+            t->used++;
+            return e;
+        }
+        if (e->hash == hash && e->pack == pack && !strncmp(e->key, key, len) &&
+            !e->key[len])
+            return e;
+    }
+}
+
+/* the files most requested before are read ahead, at most half of the free
+ * memory of them
+ */
+static void *warm_up(void *arg)
+{
+    FILE *f = arg;
+    uint64_t budget = (uint64_t) sysconf(_SC_AVPHYS_PAGES) *
+                      sysconf(_SC_PAGESIZE) / 2;
+    uint64_t bytes = 0;
+    unsigned files = 0;
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    char line[1024];
+    while (bytes < budget && fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = '\0';
+        char *kind = strchr(line, '\t');
+        char *key = kind ? strchr(kind + 1, '\t') : NULL;
+        if (!key)
+            continue;
+        *key++ = '\0';
+        kind++;
+
+        if (!strcmp(kind, "pack")) {
+            file_entry_t e;
+            if (!pack_lookup(key, strlen(key), &e))
+                continue;
+            uintptr_t start = (uintptr_t) e.data & ~(page - 1);
+            madvise((void *) start, (uintptr_t) e.data + e.size - start,
+                    MADV_WILLNEED);
+            bytes += e.size;
+        } else {
+            struct stat st;
+            int fd = open(key, O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+                continue;
+            if (!fstat(fd, &st) && S_ISREG(st.st_mode)) {
+                posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+                bytes += st.st_size;
+            }
+            close(fd);
+        }
+        files++;
+    }
+    fclose(f);
+
+    printf("Hot set: read ahead %u files, %" PRIu64 " bytes.\n", files, bytes);
+    fflush(stdout);
+    return NULL;
+}
+
+/* count hits from now on and write them to path; what path holds from an
+ * earlier run is read ahead in the background
+ */
+bool hotset_open(const char *path)
+{
+    save_path = path;
+    hotset_enabled = true;
+
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        if (errno != ENOENT)
+            log_err("hotset_open: %s", path);
+        return true;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, warm_up, f)) {
+        log_err("hotset_open: pthread_create");
+        fclose(f);
+        return true;
+    }
+    pthread_detach(thread);
+    return true;
+}
+
+/* called by every worker before it serves */
+void hotset_register()
+{
+    if (!hotset_enabled)
+        return;
+    local = calloc(1, sizeof(hot_table_t));
+    if (!local)
+        log_err("hotset_register: calloc");
+    next_tick_ns = now_ns() + HOTSET_INTERVAL * 1000000ULL;
+}
+
+/* a response with file, requested as uri */
+void hotset_hit(const file_entry_t *file, const char *uri, size_t len)
+{
+    if (!local)
+        return;
+
+    /* a pack entry is found by its URI, anything else by its path */
+    bool pack = !file->path;
+    const char *key = file->path;
+    if (pack) {
+        const char *query = memchr(uri, '?', len);
+        key = uri;
+        if (query)
+            len = query - uri;
+    } else {
+        len = strlen(key);
+    }
+
+    hot_entry_t *e = find(local, hash_key(key, len), pack, key, len);
+    if (e)
+        e->hits++;
+}
+
+/* add the calling worker's counts to the shared table */
+void hotset_merge()
+{
+    if (!local)
+        return;
+
+    pthread_mutex_lock(&merged_lock);
+    for (size_t i = 0; i < HOTSET_SLOTS; i++) {
+        hot_entry_t *e = &local->slot[i];
+        if (!e->key)
+            continue;
+        hot_entry_t *m =
+            find(&merged, e->hash, e->pack, e->key, strlen(e->key));
+        if (m)
+            m->hits += e->hits;
+        free(e->key);
+    }
+    pthread_mutex_unlock(&merged_lock);
+    memset(local, 0, sizeof(hot_table_t));
+}
+
+static int by_hits(const void *a, const void *b)
+{
+    const hot_entry_t *x = *(hot_entry_t *const *) a;
+    const hot_entry_t *y = *(hot_entry_t *const *) b;
+    return x->hits < y->hits ? 1 : x->hits > y->hits ? -1 : 0;
+}
+
+/* write the hottest files out, then halve the counts */
+void hotset_save()
+{
+    if (!hotset_enabled)
+        return;
+
+    static hot_entry_t *sorted[HOTSET_SLOTS];
+    static hot_table_t decayed;
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", save_path);
+
+    pthread_mutex_lock(&merged_lock);
+    size_t n = 0;
+    for (size_t i = 0; i < HOTSET_SLOTS; i++) {
+        if (merged.slot[i].key)
+            sorted[n++] = &merged.slot[i];
+    }
+    qsort(sorted, n, sizeof(sorted[0]), by_hits);
+
+    FILE *f = fopen(tmp, "w");
+    if (f) {
+        for (size_t i = 0; i < n && i < HOTSET_KEEP; i++)
+            fprintf(f, "%" PRIu64 "\t%s\t%s\n", sorted[i]->hits,
+                    sorted[i]->pack ? "pack" : "file", sorted[i]->key);
+        if (fclose(f) || rename(tmp, save_path))
+            log_err("hotset_save: %s", save_path);
+    } else {
+        log_err("hotset_save: %s", tmp);
+    }
+
+    /* the keys move to the new table, the forgotten ones are freed */
+    memset(&decayed, 0, sizeof(decayed));
+    for (size_t i = 0; i < n; i++) {
+        hot_entry_t *e = sorted[i];
+        if (e->hits / 2 == 0 || decayed.used >= HOTSET_FILL) {
+            free(e->key);
+            continue;
+        }
+        size_t j = e->hash;
+        while (decayed.slot[j & (HOTSET_SLOTS - 1)].key)
+            j++;
+        decayed.slot[j & (HOTSET_SLOTS - 1)] = *e;
+        decayed.slot[j & (HOTSET_SLOTS - 1)].hits /= 2;
+        decayed.used++;
+    }
+    merged = decayed;
+    pthread_mutex_unlock(&merged_lock);
+}
+
+/* merge, and save with save, once an interval has passed. Returns the
+ * milliseconds until the next time, -1 without a hot set.
+ */
+int hotset_tick(bool save)
+{
+    if (!local)
+        return -1;
+
+    uint64_t now = now_ns();
+    if (now >= next_tick_ns) {
+        hotset_merge();
+        if (save)
+            hotset_save();
+        next_tick_ns = now + HOTSET_INTERVAL * 1000000ULL;
+    }
+    return (next_tick_ns - now) / 1000000 + 1;
+}
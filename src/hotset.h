@@ -0,0 +1,28 @@
+#ifndef HOTSET_H
+#define HOTSET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "file_index.h"
+
+/* The hot set: the files served most, kept across restarts.
+ *
+ * Every worker counts the hits of the files it serves in a table of its own
+ * and adds it to a shared one once a minute. The first worker then writes
+ * the most requested files out, one "hits<TAB>kind<TAB>key" line each, with
+ * kind "file" for a path on disk and "pack" for a URI of the pack file, and
+ * halves the counts so that the set follows the traffic. On startup a
+ * background thread reads the set back and has the kernel read those files
+ * into the page cache while the server already accepts.
+ */
+bool hotset_open(const char *path);
+void hotset_register();
+void hotset_hit(const file_entry_t *file, const char *uri, size_t len);
+int hotset_tick(bool save);
+void hotset_merge();
+void hotset_save();
+
+extern bool hotset_enabled;
+
+#endif
@@ -0,0 +1,407 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "hpack.h"
+
+struct hpack_field {
+    size_t name_len, value_len;
+    char data[]; /* name, then value */
+};
+
+typedef struct {
+    const char *name, *value;
+} static_field_t;
+
+/* RFC 7541 Appendix A, index 0 is unused */
+static const static_field_t static_table[] = {
+    {"", ""},
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+#define STATIC_ENTRIES (sizeof(static_table) / sizeof(static_table[0]) - 1)
+
+/* The Huffman code of Appendix B is canonical: codes of one length are
+ * consecutive and ordered by symbol. So the number of codes per length and
+ * the symbols sorted by code length are enough to decode it.
+ */
+static const uint8_t huff_count[31] = {
+    0, 0, 0, 0, 0,  10, 26, 32, 6,  0, 5,  3,  2,  6, 2, 3,
+    0, 0, 0, 3, 8,  13, 26, 29, 12, 4, 15, 19, 29, 0, 4,
+};
+static const uint16_t huff_sym[257] = {
+    48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37,
+    45, 46, 47, 51, 52, 53, 54, 55, 56, 57, 61, 65,
+    95, 98, 100, 102, 103, 104, 108, 109, 110, 112, 114, 117,
+    58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+    77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89,
+    106, 107, 113, 118, 119, 120, 121, 122, 38, 42, 44, 59,
+    88, 90, 33, 34, 40, 41, 63, 39, 43, 124, 35, 62,
+    0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+    195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161,
+    167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230, 129,
+    132, 133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170,
+    173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+    233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150,
+    151, 152, 155, 157, 158, 165, 166, 168, 174, 175, 180, 182,
+    183, 188, 191, 197, 231, 239, 9, 142, 144, 145, 148, 159,
+    171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+    200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243,
+    255, 203, 204, 211, 212, 214, 221, 222, 223, 241, 244, 245,
+    246, 247, 248, 250, 251, 252, 253, 254, 2, 3, 4, 5,
+    6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+    21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220,
+    249, 10, 13, 22, 256,
+};
+
+#define HUFF_EOS 256
+
+void hpack_init(hpack_table_t *t)
+{
+    memset(t, 0, sizeof(hpack_table_t));
+    t->max_size = HPACK_TABLE_SIZE;
+}
+
+static hpack_field_t *nth_field(const hpack_table_t *t, unsigned i)
+{
+    return t->fields[(t->first + i) & (HPACK_MAX_ENTRIES - 1)];
+}
+
+static void evict(hpack_table_t *t, size_t max_size)
+{
+    while (t->count && t->size > max_size) {
+        hpack_field_t *f = nth_field(t, --t->count);
+        t->size -= f->name_len + f->value_len + 32;
+        free(f);
+    }
+}
+
+void hpack_free(hpack_table_t *t)
+{
+    evict(t, 0);
+}
+
+/* an integer with an N-bit prefix; false if truncated or too large */
+static bool decode_int(const uint8_t **p,
+                       const uint8_t *end,
+                       int prefix,
+                       uint32_t *value)
+{
+    uint32_t mask = (1u << prefix) - 1;
+    *value = **p & mask;
+    (*p)++;
+    if (*value < mask)
+        return true;
+
+    for (int shift = 0; shift <= 21; shift += 7) {
+        if (*p == end)
+            return false;
+        uint8_t b = *(*p)++;
+        *value += (uint32_t) (b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+static bool huff_decode(const uint8_t *in, size_t len, char *out, size_t *n)
+{
+    uint32_t code = 0;
+    int bits = 0, first = 0, index = 0;
+    *n = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        for (int b = 7; b >= 0; b--) {
+            code = (code << 1) | ((in[i] >> b) & 1);
+            bits++;
+            int count = huff_count[bits];
+            if ((int) code - first < count) {
+                int sym = huff_sym[index + code - first];
+                if (sym == HUFF_EOS)
+                    return false;
+                out[(*n)++] = sym;
+                code = 0, bits = 0, first = 0, index = 0;
+                continue;
+            }
+            if (bits == 30)
+                return false;
+            index += count;
+            first = (first + count) << 1;
+        }
+    }
+
+    /* padding is at most 7 bits of the EOS code, all ones */
+    return bits <= 7 && code == (1u << bits) - 1;
+}
+
+/* a string literal, Huffman decoded into 'scratch' when needed */
+static bool decode_string(const uint8_t **p,
+                          const uint8_t *end,
+                          char **scratch,
+                          const char **s,
+                          size_t *len)
+{
+    if (*p == end)
+        return false;
+    bool huffman = **p & 0x80;
+    uint32_t n;
+    if (!decode_int(p, end, 7, &n) || n > (size_t) (end - *p))
+        return false;
+
+    if (!huffman) {
+        *s = (const char *) *p;
+        *len = n;
+    } else {
+        if (!huff_decode(*p, n, *scratch, len))
+            return false;
+        *s = *scratch;
+        *scratch += *len;
+    }
+    *p += n;
+    return true;
+}
+
+static bool lookup(const hpack_table_t *t,
+                   uint32_t index,
+                   const char **name,
+                   size_t *name_len,
+                   const char **value,
+                   size_t *value_len)
+{
+    if (index == 0)
+        return false;
+    if (index <= STATIC_ENTRIES) {
+        *name = static_table[index].name;
+        *name_len = strlen(*name);
+        *value = static_table[index].value;
+        *value_len = strlen(*value);
+        return true;
+    }
+
+    index -= STATIC_ENTRIES + 1;
+    if (index >= t->count)
+        return false;
+    hpack_field_t *f = nth_field(t, index);
+    *name = f->data;
+    *name_len = f->name_len;
+    *value = f->data + f->name_len;
+    *value_len = f->value_len;
+    return true;
+}
+
+/* add a field, or empty the table if it is larger than all of it. Returns
+ * the field, owned by the table unless it did not fit.
+ */
+static hpack_field_t *insert(hpack_table_t *t,
+                             const char *name,
+                             size_t name_len,
+                             const char *value,
+                             size_t value_len,
+                             bool *owned)
+{
+    hpack_field_t *f = malloc(sizeof(hpack_field_t) + name_len + value_len);
+    if (!f)
+        return NULL;
+    f->name_len = name_len;
+    f->value_len = value_len;
+    memcpy(f->data, name, name_len);
+    memcpy(f->data + name_len, value, value_len);
+
+    size_t size = name_len + value_len + 32;
+    if (size > t->max_size) {
+        evict(t, 0);
+        *owned = false;
+        return f;
+    }
+
+    evict(t, t->max_size - size);
+    t->first = (t->first - 1) & (HPACK_MAX_ENTRIES - 1);
+    t->fields[t->first] = f;
+    t->count++;
+    t->size += size;
+    *owned = true;
+    return f;
+}
+
+bool hpack_decode(hpack_table_t *t,
+                  const uint8_t *in,
+                  size_t len,
+                  hpack_field_cb cb,
+                  void *arg)
+{
+    /* Huffman codes are at least 5 bits long. Each field is handed to 'cb'
+     * before the next one reuses the space.
+     */
+    char *scratch_base = malloc(len * 8 / 5 + 1);
+    if (!scratch_base)
+        return false;
+
+    const uint8_t *p = in, *end = in + len;
+    bool fields_seen = false, ok = true;
+    while (ok && p < end) {
+        char *scratch = scratch_base;
+        const char *name, *value;
+        size_t name_len, value_len;
+        uint32_t index;
+
+        if (*p & 0x80) { /* indexed field */
+            ok = decode_int(&p, end, 7, &index) &&
+                 lookup(t, index, &name, &name_len, &value, &value_len) &&
+                 cb(arg, name, name_len, value, value_len);
+        } else if ((*p & 0xe0) == 0x20) { /* dynamic table size update */
+            ok = !fields_seen && decode_int(&p, end, 5, &index) &&
+                 index <= HPACK_TABLE_SIZE;
+            if (ok) {
+                t->max_size = index;
+                evict(t, index);
+            }
+            continue;
+        } else { /* literal, with incremental indexing or not */
+            bool indexing = *p & 0x40;
+            ok = decode_int(&p, end, indexing ? 6 : 4, &index);
+            if (ok && index)
+                ok = lookup(t, index, &name, &name_len, &value, &value_len);
+            else if (ok)
+                ok = decode_string(&p, end, &scratch, &name, &name_len);
+            ok = ok && decode_string(&p, end, &scratch, &value, &value_len);
+            if (ok && indexing) {
+                bool owned;
+                hpack_field_t *f =
+                    insert(t, name, name_len, value, value_len, &owned);
+                ok = f && cb(arg, f->data, name_len, f->data + name_len,
+                             value_len);
+                if (f && !owned)
+                    free(f);
+            } else if (ok) {
+                ok = cb(arg, name, name_len, value, value_len);
+            }
+        }
+        fields_seen = true;
+    }
+
+    free(scratch_base);
+    return ok;
+}
+
+/* the static index of a lower-case field name, 0 if there is none */
+int hpack_static_name(const char *name, size_t len)
+{
+    for (size_t i = 1; i <= STATIC_ENTRIES; i++) {
+        if (!strncmp(static_table[i].name, name, len) &&
+            !static_table[i].name[len])
+            return i;
+    }
+    return 0;
+}
+
+static size_t encode_int(uint8_t *out, uint8_t bits, int prefix, size_t value)
+{
+    size_t mask = (1u << prefix) - 1, n = 0;
+    if (value < mask) {
+        out[n++] = bits | value;
+        return n;
+    }
+
+    out[n++] = bits | mask;
+    for (value -= mask; value >= 0x80; value >>= 7)
+        out[n++] = (value & 0x7f) | 0x80;
+    out[n++] = value;
+    return n;
+}
+
+size_t hpack_encode_status(uint8_t *out, int status)
+{
+    if (status == 200)
+        return encode_int(out, 0x80, 7, HPACK_STATUS_200);
+    if (status == 304)
+        return encode_int(out, 0x80, 7, HPACK_STATUS_304);
+    if (status == 404)
+        return encode_int(out, 0x80, 7, HPACK_STATUS_404);
+
+    char value[4];
+    value[0] = '0' + status / 100 % 10;
+    value[1] = '0' + status / 10 % 10;
+    value[2] = '0' + status % 10;
+    return hpack_encode_field(out, HPACK_STATUS_200, NULL, 0, value, 3);
+}
+
+/* a literal without indexing, named by a static 'index' or by 'name' when
+ * it is 0. 'out' needs room for both strings and 12 more bytes.
+ */
+size_t hpack_encode_field(uint8_t *out,
+                          int index,
+                          const char *name,
+                          size_t name_len,
+                          const char *value,
+                          size_t value_len)
+{
+    size_t n = encode_int(out, 0x00, 4, index);
+    if (!index) {
+        n += encode_int(out + n, 0x00, 7, name_len);
+        memcpy(out + n, name, name_len);
+        n += name_len;
+    }
+    n += encode_int(out + n, 0x00, 7, value_len);
+    memcpy(out + n, value, value_len);
+    return n + value_len;
+}
@@ -0,0 +1,67 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* the dynamic table size this server announces, the protocol default */
+#define HPACK_TABLE_SIZE 4096
+
+/* every entry costs at least 32 bytes */
+#define HPACK_MAX_ENTRIES (HPACK_TABLE_SIZE / 32)
+
+/* static table indexes of the response fields this server sends */
+enum {
+    HPACK_STATUS_200 = 8,
+    HPACK_STATUS_304 = 11,
+    HPACK_STATUS_404 = 13,
+    HPACK_CACHE_CONTROL = 24,
+    HPACK_CONTENT_LENGTH = 28,
+    HPACK_CONTENT_TYPE = 31,
+    HPACK_DATE = 33,
+    HPACK_ETAG = 34,
+    HPACK_LAST_MODIFIED = 44,
+    HPACK_SERVER = 54,
+};
+
+typedef struct hpack_field hpack_field_t;
+
+/* the decoding context of one connection */
+typedef struct {
+    hpack_field_t *fields[HPACK_MAX_ENTRIES]; /* ring, newest at 'first' */
+    unsigned first, count;
+    size_t size, max_size;
+} hpack_table_t;
+
+typedef bool (*hpack_field_cb)(void *arg,
+                               const char *name,
+                               size_t name_len,
+                               const char *value,
+                               size_t value_len);
+
+/* HPACK header compression (RFC 7541).
+ *
+ * The decoder keeps the dynamic table the client builds and hands every
+ * decoded field to a callback; it fails on anything malformed, which is a
+ * connection error. The encoder only emits literals without indexing, so
+ * responses never depend on encoder state.
+ */
+void hpack_init(hpack_table_t *t);
+void hpack_free(hpack_table_t *t);
+bool hpack_decode(hpack_table_t *t,
+                  const uint8_t *in,
+                  size_t len,
+                  hpack_field_cb cb,
+                  void *arg);
+
+int hpack_static_name(const char *name, size_t len);
+size_t hpack_encode_status(uint8_t *out, int status);
+size_t hpack_encode_field(uint8_t *out,
+                          int index,
+                          const char *name,
+                          size_t name_len,
+                          const char *value,
+                          size_t value_len);
+
+#endif
@@ -1,3 +1,7 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for the sake of mkostemp(3) and pipe2(2) */
+#endif
+
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -6,19 +10,42 @@
 #include <sys/epoll.h>
 #include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include "access_log.h"
+#include "cycles.h"
+#include "error_page.h"
+#include "file_index.h"
+#include "h2.h"
+#include "hotset.h"
 #include "http.h"
+#include "latency.h"
 #include "logger.h"
+#include "pack.h"
+#include "perf_counters.h"
+#include "probe.h"
+#include "proxy.h"
+#include "stats.h"
 #include "timer.h"
+#include "tls.h"
+#include "vhost.h"
+#include "zerocopy.h"
 
 #define MAXLINE 8192
 #define SHORTLINE 512
 
+/* packed bodies up to this size go out in the same writev as the header */
+#define PACK_INLINE_MAX (64 * 1024)
+
 #ifndef MIN
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #endif
 
+/* what one connection may take from a wakeup before the others get a turn */
+#define FAIR_REQUESTS 16
+#define FAIR_BYTES (256 * 1024)
+
 static ssize_t writen(int fd, void *usrbuf, size_t n)
 {
     ssize_t nwritten;
@@ -36,28 +63,49 @@ static ssize_t writen(int fd, void *usrbuf, size_t n)
         bufp += nwritten;
     }
 
+    stats_add(bytes_sent, n);
     return n;
 }
 
-static char *webroot = NULL;
+/* writen for a header and body kept in separate buffers, in one syscall when
+ * the socket takes it all
+ */
+static ssize_t writen2(int fd,
+                       const void *a,
+                       size_t alen,
+                       const void *b,
+                       size_t blen)
+{
+    struct iovec iov[2] = {
+        {.iov_base = (void *) a, .iov_len = alen},
+        {.iov_base = (void *) b, .iov_len = blen},
+    };
+
+    ssize_t nwritten;
+    while ((nwritten = writev(fd, iov, 2)) < 0 && errno == EINTR)
+        ;
+    if (nwritten < 0) {
+        log_err("errno == %d\n", errno);
+        return -1;
+    }
+    stats_add(bytes_sent, nwritten);
 
-typedef struct {
-    const char *type;
-    const char *value;
-} mime_type_t;
-
-static mime_type_t mime[] = {{".html", "text/html"},
-                             {".xml", "text/xml"},
-                             {".xhtml", "application/xhtml+xml"},
-                             {".txt", "text/plain"},
-                             {".pdf", "application/pdf"},
-                             {".png", "image/png"},
-                             {".gif", "image/gif"},
-                             {".jpg", "image/jpeg"},
-                             {".css", "text/css"},
-                             {NULL, "text/plain"}};
-
-static void parse_uri(char *uri, int uri_length, char *filename)
+    size_t done = nwritten;
+    if (done < alen) {
+        if (writen(fd, (char *) a + done, alen - done) < 0)
+            return -1;
+        done = alen;
+    }
+    if (done < alen + blen &&
+        writen(fd, (char *) b + (done - alen), alen + blen - done) < 0)
+        return -1;
+    return alen + blen;
+}
+
+static __thread char *webroot = NULL;
+
+/* build the file name of uri in filename, false if it does not fit */
+static bool parse_uri(char *uri, int uri_length, char *filename)
 {
     assert(uri && "parse_uri: uri is NULL");
     uri[uri_length] = '\0';
@@ -76,10 +124,12 @@ static void parse_uri(char *uri, int uri_length, char *filename)
         debug("file_length = uri_length = %d", file_length);
     }
 
-    /* uri_length can not be too long */
-    if (uri_length > (SHORTLINE >> 1)) {
+    /* uri_length can not be too long, nor the root and uri together */
+    if (uri_length > (SHORTLINE >> 1) ||
+        strlen(webroot) + file_length + sizeof("/index.html") >
+            HTTP_FILENAME_MAX) {
         log_err("uri too long: %.*s", uri_length, uri);
-        return;
+        return false;
     }
 
     strcpy(filename, webroot);
@@ -96,55 +146,27 @@ static void parse_uri(char *uri, int uri_length, char *filename)
         strcat(filename, "index.html");
 
     debug("served filename = %s", filename);
+    return true;
 }
 
-static void do_error(int fd,
-                     char *cause,
-                     char *errnum,
-                     char *shortmsg,
-                     char *longmsg)
+static ssize_t do_error(int fd, int status)
 {
-    char header[MAXLINE], body[MAXLINE];
-    char buf[SHORTLINE];
-    time_t date;
-    struct tm tm;
-    time(&date);
-    localtime_r(&date, &tm);
-    strftime(buf, SHORTLINE, "%a, %d %b %Y %H:%M:%S GMT", &tm);
-
-    sprintf(body,
-            "<html><title>Server Error</title>"
-            "<body>\n%s: %s\n<p>%s: %s\n</p>"
-            "<hr><em>web server</em>\n</body></html>",
-            errnum, shortmsg, longmsg, cause);
-
-    sprintf(header,
-            "HTTP/1.1 %s %s\r\n"
-            "Server: seHTTPd\r\n"
-            "Content-type: text/html; charset=ISO-8859-1\r\n"
-            "Connection: close\r\n"
-            "Content-length: %d\r\n"
-            "Date: %s\r\n"
-            "Last-Modified: %s\r\n\r\n",
-            errnum, shortmsg, (int) strlen(body), buf, buf);
-
-    writen(fd, header, strlen(header));
-    writen(fd, body, strlen(body));
+    probe_response_start(fd, status);
+    stats_count_status(status);
+    ssize_t n = error_page_send(fd, status);
+    probe_response_done(fd, status, n);
+    return n;
 }
 
-static const char *get_file_type(const char *type)
+/* an error page for handlers living outside this file */
+ssize_t http_send_error(int fd, int status)
 {
-    if (!type)
-        return "text/plain";
-
-    int i;
-    for (i = 0; mime[i].type; ++i) {
-        if (!strcmp(type, mime[i].type))
-            return mime[i].value;
-    }
-    return mime[i].value;
+    return do_error(fd, status);
 }
 
+static bool use_pack = false;
+static size_t zerocopy_threshold = 0; /* 0 disables MSG_ZEROCOPY */
+
 static const char *get_msg_from_status(int status_code)
 {
     if (status_code == HTTP_OK)
@@ -159,15 +181,59 @@ static const char *get_msg_from_status(int status_code)
     return "Unknown";
 }
 
-static void serve_static(int fd,
-                         char *filename,
-                         size_t filesize,
-                         http_out_t *out)
+/* the part of a response body the socket did not take at once, sent as it
+ * drains. A file is sent from a descriptor of its own, as an index refresh may
+ * close the shared one meanwhile.
+ */
+typedef struct {
+    const char *data; /* a zerocopy body in memory, or NULL for fd */
+    int fd;
+    off_t offset;
+    size_t left;
+    bool keep_alive;
+} body_rest_t;
+
+void http_body_rest_abort(http_request_t *r)
 {
-    char header[MAXLINE];
+    body_rest_t *b = r->body_rest;
+    if (b->fd >= 0)
+        close(b->fd);
+    free(b);
+    r->body_rest = NULL;
+}
+
+/* keep the rest of a body for EPOLLOUT, false if the connection has to be
+ * closed instead
+ */
+static bool body_rest_keep(http_request_t *r,
+                           const char *data,
+                           int fd,
+                           off_t offset,
+                           size_t left)
+{
+    body_rest_t *b = malloc(sizeof(body_rest_t));
+    if (!b)
+        return false;
+    *b = (body_rest_t){.data = data, .fd = -1, .offset = offset, .left = left};
+    if (!data && (b->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0) {
+        free(b);
+        return false;
+    }
+    r->body_rest = b;
+    return true;
+}
 
-    const char *dot_pos = strrchr(filename, '.');
-    const char *file_type = get_file_type(dot_pos);
+static ssize_t serve_static(http_request_t *r,
+                            const file_entry_t *file,
+                            http_out_t *out)
+{
+    int fd = r->fd;
+    bool zerocopy = zerocopy_threshold && file->data &&
+                    file->size >= zerocopy_threshold;
+
+    probe_response_start(fd, out->status);
+    latency_begin(t_header);
+    char header[MAXLINE];
 
     sprintf(header, "HTTP/1.1 %d %s\r\n", out->status,
             get_msg_from_status(out->status));
@@ -178,48 +244,254 @@ static void serve_static(int fd,
         len += snprintf(header + len, MAXLINE - len,
                         "Connection: keep-alive\r\n"
                         "Keep-Alive: timeout=%d\r\n",
-                        TIMEOUT_DEFAULT);
+                        (http_keepalive_timeout() + 999) / 1000);
+    } else {
+        /* HTTP/1.1 clients, and those of a draining server, must not reuse
+         * the connection
+         */
+        len += snprintf(header + len, MAXLINE - len, "Connection: close\r\n");
     }
 
-    if (out->modified) {
+    if (out->modified && file->header) {
+        if (file->header_len >= MAXLINE - len - SHORTLINE) {
+            log_err("packed header too long");
+            return -1;
+        }
+        memcpy(header + len, file->header, file->header_len);
+        len += file->header_len;
+    } else if (out->modified) {
         char buf[SHORTLINE];
 
         len += snprintf(header + len, MAXLINE - len,
                         "Content-type: %s; charset=ISO-8859-1\r\n"
                         "Content-length: %zu\r\n",
-                        file_type, filesize);
+                        file->mime, file->size);
 
         struct tm tm;
-        localtime_r(&(out->mtime), &tm);
+        gmtime_r(&(out->mtime), &tm);
         strftime(buf, SHORTLINE, "%a, %d %b %Y %H:%M:%S GMT", &tm);
 
         len +=
             snprintf(header + len, MAXLINE - len, "Last-Modified: %s\r\n", buf);
     }
+    if (file->etag)
+        len += snprintf(header + len, MAXLINE - len, "ETag: %s\r\n",
+                        file->etag);
     time_t date;
     struct tm tm;
     char buf[SHORTLINE];
     time(&date);
-    localtime_r(&date, &tm);
+    gmtime_r(&date, &tm);
     strftime(buf, SHORTLINE, "%a, %d %b %Y %H:%M:%S GMT", &tm);
     len += snprintf(header + len, MAXLINE - len, "Date: %s\r\n", buf);
 
     len += snprintf(header + len, MAXLINE - len, "Server: seHTTPd\r\n\r\n");
+    latency_end(header, t_header);
+
+    if (out->modified && file->data && file->size <= PACK_INLINE_MAX &&
+        !zerocopy) {
+        stats_count_status(out->status);
+        latency_begin(t_write);
+        ssize_t n = writen2(fd, header, len, file->data, file->size);
+        latency_end(write, t_write);
+        probe_response_done(fd, out->status, n);
+        return n;
+    }
 
-    size_t n = (size_t) writen(fd, header, strlen(header));
+    latency_begin(t_write);
+    size_t n = (size_t) writen(fd, header, len);
+    latency_end(write, t_write);
     assert(n == len && "writen error");
     if (n != len) {
         log_err("n != strlen(header)");
-        return;
+        return -1;
     }
 
-    if (!out->modified)
-        return;
+    stats_count_status(out->status);
+    if (!out->modified) {
+        probe_response_done(fd, out->status, n);
+        return n;
+    }
+
+    if (zerocopy) {
+        latency_begin(t_sendfile);
+        size_t sent = zerocopy_send(r, file->data, file->size);
+        latency_end(sendfile, t_sendfile);
+        if (sent < file->size &&
+            (errno != EAGAIN ||
+             !body_rest_keep(r, file->data + sent, -1, 0, file->size - sent)))
+            out->keep_alive = false;
+        n += r->body_rest ? file->size : sent;
+        probe_response_done(fd, out->status, n);
+        return n;
+    }
 
-    int srcfd = open(filename, O_RDONLY, 0);
+    latency_begin(t_sendfile);
+    int srcfd = file->fd >= 0 ? file->fd : open(file->path, O_RDONLY, 0);
     assert(srcfd > 2 && "open error");
-    sendfile(fd, srcfd, NULL, filesize);
-    close(srcfd);
+
+    /* an explicit offset leaves the position of a shared descriptor alone */
+    off_t offset = file->offset;
+    ssize_t sent = sendfile(fd, srcfd, &offset, file->size);
+    if (sent > 0)
+        stats_add(bytes_sent, sent);
+    if (sent < 0 && errno == EAGAIN)
+        sent = 0;
+    if (sent < 0)
+        out->keep_alive = false;
+    else if ((size_t) sent < file->size &&
+             !body_rest_keep(r, NULL, srcfd, offset, file->size - sent))
+        out->keep_alive = false;
+    if (srcfd != file->fd)
+        close(srcfd);
+    latency_end(sendfile, t_sendfile);
+    n += r->body_rest ? file->size : (size_t) (sent > 0 ? sent : 0);
+    probe_response_done(fd, out->status, n);
+    return n;
+}
+
+static ssize_t serve_stats(int fd, http_out_t *out)
+{
+    char header[SHORTLINE];
+    char *body = malloc(STATS_BUFSIZE);
+    if (!body) {
+        log_err("no enough space for stats");
+        return -1;
+    }
+
+    size_t body_len = stats_render(body, STATS_BUFSIZE);
+    body_len += latency_render(body + body_len, STATS_BUFSIZE - body_len);
+    body_len += perf_render(body + body_len, STATS_BUFSIZE - body_len);
+
+    int len = snprintf(header, SHORTLINE,
+                       "HTTP/1.1 200 OK\r\n"
+                       "Content-type: text/plain; version=0.0.4\r\n"
+                       "Content-length: %zu\r\n"
+                       "Cache-Control: no-cache\r\n"
+                       "Connection: %s\r\n"
+                       "Server: seHTTPd\r\n\r\n",
+                       body_len, out->keep_alive ? "keep-alive" : "close");
+
+    probe_response_start(fd, HTTP_OK);
+    stats_count_status(HTTP_OK);
+    ssize_t n = writen(fd, header, len);
+    if (n >= 0)
+        n += writen(fd, body, body_len);
+    probe_response_done(fd, HTTP_OK, n);
+    free(body);
+    return n;
+}
+
+/* paths found missing, remembered for NEGATIVE_TTL seconds so that a client
+ * asking for them again and again costs no stat(2)
+ */
+#define NEGATIVE_SLOTS 1024 /* a power of 2 */
+#define NEGATIVE_TTL 2
+
+typedef struct {
+    uint32_t hash;
+    time_t expires;
+    char *path; /* NULL for a free slot */
+} negative_entry_t;
+
+static __thread negative_entry_t *negative;
+
+static uint32_t hash_path(const char *path)
+{
+    uint32_t h = 2166136261u; /* FNV-1a */
+    while (*path)
+        h = (h ^ (uint8_t) *path++) * 16777619u;
+    return h;
+}
+
+static bool negative_lookup(const char *path, uint32_t hash)
+{
+    if (!negative)
+        return false;
+    const negative_entry_t *e = &negative[hash & (NEGATIVE_SLOTS - 1)];
+    return e->path && e->hash == hash && e->expires > time(NULL) &&
+           !strcmp(e->path, path);
+}
+
+/* a slot holds the path that missed last, older ones are overwritten */
+static void negative_add(const char *path, uint32_t hash)
+{
+    if (!negative && !(negative = calloc(NEGATIVE_SLOTS, sizeof(*negative))))
+        return;
+    negative_entry_t *e = &negative[hash & (NEGATIVE_SLOTS - 1)];
+    char *copy = strdup(path);
+    if (!copy)
+        return;
+    free(e->path);
+    *e = (negative_entry_t){
+        .hash = hash,
+        .expires = time(NULL) + NEGATIVE_TTL,
+        .path = copy,
+    };
+}
+
+/* resolve a request URI to a file of 'host'. With the pack file or a file
+ * index this is a single lookup, otherwise the path is built under the host's
+ * root, stat'ed and described in *st_file.
+ */
+int http_find_file(const vhost_t *host,
+                   char *uri,
+                   size_t uri_len,
+                   char *filename,
+                   file_entry_t *st_file,
+                   const file_entry_t **file)
+{
+    if (use_pack && uri_len > 0) {
+        *filename = '\0';
+        *file = st_file;
+        return pack_lookup(uri, uri_len, st_file) ? HTTP_OK : HTTP_NOT_FOUND;
+    }
+
+    if (host->index && uri_len > 0) {
+        *filename = '\0';
+        *file = file_index_lookup(host->index, uri, uri_len);
+        return *file ? HTTP_OK : HTTP_NOT_FOUND;
+    }
+
+    webroot = host->root;
+    if (!parse_uri(uri, uri_len, filename))
+        return HTTP_URI_TOO_LONG;
+
+    uint32_t hash = hash_path(filename);
+    if (negative_lookup(filename, hash))
+        return HTTP_NOT_FOUND;
+
+    struct stat sbuf;
+    if (stat(filename, &sbuf) < 0) {
+        if (errno == ENOENT || errno == ENOTDIR)
+            negative_add(filename, hash);
+        return HTTP_NOT_FOUND;
+    }
+
+    if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode))
+        return HTTP_FORBIDDEN;
+
+    *st_file = (file_entry_t){
+        .path = filename,
+        .fd = -1,
+        .size = sbuf.st_size,
+        .mtime = sbuf.st_mtime,
+        .mime = http_mime_type(filename),
+        .etag = NULL,
+    };
+    *file = st_file;
+    return HTTP_OK;
+}
+
+void http_use_pack(bool enable)
+{
+    use_pack = enable;
+}
+
+/* send in-memory bodies of at least 'threshold' bytes with MSG_ZEROCOPY */
+void http_use_zerocopy(size_t threshold)
+{
+    zerocopy_threshold = threshold;
 }
 
 static inline int init_http_out(http_out_t *o, int fd)
@@ -231,58 +503,387 @@ static inline int init_http_out(http_out_t *o, int fd)
     return 0;
 }
 
+/* answer a request that is not served; its connection is closed after */
+static void refuse(http_request_t *r, int status, uint64_t start_ns)
+{
+    ssize_t sent = do_error(r->fd, status);
+    if (access_log_enabled)
+        access_log_append(r, status, sent, start_ns);
+}
+
+static const char *upload_dir = NULL;
+
+/* store the bodies of POST requests in files below dir */
+void http_use_uploads(const char *dir)
+{
+    upload_dir = dir;
+}
+
+typedef struct {
+    int fd; /* the temporary file, renamed once the body is complete */
+    int pipe[2];
+    size_t piped;
+    bool keep_alive;
+    uint64_t start_ns;
+    char tmp[HTTP_FILENAME_MAX];
+    char path[HTTP_FILENAME_MAX];
+} upload_t;
+
+void http_upload_abort(http_request_t *r)
+{
+    upload_t *u = r->upload;
+    unlink(u->tmp);
+    close(u->fd);
+    close(u->pipe[0]);
+    close(u->pipe[1]);
+    free(u);
+    r->upload = NULL;
+}
+
+/* the path below --upload-dir a POST to uri is stored at, and the hidden
+ * file next to it the body is written to first. Returns 0 or an error status.
+ */
+static int upload_paths(upload_t *u, const char *uri, size_t len)
+{
+    const char *query = memchr(uri, '?', len);
+    if (query)
+        len = query - uri;
+    size_t dir_len = strlen(upload_dir);
+    if (len < 2 || uri[len - 1] == '/' || memchr(uri, '\0', len) ||
+        dir_len + len + sizeof(".XXXXXX") + 1 > HTTP_FILENAME_MAX)
+        return 403;
+
+    memcpy(u->path, upload_dir, dir_len);
+    memcpy(u->path + dir_len, uri, len);
+    u->path[dir_len + len] = '\0';
+
+    /* nothing outside the directory */
+    const char *name = u->path + dir_len;
+    if (strstr(name, "/../") || (len >= 3 && !strcmp(name + len - 3, "/..")))
+        return 403;
+
+    const char *base = strrchr(name, '/') + 1;
+    snprintf(u->tmp, sizeof(u->tmp), "%.*s.%s.XXXXXX",
+             (int) (base - u->path), u->path, base);
+    return 0;
+}
+
+/* set up the file the body of r goes to. Returns 0 or an error status. */
+static int upload_start(http_request_t *r, uint64_t start_ns)
+{
+    upload_t *u = malloc(sizeof(upload_t));
+    if (!u)
+        return 500;
+
+    int status = upload_paths(u, r->uri_start,
+                              (char *) r->uri_end - (char *) r->uri_start);
+    if (!status && (u->fd = mkostemp(u->tmp, O_CLOEXEC)) < 0)
+        status = errno == ENOENT ? 404 : 403;
+    if (!status)
+        fchmod(u->fd, 0644); /* mkostemp creates it private */
+    if (!status && pipe2(u->pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+        unlink(u->tmp);
+        close(u->fd);
+        status = 500;
+    }
+    if (status) {
+        free(u);
+        return status;
+    }
+
+    http_out_t out;
+    init_http_out(&out, r->fd);
+    http_handle_header(r, &out);
+    u->keep_alive = out.keep_alive;
+    u->piped = 0;
+    u->start_ns = start_ns;
+    r->upload = u;
+
+    http_body_continue(r);
+    return 0;
+}
+
+/* move what arrived of the body to the file; once it is all there, put the
+ * file in place and answer 201. Returns 0 to go on with the connection,
+ * EAGAIN to wait for the client and -1 to close.
+ */
+static int upload_resume(http_request_t *r)
+{
+    upload_t *u = r->upload;
+    int rc = http_body_pump(r, u->fd, u->pipe, &u->piped, false);
+    if (rc == EAGAIN)
+        return EAGAIN;
+
+    int status = 201;
+    if (rc != 0)
+        status = errno == EFBIG ? 413 : errno == EINVAL ? 400 : 0;
+    else if (rename(u->tmp, u->path) < 0)
+        status = 500;
+
+    uint64_t start_ns = u->start_ns;
+    bool keep_alive = u->keep_alive && status == 201;
+    http_upload_abort(r);
+    if (status != 201) {
+        if (status)
+            refuse(r, status, start_ns);
+        return -1;
+    }
+
+    char header[SHORTLINE];
+    int len = snprintf(header, SHORTLINE,
+                       "HTTP/1.1 201 Created\r\n"
+                       "Content-length: 0\r\n"
+                       "Connection: %s\r\n"
+                       "Server: seHTTPd\r\n\r\n",
+                       keep_alive ? "keep-alive" : "close");
+    probe_response_start(r->fd, 201);
+    stats_count_status(201);
+    ssize_t sent = writen(r->fd, header, len);
+    probe_response_done(r->fd, 201, sent);
+    if (access_log_enabled)
+        access_log_append(r, 201, sent, start_ns);
+    return keep_alive && sent == len ? 0 : -1;
+}
+
+/* read past the body of a request answered without it */
+static int discard_body(http_request_t *r)
+{
+    size_t piped = 0;
+    int rc = http_body_pump(r, -1, NULL, &piped, false);
+    return rc == 0 || rc == EAGAIN ? rc : -1;
+}
+
+/* send what is left of a response body. Returns 0 once it is out, EAGAIN
+ * to wait for room and -1 to close.
+ */
+static int body_rest_send(http_request_t *r)
+{
+    body_rest_t *b = r->body_rest;
+    while (b->left > 0) {
+        if (b->data) {
+            /* it returns short only where send() failed */
+            size_t n = zerocopy_send(r, b->data, b->left);
+            b->data += n;
+            b->left -= n;
+            if (b->left > 0)
+                return errno == EAGAIN ? EAGAIN : -1;
+            continue;
+        }
+
+        ssize_t n = sendfile(r->fd, b->fd, &b->offset, b->left);
+        if (n > 0) {
+            stats_add(bytes_sent, n);
+            b->left -= n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            return EAGAIN;
+        /* an error, or a file that shrank meanwhile */
+        return -1;
+    }
+
+    bool keep_alive = b->keep_alive;
+    http_body_rest_abort(r);
+    return keep_alive ? 0 : -1;
+}
+
+/* connections that used up their share and still have work, in the order
+ * they yielded
+ */
+static __thread list_head yielded;
+
+/* have r served again before the worker waits for events. Its timer must
+ * have been deleted; the heap frees it meanwhile.
+ */
+void http_requeue(http_request_t *r)
+{
+    if (!yielded.next)
+        INIT_LIST_HEAD(&yielded);
+    list_add_tail(&r->run, &yielded);
+    r->timer = NULL;
+}
+
+static void yield(http_request_t *r)
+{
+    http_requeue(r);
+    stats_inc(yields);
+}
+
+bool http_yielded()
+{
+    return yielded.next && !list_empty(&yielded);
+}
+
+/* give every connection that yielded before now one more turn */
+void http_run_yielded()
+{
+    if (!http_yielded())
+        return;
+
+    list_head round;
+    list_add(&round, &yielded);
+    list_del(&yielded);
+    INIT_LIST_HEAD(&yielded);
+    while (!list_empty(&round)) {
+        http_request_t *r = list_entry(round.next, http_request_t, run);
+        list_del(&r->run);
+        perf_begin(t_perf);
+        do_request(r);
+        perf_end(t_perf);
+    }
+}
+
 void do_request(void *ptr)
 {
-    /* check whether MAX_BUF is a power of 2 in compile time */
-    _Static_assert(!(MAX_BUF & (MAX_BUF - 1)),
-                   "Problems may occure since MAX_BUF is not a power of 2");
     http_request_t *r = ptr;
     int fd = r->fd;
     int rc;
-    char filename[SHORTLINE];
-    webroot = r->root;
-
-    del_timer(r);
+    char filename[HTTP_FILENAME_MAX];
+    /* bytes left by the last pass may hold a whole pipelined request */
+    bool need_input = r->pos == r->last;
+    unsigned served = 0;
+    size_t moved = 0, sent_before = stats_local.bytes_sent;
+
+    /* a connection resumed from the yield queue has no timer */
+    if (r->timer)
+        del_timer(r);
     for (;;) {
-        char *plast = &r->buf[r->last & (MAX_BUF - 1)];
-        size_t remain_size = MIN(MAX_BUF - (r->last - r->pos) - 1,
-                                 MAX_BUF - (r->last & (MAX_BUF - 1)));
+        /* a pipelining or downloading client must not hold up the others */
+        if (served >= FAIR_REQUESTS ||
+            moved + (stats_local.bytes_sent - sent_before) >= FAIR_BYTES) {
+            yield(r);
+            return;
+        }
 
-        int n = read(fd, plast, remain_size);
-        assert(r->last - r->pos < MAX_BUF && "request buffer overflow!");
+        /* the rest of the last response goes out before anything else */
+        if (r->body_rest) {
+            rc = body_rest_send(r);
+            if (rc == EAGAIN)
+                break;
+            if (rc != 0)
+                goto close;
+            need_input = r->pos == r->last;
+            continue;
+        }
 
-        if (n == 0) /* EOF */
-            goto err;
+        /* the body of a request comes before the next request */
+        if (r->body_state || r->upload) {
+            rc = r->upload ? upload_resume(r) : discard_body(r);
+            if (rc == EAGAIN)
+                break;
+            if (rc != 0)
+                goto close;
+            need_input = r->pos == r->last;
+            continue;
+        }
+
+        if (need_input) {
+            /* the part of a request already parsed is pointed into */
+            size_t size = r->buf_size;
+            size_t keep = r->in_headers || r->state ? r->request_pos : r->pos;
+            char *plast = &r->buf[r->last & (size - 1)];
+            size_t remain_size = size - (r->last - keep) - 1;
+
+            /* the request does not fit the buffer */
+            if (!remain_size) {
+                stats_inc(parse_errors);
+                do_error(fd, r->in_headers ? 431 : 414);
+                goto close;
+            }
+
+            int n = tls_read(r, plast, remain_size);
+            assert(r->last - r->pos < size && "request buffer overflow!");
 
-        if (n < 0) {
-            if (errno != EAGAIN) {
-                log_err("read err, and errno = %d", errno);
+            if (n == 0) /* EOF */
                 goto err;
+
+            if (n < 0) {
+                if (errno != EAGAIN) {
+                    log_err("read err, and errno = %d", errno);
+                    goto err;
+                }
+                break;
             }
-            break;
-        }
 
-        r->last += n;
-        assert(r->last - r->pos < MAX_BUF && "request buffer overflow!");
+            r->last += n;
+            moved += n;
+            assert(r->last - r->pos < size && "request buffer overflow!");
+        }
+        need_input = true;
 
         /* about to parse request line */
-        rc = http_parse_request_line(r);
+        uint64_t start_ns = access_log_enabled ? now_ns() : 0;
+        latency_begin(t_request);
+        latency_begin(t_parse);
+
+        /* the request line may have been parsed by an earlier pass that
+         * stopped within the headers
+         */
+        if (!r->in_headers) {
+            /* a client with prior knowledge opens with the HTTP/2 preface */
+            if (r->pos == 0 && r->state == 0) {
+                rc = h2_preface(r);
+                if (rc == EAGAIN)
+                    continue;
+                if (rc == 0) {
+                    h2_start(r);
+                    return;
+                }
+            }
+
+            rc = http_parse_request_line(r);
+            if (rc == EAGAIN)
+                continue;
+            if (rc != 0) {
+                log_err("rc != 0");
+                stats_inc(parse_errors);
+                goto err;
+            }
+            r->in_headers = true;
+
+            debug("uri = %.*s", (int) (r->uri_end - r->uri_start),
+                  (char *) r->uri_start);
+        }
+
+        rc = http_parse_request_body(r);
         if (rc == EAGAIN)
             continue;
         if (rc != 0) {
             log_err("rc != 0");
+            stats_inc(parse_errors);
             goto err;
         }
+        r->in_headers = false;
+        latency_end(parse, t_parse);
+        probe_request_parsed(fd, r->method, r->uri_start,
+                             (char *) r->uri_end - (char *) r->uri_start);
+
+        rc = http_body_init(r);
+        if (rc) {
+            refuse(r, rc, start_ns);
+            goto close;
+        }
 
-        debug("uri = %.*s", (int) (r->uri_end - r->uri_start),
-              (char *) r->uri_start);
+        int route = proxy_match(r->uri_start, r->uri_end - r->uri_start);
+        if (route >= 0) {
+            /* the proxy owns the connection until the response is relayed */
+            proxy_start(r, route, start_ns);
+            return;
+        }
 
-        rc = http_parse_request_body(r);
-        if (rc == EAGAIN)
+        /* "Upgrade: h2c" switches the connection, this is stream 1 */
+        if (!r->body_state && h2_upgrade(r, start_ns))
+            return;
+
+        if (upload_dir && r->method == HTTP_POST && r->body_state) {
+            rc = upload_start(r, start_ns);
+            if (rc) {
+                refuse(r, rc, start_ns);
+                goto close;
+            }
             continue;
-        if (rc != 0) {
-            log_err("rc != 0");
-            goto err;
         }
 
         /* handle http header */
@@ -294,20 +895,38 @@ void do_request(void *ptr)
 
         init_http_out(out, fd);
 
-        parse_uri(r->uri_start, r->uri_end - r->uri_start, filename);
-
-        struct stat sbuf;
-        if (stat(filename, &sbuf) < 0) {
-            do_error(fd, filename, "404", "Not Found", "Can't find the file");
-            goto close;
+        if (stats_match(r->uri_start, r->uri_end - r->uri_start)) {
+            http_handle_header(r, out);
+            ssize_t sent = serve_stats(fd, out);
+            if (access_log_enabled)
+                access_log_append(r, HTTP_OK, sent, start_ns);
+            if (!out->keep_alive) {
+                free(out);
+                goto close;
+            }
+            free(out);
+            need_input = r->pos == r->last;
+            served++;
+            continue;
         }
 
-        if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-            do_error(fd, filename, "403", "Forbidden", "Can't read the file");
+        latency_begin(t_stat);
+        file_entry_t st_file;
+        const file_entry_t *file;
+        const vhost_t *host = http_find_host(r);
+        int status = http_find_file(host, r->uri_start,
+                                    (char *) r->uri_end - (char *) r->uri_start,
+                                    filename, &st_file, &file);
+        latency_end(stat, t_stat);
+
+        if (status != HTTP_OK) {
+            ssize_t sent = do_error(fd, status);
+            if (access_log_enabled)
+                access_log_append(r, status, sent, start_ns);
             goto close;
         }
 
-        out->mtime = sbuf.st_mtime;
+        out->mtime = file->mtime;
 
         http_handle_header(r, out);
         assert(list_empty(&(r->list)) && "header list should be empty");
@@ -315,23 +934,46 @@ void do_request(void *ptr)
         if (!out->status)
             out->status = HTTP_OK;
 
-        serve_static(fd, filename, sbuf.st_size, out);
+        ssize_t sent = serve_static(r, file, out);
+        latency_end(request, t_request);
+        if (hotset_enabled && out->status == HTTP_OK)
+            hotset_hit(file, r->uri_start,
+                       (char *) r->uri_end - (char *) r->uri_start);
+        if (access_log_enabled)
+            access_log_append(r, out->status, sent, start_ns);
+
+        /* the connection stays open for the rest of the body */
+        if (r->body_rest) {
+            ((body_rest_t *) r->body_rest)->keep_alive = out->keep_alive;
+            free(out);
+            served++;
+            continue;
+        }
 
-        if (!out->keep_alive) {
+        /* after a failed write the client cannot find the next response */
+        if (!out->keep_alive || sent < 0) {
             debug("no keep_alive! ready to close");
             free(out);
             goto close;
         }
         free(out);
+        need_input = r->pos == r->last;
+        served++;
     }
 
     struct epoll_event event = {
         .data.ptr = ptr,
-        .events = EPOLLIN | EPOLLET | EPOLLONESHOT,
+        .events =
+            (r->body_rest ? EPOLLOUT : EPOLLIN) | EPOLLET | EPOLLONESHOT,
     };
     epoll_ctl(r->epfd, EPOLL_CTL_MOD, r->fd, &event);
 
-    add_timer(r, TIMEOUT_DEFAULT, http_close_conn);
+    /* only a connection between requests may be closed to make room */
+    if (r->pos == r->last && !r->in_headers && !r->state && !r->body_rest &&
+        !r->body_state && !r->upload)
+        add_idle_timer(r, http_keepalive_timeout(), http_close_conn);
+    else
+        add_timer(r, http_keepalive_timeout(), http_close_conn);
     return;
 
 err:
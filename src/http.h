@@ -3,9 +3,13 @@
 
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
 #include <time.h>
 
 #include "list.h"
+#include "vhost.h"
 
 enum http_parser_retcode {
     HTTP_PARSER_INVALID_METHOD = 10,
@@ -23,21 +27,32 @@ enum http_method {
 enum http_status {
     HTTP_OK = 200,
     HTTP_NOT_MODIFIED = 304,
+    HTTP_FORBIDDEN = 403,
     HTTP_NOT_FOUND = 404,
+    HTTP_URI_TOO_LONG = 414,
 };
 
-/* to compute modulo with bitwise AND
- * must be a power of 2
+/* the default size of the request buffer. To compute modulo with bitwise
+ * AND, every buffer size must be a power of 2. The buffer is mapped twice in
+ * a row, so a request never wraps around in memory.
  */
 #define MAX_BUF 8192
 
+/* room for the file name http_find_file() builds from a URI */
+#define HTTP_FILENAME_MAX 512
+
 typedef struct {
     void *root;
     int fd;
     int epfd;
-    char buf[MAX_BUF] __attribute__((aligned(8))); /* ring buffer */
+    uint32_t addr; /* client address and port, network byte order */
+    uint16_t port;
+    char *buf; /* ring buffer, mirrored at buf + buf_size */
+    size_t buf_size;
     size_t pos, last;
+    size_t request_pos; /* where the request the parser is in begins */
     int state;
+    bool in_headers; /* the request line is parsed, the headers are not */
     void *request_start;
     int method;
     void *uri_start, *uri_end;
@@ -49,6 +64,20 @@ typedef struct {
     void *cur_header_value_start, *cur_header_value_end;
 
     void *timer;
+    uint32_t zc_pending; /* zerocopy sends not yet completed */
+    void *proxy;         /* the proxied exchange this connection is part of */
+    unsigned requests;   /* served on this connection */
+    void *h2;            /* the HTTP/2 session once the connection switched */
+    void *tls;           /* the OpenSSL session of a TLS connection */
+
+    int body_state;        /* how the rest of the request body is framed */
+    int64_t body_left;     /* of the body or of the current chunk */
+    uint64_t body_size;    /* chunk data announced so far */
+    bool expect_continue;  /* the client waits for 100 Continue */
+    char *uri_copy;        /* the URI, while the body passes through buf */
+    void *upload;          /* the file the request body is stored in */
+    void *body_rest;       /* what the socket did not take of a response */
+    struct list_head run;  /* queued when the connection yielded */
 } http_request_t;
 
 typedef struct {
@@ -78,7 +107,29 @@ typedef struct {
 } http_header_handle_t;
 
 void http_handle_header(http_request_t *r, http_out_t *o);
+const vhost_t *http_find_host(http_request_t *r);
+int http_find_file(const vhost_t *host,
+                   char *uri,
+                   size_t uri_len,
+                   char *filename,
+                   file_entry_t *st_file,
+                   const file_entry_t **file);
+bool http_modified_since(time_t mtime, const char *since);
+bool http_last_request(http_request_t *r);
+const char *http_mime_type(const char *filename);
+void http_use_pack(bool enable);
+void http_use_zerocopy(size_t threshold);
+void http_drain();
+void http_set_keepalive(int timeout, unsigned max_requests);
+int http_keepalive_timeout();
 int http_close_conn(http_request_t *r);
+void http_use_uploads(const char *dir);
+bool http_yielded();
+void http_run_yielded();
+void http_requeue(http_request_t *r);
+void http_upload_abort(http_request_t *r);
+void http_body_rest_abort(http_request_t *r);
+ssize_t http_send_error(int fd, int status);
 
 static inline void init_http_request(http_request_t *r,
                                      int fd,
@@ -86,16 +137,48 @@ static inline void init_http_request(http_request_t *r,
                                      char *root)
 {
     r->fd = fd, r->epfd = epfd;
+    r->addr = 0, r->port = 0;
     r->pos = r->last = 0;
+    r->request_pos = 0;
     r->state = 0;
+    r->in_headers = false;
+    r->zc_pending = 0;
+    r->proxy = NULL;
+    r->requests = 0;
+    r->h2 = NULL;
+    r->tls = NULL;
+    r->body_state = 0;
+    r->expect_continue = false;
+    r->uri_copy = NULL;
+    r->upload = NULL;
+    r->body_rest = NULL;
     r->root = root;
     INIT_LIST_HEAD(&(r->list));
 }
 
+http_request_t *http_request_alloc(size_t buf_size);
+void http_request_free(http_request_t *r);
+uint64_t http_ring_max_conns(unsigned workers);
+
 /* TODO: public functions should have conventions to prefix http_ */
 void do_request(void *infd);
 
 int http_parse_request_line(http_request_t *r);
 int http_parse_request_body(http_request_t *r);
 
+/* returned by http_body_pump while the sink cannot take more */
+#define HTTP_BODY_BLOCKED 1
+
+void http_set_max_body(uint64_t bytes);
+int http_body_init(http_request_t *r);
+int http_body_pump(http_request_t *r,
+                   int sink,
+                   int pipe[2],
+                   size_t *piped,
+                   bool raw);
+void http_body_continue(http_request_t *r);
+void http_body_chunked(http_request_t *r);
+int64_t http_body_data_left(const http_request_t *r);
+ssize_t http_body_scan(http_request_t *r, size_t n);
+
 #endif
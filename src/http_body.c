@@ -0,0 +1,368 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for the sake of splice(2) */
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "http.h"
+#include "tls.h"
+
+/* bytes spliced from the client per step, the default pipe capacity */
+#define BODY_SPLICE_MAX (64 * 1024)
+
+/* chunk framing copied into the pipe at once; an empty pipe takes it all */
+#define BODY_FRAMING_MAX 4096
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+enum {
+    BODY_NONE,        /* no body, or all of it consumed */
+    BODY_LENGTH,      /* body_left bytes of a Content-Length body */
+    BODY_CHUNK_SIZE,  /* the hex digits of a chunk size, -1 before any */
+    BODY_CHUNK_EXT,   /* a chunk extension, up to LF */
+    BODY_CHUNK_DATA,  /* body_left bytes of chunk data */
+    BODY_CHUNK_CR,    /* the CRLF closing the chunk data */
+    BODY_CHUNK_LF,
+    BODY_TRAILER,     /* at the start of a trailer line */
+    BODY_TRAILER_LINE,
+    BODY_TRAILER_CR,  /* the CRLF ending the body */
+};
+
+static _Atomic uint64_t max_body = 0; /* 0 is unlimited */
+
+void http_set_max_body(uint64_t bytes)
+{
+    max_body = bytes;
+}
+
+static bool header_is(const http_header_t *h, const char *name)
+{
+    size_t len = strlen(name);
+    return (size_t) ((char *) h->key_end - (char *) h->key_start) == len &&
+           !strncasecmp(h->key_start, name, len);
+}
+
+static bool value_is(const http_header_t *h, const char *value)
+{
+    size_t len = strlen(value);
+    return (size_t) ((char *) h->value_end - (char *) h->value_start) == len &&
+           !strncasecmp(h->value_start, value, len);
+}
+
+/* how the body of the request whose headers were just parsed is framed, from
+ * Content-Length or Transfer-Encoding. Returns 0, or the status to refuse the
+ * request with. The URI is copied out of the request buffer, through which
+ * the body may flow before the request is logged.
+ */
+int http_body_init(http_request_t *r)
+{
+    free(r->uri_copy);
+    r->uri_copy = NULL;
+    r->body_state = BODY_NONE;
+    r->body_size = 0;
+    r->expect_continue = false;
+
+    bool chunked = false, sized = false;
+    int64_t length = 0;
+    list_head *pos;
+    list_for_each (pos, &r->list) {
+        http_header_t *h = list_entry(pos, http_header_t, list);
+        if (header_is(h, "Content-Length")) {
+            char *end;
+            long long n = strtoll(h->value_start, &end, 10);
+            if (end == h->value_start || end != (char *) h->value_end ||
+                n < 0 || (sized && n != length))
+                return 400;
+            length = n;
+            sized = true;
+        } else if (header_is(h, "Transfer-Encoding")) {
+            if (!value_is(h, "chunked"))
+                return 501;
+            chunked = true;
+        } else if (header_is(h, "Expect")) {
+            if (!value_is(h, "100-continue"))
+                return 417;
+            r->expect_continue = true;
+        }
+    }
+
+    /* both would let a proxy and its upstream disagree on the body's end */
+    if (chunked && sized)
+        return 400;
+    uint64_t limit = atomic_load_explicit(&max_body, memory_order_relaxed);
+    if (limit && sized && (uint64_t) length > limit)
+        return 413;
+
+    if (chunked) {
+        r->body_state = BODY_CHUNK_SIZE;
+        r->body_left = -1;
+    } else if (length) {
+        r->body_state = BODY_LENGTH;
+        r->body_left = length;
+    } else {
+        r->expect_continue = false;
+        return 0;
+    }
+
+    size_t uri_len = (char *) r->uri_end - (char *) r->uri_start;
+    r->uri_copy = malloc(uri_len + 1); /* parse_uri terminates it */
+    if (!r->uri_copy)
+        return 500;
+    memcpy(r->uri_copy, r->uri_start, uri_len);
+    r->uri_start = r->uri_copy;
+    r->uri_end = r->uri_copy + uri_len;
+    return 0;
+}
+
+static int hex_digit(uint8_t ch)
+{
+    if (ch >= '0' && ch <= '9')
+        return ch - '0';
+    ch |= 0x20;
+    if (ch >= 'a' && ch <= 'f')
+        return ch - 'a' + 10;
+    return -1;
+}
+
+/* advance the chunk framing over up to n bytes at r->pos. Returns the bytes
+ * consumed, stopping at chunk data and at the end of the body, or -1 with
+ * errno EINVAL if the framing is malformed, EFBIG if the body grows beyond
+ * limit, 0 for none.
+ */
+static ssize_t parse_framing(http_request_t *r, size_t n, uint64_t limit)
+{
+    const uint8_t *p = (uint8_t *) &r->buf[r->pos & (r->buf_size - 1)];
+    size_t i;
+    for (i = 0; i < n; i++) {
+        uint8_t ch = p[i];
+        switch (r->body_state) {
+        case BODY_CHUNK_SIZE: {
+            int d = hex_digit(ch);
+            if (d >= 0) {
+                if (r->body_left > (INT64_MAX >> 4))
+                    goto malformed;
+                r->body_left = (r->body_left < 0 ? 0 : r->body_left << 4) + d;
+                break;
+            }
+            if (r->body_left < 0)
+                goto malformed;
+            if (ch == '\n')
+                goto size_done;
+            if (ch != ';' && ch != ' ' && ch != '\t' && ch != '\r')
+                goto malformed;
+            r->body_state = BODY_CHUNK_EXT;
+            break;
+        }
+        case BODY_CHUNK_EXT:
+            if (ch == '\n')
+                goto size_done;
+            break;
+        case BODY_CHUNK_CR:
+            if (ch == '\r') {
+                r->body_state = BODY_CHUNK_LF;
+                break;
+            }
+            /* fall through */
+        case BODY_CHUNK_LF:
+            if (ch != '\n')
+                goto malformed;
+            r->body_state = BODY_CHUNK_SIZE;
+            r->body_left = -1;
+            break;
+        case BODY_TRAILER:
+            if (ch == '\n') {
+                r->body_state = BODY_NONE;
+                return i + 1;
+            }
+            r->body_state = ch == '\r' ? BODY_TRAILER_CR : BODY_TRAILER_LINE;
+            break;
+        case BODY_TRAILER_LINE:
+            if (ch == '\n')
+                r->body_state = BODY_TRAILER;
+            break;
+        case BODY_TRAILER_CR:
+            if (ch != '\n')
+                goto malformed;
+            r->body_state = BODY_NONE;
+            return i + 1;
+        default:
+            return i;
+        }
+        continue;
+
+    size_done:
+        if (r->body_left == 0) {
+            r->body_state = BODY_TRAILER;
+            continue;
+        }
+        r->body_size += r->body_left;
+        if (limit && r->body_size > limit) {
+            errno = EFBIG;
+            return -1;
+        }
+        r->body_state = BODY_CHUNK_DATA;
+        return i + 1;
+    }
+    return i;
+
+malformed:
+    errno = EINVAL;
+    return -1;
+}
+
+/* n bytes of body data were consumed */
+static void consumed(http_request_t *r, size_t n)
+{
+    r->body_left -= n;
+    if (r->body_left == 0)
+        r->body_state =
+            r->body_state == BODY_LENGTH ? BODY_NONE : BODY_CHUNK_CR;
+}
+
+static bool in_data(const http_request_t *r)
+{
+    return r->body_state == BODY_LENGTH || r->body_state == BODY_CHUNK_DATA;
+}
+
+/* move the request body to sink through pipe, *piped bytes of which are in
+ * flight. Bytes already in the request buffer are copied into the pipe; the
+ * rest of the data is spliced from the socket, except over TLS, where it is
+ * decrypted into the request buffer first. With raw, the chunk framing goes
+ * to the sink too, otherwise only the data. A negative sink discards the
+ * body. Returns 0 once the body is through, EAGAIN to wait for the client,
+ * HTTP_BODY_BLOCKED to wait for the sink and -1 on errors.
+ */
+int http_body_pump(http_request_t *r,
+                   int sink,
+                   int pipe[2],
+                   size_t *piped,
+                   bool raw)
+{
+    uint64_t limit = atomic_load_explicit(&max_body, memory_order_relaxed);
+    size_t mask = r->buf_size - 1;
+    for (;;) {
+        /* the pipe is emptied before anything else goes in */
+        if (*piped) {
+            ssize_t n = splice(pipe[0], NULL, sink, NULL, *piped,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n == 0)
+                errno = EIO;
+            if (n <= 0)
+                return errno == EAGAIN ? HTTP_BODY_BLOCKED : -1;
+            *piped -= n;
+            continue;
+        }
+        if (r->body_state == BODY_NONE)
+            return 0;
+
+        size_t avail = r->last - r->pos;
+        char *p = &r->buf[r->pos & mask];
+        if (avail && !in_data(r)) {
+            bool copy = raw && sink >= 0;
+            ssize_t n = parse_framing(
+                r, copy ? MIN(avail, BODY_FRAMING_MAX) : avail, limit);
+            if (n < 0)
+                return -1;
+            if (copy && n && write(pipe[1], p, n) != n)
+                return -1;
+            if (copy)
+                *piped = n;
+            r->pos += n;
+            continue;
+        }
+
+        if (avail) {
+            size_t n = MIN(avail, (uint64_t) r->body_left);
+            if (sink >= 0) {
+                ssize_t w = write(pipe[1], p, n);
+                if (w <= 0)
+                    return -1;
+                n = w;
+                *piped = n;
+            }
+            r->pos += n;
+            consumed(r, n);
+            continue;
+        }
+
+        /* nothing buffered: data straight from the socket to the pipe */
+        if (sink >= 0 && !r->tls && in_data(r)) {
+            ssize_t n = splice(r->fd, NULL, pipe[1], NULL,
+                               MIN((uint64_t) r->body_left, BODY_SPLICE_MAX),
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n == 0)
+                errno = ECONNRESET;
+            if (n <= 0)
+                return errno == EAGAIN ? EAGAIN : -1;
+            *piped = n;
+            consumed(r, n);
+            continue;
+        }
+
+        /* the request buffer is all consumed, any of it may be refilled */
+        ssize_t n = tls_read(r, &r->buf[r->last & mask], r->buf_size);
+        if (n == 0)
+            errno = ECONNRESET;
+        if (n <= 0)
+            return errno == EAGAIN ? EAGAIN : -1;
+        r->last += n;
+    }
+}
+
+/* what r reads from now on is a chunked body, as a proxied response is */
+void http_body_chunked(http_request_t *r)
+{
+    r->body_state = BODY_CHUNK_SIZE;
+    r->body_left = -1;
+    r->body_size = 0;
+}
+
+/* chunk data bytes that follow at once, 0 in the framing */
+int64_t http_body_data_left(const http_request_t *r)
+{
+    return r->body_state == BODY_CHUNK_DATA ? r->body_left : 0;
+}
+
+/* follow a chunked body over the next n bytes read from r, for a relay that
+ * passes it on as is. The framing is read at r->pos, chunk data is only
+ * counted and may have been spliced elsewhere. Returns the bytes that belong
+ * to the body, fewer than n once it ended, or -1 if it is malformed.
+ */
+ssize_t http_body_scan(http_request_t *r, size_t n)
+{
+    size_t done = 0;
+    while (done < n && r->body_state != BODY_NONE) {
+        size_t k;
+        if (in_data(r)) {
+            k = MIN(n - done, (uint64_t) r->body_left);
+            consumed(r, k);
+        } else {
+            ssize_t m = parse_framing(r, n - done, 0);
+            if (m < 0)
+                return -1;
+            k = m;
+        }
+        r->pos += k;
+        done += k;
+    }
+    return done;
+}
+
+/* the interim response a client sending Expect: 100-continue waits for */
+void http_body_continue(http_request_t *r)
+{
+    static const char interim[] = "HTTP/1.1 100 Continue\r\n\r\n";
+    if (!r->expect_continue)
+        return;
+    r->expect_continue = false;
+    ssize_t n UNUSED = write(r->fd, interim, sizeof(interim) - 1);
+}
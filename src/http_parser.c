@@ -31,13 +31,17 @@
         return EAGAIN;    \
     } while (0)
 
-#define dispatch(i)                                  \
-    do {                                             \
-        if (i >= r->last)                            \
-            interrupt_parse();                       \
-        p = (uint8_t *) &r->buf[pi & (MAX_BUF - 1)]; \
-        ch = *p;                                     \
-        goto *conditions[state];                     \
+/* pointers count from the start of the request; being within buf_size of
+ * it, they fall into the mirror rather than wrap around
+ */
+#define dispatch(i)                                                   \
+    do {                                                              \
+        if (i >= r->last)                                             \
+            interrupt_parse();                                        \
+        p = (uint8_t *) &r->buf[(r->request_pos & (r->buf_size - 1)) + \
+                                (pi - r->request_pos)];               \
+        ch = *p;                                                      \
+        goto *conditions[state];                                      \
     } while (0)
 
 int http_parse_request_line(http_request_t *r)
@@ -53,6 +57,8 @@ int http_parse_request_line(http_request_t *r)
 
     /* initialize pi */
     pi = r->pos;
+    if (state == s_start)
+        r->request_pos = pi;
     dispatch(pi);
 
 /* HTTP methods: GET, HEAD, POST */
@@ -287,7 +293,6 @@ int http_parse_request_body(http_request_t *r)
     define_label_array(conditions, state_code);
 
     state = r->state;
-    assert(state == 0 && "state should be 0");
 
     http_header_t *hd;
     pi = r->pos;
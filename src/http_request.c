@@ -1,8 +1,9 @@
 #ifndef _GNU_SOURCE
-#define _GNU_SOURCE /* for the sake of strptime(3) */
+#define _GNU_SOURCE /* for the sake of strptime(3) and timegm(3) */
 #endif
 
 #include <math.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -10,6 +11,10 @@
 #include <unistd.h>
 
 #include "http.h"
+#include "probe.h"
+#include "stats.h"
+#include "timer.h"
+#include "tls.h"
 
 int http_close_conn(http_request_t *r)
 {
@@ -19,8 +24,17 @@ int http_close_conn(http_request_t *r)
      * underlying open file description have been closed (or before if the
      * descriptor is explicitly removed using epoll_ctl(2) EPOLL_CTL_DEL).
      */
+    probe_close(r->fd);
+    if (r->upload)
+        http_upload_abort(r);
+    if (r->body_rest)
+        http_body_rest_abort(r);
+    free(r->uri_copy);
+    if (r->tls)
+        tls_close(r);
     close(r->fd);
-    free(r);
+    http_request_free(r);
+    stats_inc(closes);
     return 0;
 }
 
@@ -42,22 +56,20 @@ static int http_process_connection(http_request_t *r UNUSED,
     return 0;
 }
 
-static int http_process_if_modified_since(http_request_t *r UNUSED,
-                                          http_out_t *out,
-                                          char *data,
-                                          int len UNUSED)
+/* whether a file modified at 'mtime' changed since the HTTP date 'since' */
+bool http_modified_since(time_t mtime, const char *since)
 {
-    struct tm tm;
-    if (!strptime(data, "%a, %d %b %Y %H:%M:%S GMT", &tm))
-        return 0;
+    struct tm tm = {0};
+    if (!strptime(since, "%a, %d %b %Y %H:%M:%S GMT", &tm))
+        return true;
 
-    time_t client_time = mktime(&tm);
+    time_t client_time = timegm(&tm);
 
     union {
         uint64_t bits;
         double data;
     } time_diff, tmp;
-    time_diff.data = difftime(out->mtime, client_time);
+    time_diff.data = difftime(mtime, client_time);
 
     /* compute the absolute value by bitwise masking */
     time_diff.bits &= ~((uint64_t) 1 << 63);
@@ -66,7 +78,15 @@ static int http_process_if_modified_since(http_request_t *r UNUSED,
     tmp.data = 1e-6;
     time_diff.data = tmp.data - time_diff.data;
 
-    if (!(time_diff.bits >> 63)) { /* Not modified */
+    return time_diff.bits >> 63;
+}
+
+static int http_process_if_modified_since(http_request_t *r UNUSED,
+                                          http_out_t *out,
+                                          char *data,
+                                          int len UNUSED)
+{
+    if (!http_modified_since(out->mtime, data)) { /* Not modified */
         out->modified = false;
         out->status = HTTP_NOT_MODIFIED;
     }
@@ -79,6 +99,54 @@ static http_header_handle_t http_headers_in[] = {
     {"If-Modified-Since", http_process_if_modified_since},
     {"", http_process_ignore}};
 
+/* the Host header selects the root the other headers are checked against, so
+ * it is looked up on its own before http_handle_header consumes the list
+ */
+const vhost_t *http_find_host(http_request_t *r)
+{
+    list_head *pos;
+    list_for_each (pos, &(r->list)) {
+        http_header_t *header = list_entry(pos, http_header_t, list);
+        if ((char *) header->key_end - (char *) header->key_start == 4 &&
+            !strncasecmp(header->key_start, "Host", 4))
+            return vhost_lookup(header->value_start,
+                                (char *) header->value_end -
+                                    (char *) header->value_start);
+    }
+    return vhost_lookup(NULL, 0);
+}
+
+/* set once the process drains: every response closes its connection */
+static _Atomic bool draining = false;
+
+/* reloadable, so read by the workers while the main thread may write */
+static _Atomic int keepalive_timeout = TIMEOUT_DEFAULT; /* ms */
+static _Atomic unsigned max_requests = 0; /* per connection, 0 is unlimited */
+
+void http_drain()
+{
+    draining = true;
+}
+
+void http_set_keepalive(int timeout, unsigned requests)
+{
+    keepalive_timeout = timeout > 0 ? timeout : TIMEOUT_DEFAULT;
+    max_requests = requests;
+}
+
+int http_keepalive_timeout()
+{
+    return atomic_load_explicit(&keepalive_timeout, memory_order_relaxed);
+}
+
+/* count a request on r; true if it must be the last on the connection */
+bool http_last_request(http_request_t *r)
+{
+    unsigned limit = atomic_load_explicit(&max_requests, memory_order_relaxed);
+    return ++r->requests == limit ||
+           atomic_load_explicit(&draining, memory_order_relaxed);
+}
+
 void http_handle_header(http_request_t *r, http_out_t *o)
 {
     list_head *pos;
@@ -98,4 +166,7 @@ void http_handle_header(http_request_t *r, http_out_t *o)
         list_del(pos);
         free(header);
     }
+
+    if (http_last_request(r))
+        o->keep_alive = false;
 }
@@ -0,0 +1,104 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for the sake of memfd_create(2) */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "http.h"
+
+/* released connections a worker keeps, their buffers still mapped, so that
+ * a busy listener does not map and unmap on every accept
+ */
+#define SPARE_MAX 64
+
+/* mappings left to the rest of the process: libraries, thread stacks, the
+ * pack file, the proxy cache
+ */
+#define MAP_RESERVE 4096
+
+static __thread http_request_t *spare[SPARE_MAX];
+static __thread unsigned spares;
+
+/* the same 'size' bytes of a memfd mapped twice, back to back */
+static char *map_mirrored(size_t size)
+{
+    int fd = memfd_create("sehttpd-request", MFD_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    char *base = MAP_FAILED;
+    if (!ftruncate(fd, size))
+        base = mmap(NULL, 2 * size, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base != MAP_FAILED &&
+        (mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd,
+              0) == MAP_FAILED ||
+         mmap(base + size, size, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)) {
+        munmap(base, 2 * size);
+        base = MAP_FAILED;
+    }
+    close(fd);
+    return base == MAP_FAILED ? NULL : base;
+}
+
+/* a connection with a 'buf_size' byte request buffer, rounded up to a page.
+ * Byte i of the ring is both at buf[i] and at buf[i + buf_size], so any
+ * buf_size bytes starting in the ring are contiguous in memory.
+ */
+http_request_t *http_request_alloc(size_t buf_size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    if (buf_size < page)
+        buf_size = page;
+
+    for (unsigned i = spares; i-- > 0;) {
+        http_request_t *r = spare[i];
+        if (r->buf_size == buf_size) {
+            spare[i] = spare[--spares];
+            return r;
+        }
+    }
+
+    http_request_t *r = malloc(sizeof(http_request_t));
+    if (!r)
+        return NULL;
+    r->buf = map_mirrored(buf_size);
+    if (!r->buf) {
+        free(r);
+        return NULL;
+    }
+    r->buf_size = buf_size;
+    return r;
+}
+
+void http_request_free(http_request_t *r)
+{
+    if (spares < SPARE_MAX) {
+        spare[spares++] = r;
+        return;
+    }
+    munmap(r->buf, 2 * r->buf_size);
+    free(r);
+}
+
+/* every ring takes two mappings of its own, so vm.max_map_count bounds the
+ * connections open at once across the workers; 0 if it cannot be read
+ */
+uint64_t http_ring_max_conns(unsigned workers)
+{
+    FILE *f = fopen("/proc/sys/vm/max_map_count", "r");
+    if (!f)
+        return 0;
+    unsigned long long maps;
+    int n = fscanf(f, "%llu", &maps);
+    fclose(f);
+    if (n != 1)
+        return 0;
+
+    uint64_t reserved = MAP_RESERVE + 2ULL * SPARE_MAX * workers;
+    return maps > reserved + 2 ? (maps - reserved) / 2 : 1;
+}
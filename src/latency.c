@@ -0,0 +1,89 @@
+#ifdef LATENCY_TRACE
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "latency.h"
+
+#define LATENCY_MAX_WORKERS 64
+
+__thread latency_hist_t latency_local[LATENCY_MAX];
+uint64_t latency_ns_mult = 1ULL << 32;
+
+static latency_hist_t *workers[LATENCY_MAX_WORKERS];
+static _Atomic int nworkers;
+
+#define latency_name_entry(name) #name
+static const char *phase_names[] = {LATENCY_PHASES(latency_name_entry)};
+#undef latency_name_entry
+
+/* measure the cycle counter against the monotonic clock once at startup */
+void latency_init()
+{
+    uint64_t t0 = now_ns(), c0 = read_cycles();
+    usleep(20000);
+    uint64_t ns = now_ns() - t0, cycles = read_cycles() - c0;
+
+    if (cycles)
+        latency_ns_mult = (ns << 32) / cycles;
+}
+
+/* one worker at a time, like stats_register() */
+void latency_register()
+{
+    int n = atomic_load(&nworkers);
+    if (n >= LATENCY_MAX_WORKERS)
+        return;
+    workers[n] = latency_local;
+    atomic_store_explicit(&nworkers, n + 1, memory_order_release);
+}
+
+#define render(...)                                              \
+    do {                                                         \
+        int _n = snprintf(buf + len, size - len, ##__VA_ARGS__); \
+        if (_n < 0 || (size_t) _n >= size - len)                 \
+            return len;                                          \
+        len += _n;                                               \
+    } while (0)
+
+/* Prometheus histograms of every phase, summed over all workers */
+size_t latency_render(char *buf, size_t size)
+{
+    size_t len = 0;
+
+    render("# TYPE sehttpd_phase_latency_seconds histogram\n");
+    int n = atomic_load_explicit(&nworkers, memory_order_acquire);
+    for (int p = 0; p < LATENCY_MAX; p++) {
+        latency_hist_t h;
+        memset(&h, 0, sizeof(h));
+        for (int w = 0; w < n; w++) {
+            h.count += workers[w][p].count;
+            h.sum_ns += workers[w][p].sum_ns;
+            for (int b = 0; b < LATENCY_BUCKETS; b++)
+                h.bucket[b] += workers[w][p].bucket[b];
+        }
+
+        uint64_t cumulative = 0;
+        for (int b = 0; b < LATENCY_BUCKETS - 1; b++) {
+            cumulative += h.bucket[b];
+            render("sehttpd_phase_latency_seconds_bucket{phase=\"%s\","
+                   "le=\"%.9f\"} %" PRIu64 "\n",
+                   phase_names[p], (1ULL << (b + LATENCY_MIN_SHIFT)) / 1e9,
+                   cumulative);
+        }
+        render(
+            "sehttpd_phase_latency_seconds_bucket{phase=\"%s\",le=\"+Inf\"} "
+            "%" PRIu64 "\n"
+            "sehttpd_phase_latency_seconds_sum{phase=\"%s\"} %.9f\n"
+            "sehttpd_phase_latency_seconds_count{phase=\"%s\"} %" PRIu64 "\n",
+            phase_names[p], h.count, phase_names[p], h.sum_ns / 1e9,
+            phase_names[p], h.count);
+    }
+
+    return len;
+}
+
+#endif
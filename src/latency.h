@@ -0,0 +1,68 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* per-phase latency histograms, compiled in with "make LATENCY=1".
+ * Without LATENCY_TRACE every hook below expands to nothing.
+ */
+#ifdef LATENCY_TRACE
+
+#include "cycles.h"
+
+#define LATENCY_PHASES(X) \
+    X(parse), X(stat), X(header), X(write), X(sendfile), X(request)
+
+#define latency_phase_entry(name) LATENCY_##name
+enum { LATENCY_PHASES(latency_phase_entry), LATENCY_MAX };
+#undef latency_phase_entry
+
+/* bucket i counts samples below 2^(i + LATENCY_MIN_SHIFT) ns */
+#define LATENCY_MIN_SHIFT 7
+#define LATENCY_BUCKETS 28
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t bucket[LATENCY_BUCKETS];
+} latency_hist_t;
+
+extern __thread latency_hist_t latency_local[LATENCY_MAX];
+extern uint64_t latency_ns_mult; /* ns per cycle, 32.32 fixed point */
+
+static inline void latency_record(int phase, uint64_t cycles)
+{
+    uint64_t ns =
+        (uint64_t) (((unsigned __int128) cycles * latency_ns_mult) >> 32);
+    int b = ns ? 64 - __builtin_clzll(ns) - LATENCY_MIN_SHIFT : 0;
+    if (b < 0)
+        b = 0;
+    if (b >= LATENCY_BUCKETS)
+        b = LATENCY_BUCKETS - 1;
+
+    latency_hist_t *h = &latency_local[phase];
+    h->count++;
+    h->sum_ns += ns;
+    h->bucket[b]++;
+}
+
+void latency_init();
+void latency_register();
+size_t latency_render(char *buf, size_t size);
+
+#define latency_begin(t) uint64_t t = read_cycles()
+#define latency_end(phase, t) \
+    latency_record(LATENCY_##phase, read_cycles() - (t))
+
+#else
+
+#define latency_init()
+#define latency_register()
+#define latency_render(buf, size) ((size_t) 0)
+#define latency_begin(t)
+#define latency_end(phase, t)
+
+#endif
+
+#endif
@@ -1,30 +1,165 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for the sake of accept4(2) and pipe2(2) */
+#endif
+
 #include <arpa/inet.h>
 #include <assert.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#include "access_log.h"
+#include "affinity.h"
+#include "busypoll.h"
+#include "cycles.h"
+#include "error_page.h"
+#include "file_index.h"
+#include "h2.h"
+#include "hotset.h"
 #include "http.h"
+#include "latency.h"
 #include "logger.h"
+#include "pack.h"
+#include "perf_counters.h"
+#include "probe.h"
+#include "proxy.h"
+#include "proxy_cache.h"
+#include "stats.h"
 #include "timer.h"
+#include "tls.h"
+#include "vhost.h"
+#include "zerocopy.h"
+
+#define PORT 8081
+#define WEBROOT "./www"
 
-/* the length of the struct epoll_events array pointed to by *events */
+/* the default length of the struct epoll_events array of every worker */
 #define MAXEVENTS 1024
 
 #define LISTENQ 1024
 
-static const char short_options[] = "p:r:h";
-static const struct option long_options[] = {{"port", 1, NULL, 'p'},
-                                             {"root", 1, NULL, 'r'},
-                                             {"help", 0, NULL, 'h'}};
+/* connections accepted per wakeup before serving the other ready events */
+#define ACCEPT_BUDGET 64
+
+/* file descriptors kept free for files being served and logs. Past the
+ * resulting limit the oldest idle connection is closed for every new one.
+ */
+#define FD_RESERVE 32
+
+/* how long a draining process waits for its connections to finish (ms) */
+#define DRAIN_TIMEOUT 30000
+
+/* how a process started by an upgrade finds the inherited descriptors */
+#define ENV_LISTEN_FD "SEHTTPD_LISTEN_FD"
+#define ENV_READY_FD "SEHTTPD_READY_FD"
 
-static int open_listenfd(int port)
+/* the limit of the per-worker statistics and access log rings */
+#define MAX_WORKERS 64
+
+#define MAX_PROXY_ROUTES 16
+
+/* what to do with new connections once --max-conns is reached */
+enum { OVERLOAD_REJECT, OVERLOAD_DEFER };
+
+/* TCP options applied to the listening socket */
+typedef struct {
+    bool nodelay;     /* TCP_NODELAY, inherited by accepted sockets */
+    int defer_accept; /* TCP_DEFER_ACCEPT timeout in seconds, 0 disables */
+    int fastopen;     /* TCP_FASTOPEN queue length, 0 disables */
+} listen_opts_t;
+
+/* everything set by the command line and the configuration file */
+typedef struct {
+    int port;
+    char *root;
+    char *metrics;
+    char *access_log;
+    unsigned log_sample;
+    listen_opts_t listen_opts;
+    bool file_index;
+    char *pack;
+    size_t zerocopy;
+    char *vhosts;
+    char *proxy[MAX_PROXY_ROUTES];
+    int nproxies;
+    char *proxy_cache_dir;
+    int workers;
+    int events;
+    size_t buffer_size;
+    char *tls_cert;
+    char *tls_key;
+    char *upload_dir;
+    bool cpu_affinity;
+    unsigned busy_poll; /* microseconds, 0 disables */
+    char *hot_set;
+    char *error_pages;
+
+    /* applied again by a reload */
+    int accept_budget;
+    uint64_t max_conns;
+    int overload;
+    int backlog;
+    int keepalive_timeout;
+    unsigned max_requests;
+    size_t proxy_cache;
+    uint64_t max_body;
+} config_t;
+
+static const char short_options[] =
+    "p:r:m:a:s:b:ndfc:o:ik:z::v:x:C:D:F:w:AP::H:E:e:l:B:t:q:T:K:U:M:h";
+static const struct option long_options[] = {
+    {"port", 1, NULL, 'p'},
+    {"root", 1, NULL, 'r'},
+    {"metrics", 1, NULL, 'm'},
+    {"access-log", 1, NULL, 'a'},
+    {"log-sample", 1, NULL, 's'},
+    {"accept-budget", 1, NULL, 'b'},
+    {"nodelay", 0, NULL, 'n'},
+    {"defer-accept", 2, NULL, 'd'},
+    {"fastopen", 2, NULL, 'f'},
+    {"max-conns", 1, NULL, 'c'},
+    {"overload", 1, NULL, 'o'},
+    {"file-index", 0, NULL, 'i'},
+    {"pack", 1, NULL, 'k'},
+    {"zerocopy", 2, NULL, 'z'},
+    {"vhosts", 1, NULL, 'v'},
+    {"proxy", 1, NULL, 'x'},
+    {"proxy-cache", 1, NULL, 'C'},
+    {"proxy-cache-dir", 1, NULL, 'D'},
+    {"config", 1, NULL, 'F'},
+    {"workers", 1, NULL, 'w'},
+    {"cpu-affinity", 0, NULL, 'A'},
+    {"busy-poll", 2, NULL, 'P'},
+    {"hot-set", 1, NULL, 'H'},
+    {"error-pages", 1, NULL, 'E'},
+    {"events", 1, NULL, 'e'},
+    {"backlog", 1, NULL, 'l'},
+    {"buffer-size", 1, NULL, 'B'},
+    {"keepalive-timeout", 1, NULL, 't'},
+    {"max-requests", 1, NULL, 'q'},
+    {"tls-cert", 1, NULL, 'T'},
+    {"tls-key", 1, NULL, 'K'},
+    {"upload-dir", 1, NULL, 'U'},
+    {"max-body", 1, NULL, 'M'},
+    {"help", 0, NULL, 'h'},
+    {NULL, 0, NULL, 0}};
+
+static int open_listenfd(int port, int backlog, bool reuseport)
 {
     int listenfd, optval = 1;
 
@@ -37,6 +172,11 @@ static int open_listenfd(int port)
                    sizeof(int)) < 0)
         return -1;
 
+    /* one socket per worker, all bound to the port */
+    if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval,
+                                sizeof(int)) < 0)
+        return -1;
+
     /* Listenfd will be an endpoint for all requests to given port. */
     struct sockaddr_in serveraddr = {
         .sin_family = AF_INET,
@@ -48,12 +188,66 @@ static int open_listenfd(int port)
         return -1;
 
     /* Make it a listening socket ready to accept connection requests */
-    if (listen(listenfd, LISTENQ) < 0)
+    if (listen(listenfd, backlog) < 0)
         return -1;
 
     return listenfd;
 }
 
+/* apply the tuning options, also to a listening socket inherited from the
+ * process being upgraded
+ */
+static void set_listen_opts(int listenfd, const listen_opts_t *opts)
+{
+    int optval = 1;
+
+    /* Failing to set a tuning option is not fatal, the server still works */
+    if (opts->nodelay &&
+        setsockopt(listenfd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(int)))
+        log_err("TCP_NODELAY");
+
+    /* only wake up for a connection once its first request has arrived */
+    if (opts->defer_accept > 0 &&
+        setsockopt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &opts->defer_accept,
+                   sizeof(int)))
+        log_err("TCP_DEFER_ACCEPT");
+
+    /* let returning clients carry the request in the SYN */
+    if (opts->fastopen > 0 &&
+        setsockopt(listenfd, IPPROTO_TCP, TCP_FASTOPEN, &opts->fastopen,
+                   sizeof(int)))
+        log_err("TCP_FASTOPEN");
+}
+
+/* the listening sockets passed down by an upgrade, a comma-separated list.
+ * Returns how many were stored in fds, 0 if there are none and -1 on error.
+ */
+static int inherited_listenfds(int *fds, int max)
+{
+    const char *env = getenv(ENV_LISTEN_FD);
+    if (!env)
+        return 0;
+
+    int n = 0;
+    for (const char *p = env; *p && n < max; n++) {
+        char *end;
+        int listening = 0;
+        socklen_t len = sizeof(listening);
+        fds[n] = strtol(p, &end, 10);
+        if (end == p || (*end && *end != ',') ||
+            getsockopt(fds[n], SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) ||
+            !listening) {
+            log_err("%s=%s is not a list of listening sockets", ENV_LISTEN_FD,
+                    env);
+            unsetenv(ENV_LISTEN_FD);
+            return -1;
+        }
+        p = *end ? end + 1 : end;
+    }
+    unsetenv(ENV_LISTEN_FD);
+    return n;
+}
+
 /* set a socket non-blocking. If a listen socket is a blocking socket, after
  * it comes out from epoll and accepts the last connection, the next accpet
  * will block unexpectedly.
@@ -80,128 +274,980 @@ static void print_usage()
     printf(
         "Usage: sehttpd [options]\n"
         "Options:\n"
-        "   -p, --port       port number to be specified\n"
-        "   -r, --root       web page root to be specified\n"
-        "   -h, --help       display this message\n");
+        "   -p, --port                 port number to be specified\n"
+        "   -r, --root                 web page root to be specified\n"
+        "   -F, --config FILE          read options from FILE, reloaded on\n"
+        "                              SIGHUP; the command line wins\n"
+        "   -w, --workers N            serve with N threads (1)\n"
+        "   -A, --cpu-affinity         pin the workers to CPUs and give each\n"
+        "                              the connections received on its CPU\n"
+        "   -P, --busy-poll[=USECS]    spin instead of sleeping in epoll_wait\n"
+        "                              and busy poll the NIC (50)\n"
+        "   -H, --hot-set FILE         keep the most served files in FILE and\n"
+        "                              read them ahead on startup\n"
+        "   -E, --error-pages DIR      answer an error status N with the\n"
+        "                              page DIR/N.html\n"
+        "   -e, --events N             events taken per epoll_wait (1024)\n"
+        "   -l, --backlog N            listen backlog (1024)\n"
+        "   -B, --buffer-size BYTES    request buffer, a power of 2 (8192)\n"
+        "   -t, --keepalive-timeout MS close idle connections after MS (500)\n"
+        "   -q, --max-requests N       close connections after N requests\n"
+        "   -M, --max-body BYTES       refuse longer request bodies with 413\n"
+        "   -U, --upload-dir DIR       store POSTed bodies in files below DIR\n"
+        "   -m, --metrics PATH         serve counters in Prometheus format\n"
+        "   -a, --access-log FILE      write the access log, - for stdout\n"
+        "   -s, --log-sample N         log only one request in every N\n"
+        "   -b, --accept-budget N      connections accepted per wakeup\n"
+        "   -n, --nodelay              set TCP_NODELAY on connections\n"
+        "   -d, --defer-accept[=SECS]  set TCP_DEFER_ACCEPT (1 second)\n"
+        "   -f, --fastopen[=QLEN]      enable TCP_FASTOPEN (queue of 256)\n"
+        "   -c, --max-conns N          limit concurrent connections\n"
+        "   -o, --overload reject|defer  answer 503 or stop accepting\n"
+        "                              beyond --max-conns (reject)\n"
+        "   -i, --file-index           index the webroot at startup\n"
+        "   -k, --pack FILE            serve a pack file built by sepack\n"
+        "   -z, --zerocopy[=BYTES]     send packed bodies of at least BYTES\n"
+        "                              with MSG_ZEROCOPY (16384)\n"
+        "   -v, --vhosts FILE          serve the virtual hosts listed in FILE\n"
+        "   -x, --proxy PREFIX=ADDR    forward paths under PREFIX to ADDR,\n"
+        "                              HOST:PORT or unix:PATH (repeatable)\n"
+        "   -C, --proxy-cache BYTES    cache proxied responses, per worker\n"
+        "   -D, --proxy-cache-dir DIR  keep cached bodies in files below DIR\n"
+        "   -T, --tls-cert FILE        speak TLS with the PEM certificate\n"
+        "                              chain in FILE, encrypted by the kernel\n"
+        "   -K, --tls-key FILE         the private key (the --tls-cert file)\n"
+        "   -h, --help                 display this message\n");
     exit(0);
 }
 
-#define PORT 8081
-#define WEBROOT "./www"
+static void config_init(config_t *c)
+{
+    memset(c, 0, sizeof(config_t));
+    c->port = PORT;
+    c->root = strdup(WEBROOT);
+    c->log_sample = 1;
+    c->workers = 1;
+    c->events = MAXEVENTS;
+    c->buffer_size = MAX_BUF;
+    c->accept_budget = ACCEPT_BUDGET;
+    c->overload = OVERLOAD_REJECT;
+    c->backlog = LISTENQ;
+    c->keepalive_timeout = TIMEOUT_DEFAULT;
+}
 
-int main(int argc, char *argv[])
+static void config_free(config_t *c)
 {
-    /* when a fd is closed by remote, writing to this fd will cause system
-     * send SIGPIPE to this process, which exit the program
-     */
-    if (sigaction(SIGPIPE,
-                  &(struct sigaction){.sa_handler = SIG_IGN, .sa_flags = 0},
-                  NULL)) {
-        log_err("Failed to install sigal handler for SIGPIPE");
-        return 0;
+    free(c->root);
+    free(c->metrics);
+    free(c->access_log);
+    free(c->pack);
+    free(c->vhosts);
+    for (int i = 0; i < c->nproxies; i++)
+        free(c->proxy[i]);
+    free(c->proxy_cache_dir);
+    free(c->tls_cert);
+    free(c->tls_key);
+    free(c->upload_dir);
+    free(c->hot_set);
+    free(c->error_pages);
+}
+
+static void set_string(char **field, const char *arg)
+{
+    free(*field);
+    *field = strdup(arg);
+}
+
+/* apply one option, from the command line or the configuration file */
+static bool set_option(config_t *c, int opt, const char *arg)
+{
+    switch (opt) {
+    case 'p':
+        c->port = atoi(arg);
+        break;
+    case 'r':
+        set_string(&c->root, arg);
+        break;
+    case 'm':
+        set_string(&c->metrics, arg);
+        break;
+    case 'a':
+        set_string(&c->access_log, arg);
+        break;
+    case 's':
+        c->log_sample = atoi(arg);
+        break;
+    case 'b':
+        c->accept_budget = atoi(arg);
+        if (c->accept_budget <= 0)
+            c->accept_budget = ACCEPT_BUDGET;
+        break;
+    case 'n':
+        c->listen_opts.nodelay = true;
+        break;
+    case 'd':
+        c->listen_opts.defer_accept = arg ? atoi(arg) : 1;
+        break;
+    case 'f':
+        c->listen_opts.fastopen = arg ? atoi(arg) : 256;
+        break;
+    case 'c':
+        c->max_conns = strtoull(arg, NULL, 10);
+        break;
+    case 'o':
+        c->overload = strcmp(arg, "defer") ? OVERLOAD_REJECT : OVERLOAD_DEFER;
+        break;
+    case 'i':
+        c->file_index = true;
+        break;
+    case 'k':
+        set_string(&c->pack, arg);
+        break;
+    case 'v':
+        set_string(&c->vhosts, arg);
+        break;
+    case 'x':
+        if (c->nproxies == MAX_PROXY_ROUTES) {
+            log_err("too many proxy routes, at most %d", MAX_PROXY_ROUTES);
+            return false;
+        }
+        c->proxy[c->nproxies++] = strdup(arg);
+        break;
+    case 'C':
+        c->proxy_cache = strtoull(arg, NULL, 10);
+        break;
+    case 'D':
+        set_string(&c->proxy_cache_dir, arg);
+        break;
+    case 'z':
+        c->zerocopy = arg ? strtoul(arg, NULL, 10) : 16384;
+        break;
+    case 'w':
+        c->workers = atoi(arg);
+        if (c->workers < 1 || c->workers > MAX_WORKERS) {
+            log_err("--workers must be between 1 and %d", MAX_WORKERS);
+            return false;
+        }
+        break;
+    case 'A':
+        c->cpu_affinity = true;
+        break;
+    case 'P':
+        c->busy_poll = arg ? strtoul(arg, NULL, 10) : 50;
+        break;
+    case 'H':
+        set_string(&c->hot_set, arg);
+        break;
+    case 'E':
+        set_string(&c->error_pages, arg);
+        break;
+    case 'e':
+        c->events = atoi(arg);
+        if (c->events <= 0)
+            c->events = MAXEVENTS;
+        break;
+    case 'l':
+        c->backlog = atoi(arg);
+        if (c->backlog <= 0)
+            c->backlog = LISTENQ;
+        break;
+    case 'B':
+        c->buffer_size = strtoul(arg, NULL, 10);
+        if (c->buffer_size < 1024 || (c->buffer_size & (c->buffer_size - 1))) {
+            log_err("--buffer-size must be a power of 2 of at least 1024");
+            return false;
+        }
+        break;
+    case 't':
+        c->keepalive_timeout = atoi(arg);
+        break;
+    case 'q':
+        c->max_requests = strtoul(arg, NULL, 10);
+        break;
+    case 'T':
+        set_string(&c->tls_cert, arg);
+        break;
+    case 'K':
+        set_string(&c->tls_key, arg);
+        break;
+    case 'U':
+        set_string(&c->upload_dir, arg);
+        break;
+    case 'M':
+        c->max_body = strtoull(arg, NULL, 10);
+        break;
+    case 'h':
+        print_usage();
+        break;
     }
+    return true;
+}
 
-    /* parsing the arguments */
-    int port = PORT;
-    char *root = WEBROOT;
-    int next_option;
-    do {
-        next_option =
-            getopt_long(argc, argv, short_options, long_options, NULL);
-        switch (next_option) {
-        case 'p':
-            port = atoi(optarg);
-            break;
-        case 'r':
-            root = optarg;
-            break;
-        case 'h':
-            print_usage();
-            break;
-        case -1:
+/* one "option [value]" per line, options named like the long ones */
+static bool load_config(config_t *c, const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        log_err("load_config: %s", path);
+        return false;
+    }
+
+    char line[1024];
+    int lineno = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), f)) {
+        lineno++;
+        char *name = strtok(line, " \t\r\n");
+        if (!name || *name == '#')
+            continue;
+        char *value = strtok(NULL, " \t\r\n");
+
+        const struct option *o = long_options;
+        while (o->name && strcmp(o->name, name))
+            o++;
+        if (!o->name || o->val == 'F' || o->val == 'h' ||
+            (o->has_arg == required_argument && !value) ||
+            (o->has_arg == no_argument && value)) {
+            log_err("load_config: %s:%d: bad option \"%s\"", path, lineno,
+                    name);
+            ok = false;
             break;
         }
-    } while (next_option != -1);
+        ok = set_option(c, o->val, value);
+    }
 
-    int listenfd = open_listenfd(port);
-    int rc UNUSED = sock_set_non_blocking(listenfd);
-    assert(rc == 0 && "sock_set_non_blocking");
+    fclose(f);
+    return ok;
+}
 
-    /* create epoll and add listenfd */
-    int epfd = epoll_create1(0 /* flags */);
-    assert(epfd > 0 && "epoll_create1");
+static int saved_argc;
+static char **saved_argv;
+static char *config_path;
 
-    struct epoll_event *events = malloc(sizeof(struct epoll_event) * MAXEVENTS);
-    assert(events && "epoll_event: malloc");
+/* the configuration file, if any, then the command line on top of it */
+static bool load_options(config_t *c)
+{
+    int next_option;
+    optind = 1;
+    opterr = 0;
+    while ((next_option = getopt_long(saved_argc, saved_argv, short_options,
+                                      long_options, NULL)) != -1) {
+        if (next_option == 'F')
+            config_path = optarg;
+    }
+    if (config_path && !load_config(c, config_path))
+        return false;
+
+    optind = 1;
+    opterr = 1;
+    while ((next_option = getopt_long(saved_argc, saved_argv, short_options,
+                                      long_options, NULL)) != -1) {
+        if (next_option != 'F' && !set_option(c, next_option, optarg))
+            return false;
+    }
+    return true;
+}
+
+static volatile sig_atomic_t dump_requested = 0;
+
+static void request_dump(int sig UNUSED)
+{
+    dump_requested = 1;
+}
+
+static volatile sig_atomic_t upgrade_requested = 0;
+static volatile sig_atomic_t drain_requested = 0;
+static volatile sig_atomic_t reload_requested = 0;
+
+static void request_upgrade(int sig UNUSED)
+{
+    upgrade_requested = 1;
+}
+
+static void request_drain(int sig UNUSED)
+{
+    drain_requested = 1;
+}
+
+static void request_reload(int sig UNUSED)
+{
+    reload_requested = 1;
+}
+
+/* write the counters (and latency histograms and hardware counters if
+ * compiled in) to stderr
+ */
+static void dump_stats()
+{
+    char *buf = malloc(STATS_BUFSIZE);
+    if (!buf) {
+        log_err("dump_stats: malloc");
+        return;
+    }
+
+    size_t len = stats_render(buf, STATS_BUFSIZE);
+    len += latency_render(buf + len, STATS_BUFSIZE - len);
+    len += perf_render(buf + len, STATS_BUFSIZE - len);
+    fwrite(buf, 1, len, stderr);
+    free(buf);
+}
+
+/* the startup configuration, read-only once the workers run */
+static config_t conf;
+
+/* the limits a reload may change while the workers read them */
+static _Atomic int accept_budget = ACCEPT_BUDGET;
+static _Atomic uint64_t max_conns = 0; /* 0 means unlimited */
+static _Atomic int overload = OVERLOAD_REJECT;
+
+/* what vm.max_map_count leaves room for, 0 if unknown */
+static uint64_t ring_max_conns;
+
+static void apply_limits(const config_t *c)
+{
+    accept_budget = c->accept_budget;
+    max_conns = c->max_conns;
+    if (ring_max_conns && (!c->max_conns || c->max_conns > ring_max_conns)) {
+        /* beyond it mmap fails and accepted connections are dropped */
+        if (c->max_conns)
+            log_err("--max-conns %" PRIu64 " exceeds vm.max_map_count, "
+                    "using %" PRIu64,
+                    c->max_conns, ring_max_conns);
+        max_conns = ring_max_conns;
+    }
+    overload = c->overload;
+    http_set_keepalive(c->keepalive_timeout, c->max_requests);
+    http_set_max_body(c->max_body);
+    proxy_cache_resize(c->proxy_cache);
+}
+
+/* one listening socket shared by the workers, or one each with
+ * --cpu-affinity. Worker i polls listenfds[i % nlisteners].
+ */
+static int listenfds[MAX_WORKERS];
+static int nlisteners;
+static http_request_t listen_reqs[MAX_WORKERS];
+static int worker_cpus[MAX_WORKERS]; /* with --cpu-affinity */
+
+static __thread int listenfd;
+static __thread struct epoll_event listen_event;
+static __thread int worker_cpu = -1;
+static uint64_t fd_soft_limit; /* per worker */
+
+/* every worker polls it; written once to wake them all for draining */
+static int notify_fd;
+static http_request_t notify_req;
+
+static __thread bool accept_paused = false;
+
+/* the calling worker's share of --max-conns */
+static uint64_t worker_max_conns()
+{
+    uint64_t limit = atomic_load_explicit(&max_conns, memory_order_relaxed);
+    return (limit + conf.workers - 1) / conf.workers;
+}
+
+static void set_accept_paused(int epfd, bool paused)
+{
+    /* a level-triggered listener must leave the interest list while paused,
+     * otherwise every epoll_wait returns at once for the pending backlog.
+     * An exclusive one cannot be modified, so it is removed and added back.
+     */
+    if (paused) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, listenfd, NULL);
+    } else {
+        struct epoll_event event = listen_event;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &event);
+    }
+    accept_paused = paused;
+}
+
+static void accept_connections(int epfd)
+{
+    uint64_t limit = worker_max_conns();
+    bool defer = atomic_load_explicit(&overload, memory_order_relaxed) ==
+                 OVERLOAD_DEFER;
+
+    for (int budget = accept_budget; budget > 0; budget--) {
+        uint64_t active = stats_active_conns();
+        if (limit && active >= limit && defer) {
+            set_accept_paused(epfd, true);
+            return;
+        }
+
+        /* near the fd limit, idle keep-alive connections go first */
+        if (active >= fd_soft_limit && expire_idle_timer())
+            stats_inc(evictions);
+
+        socklen_t inlen = sizeof(struct sockaddr_in);
+        struct sockaddr_in clientaddr;
+        int infd = accept4(listenfd, (struct sockaddr *) &clientaddr, &inlen,
+                           SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (infd < 0) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                /* we have processed all incoming connections */
+                return;
+            }
+            if ((errno == EMFILE || errno == ENFILE) && expire_idle_timer()) {
+                stats_inc(evictions);
+                continue;
+            }
+            log_err("accept");
+            stats_inc(accept_errors);
+            return;
+        }
+        stats_inc(accepts);
+        probe_accept(infd);
+        if (worker_cpu >= 0 && affinity_incoming_cpu(infd) != worker_cpu)
+            stats_inc(remote_cpu_accepts);
+
+        if (limit && active >= limit) {
+            /* shed load with a canned response, nothing is allocated. A TLS
+             * client could not read it, it only sees the connection close.
+             */
+            if (!tls_enabled())
+                error_page_send(infd, 503);
+            stats_count_status(503);
+            close(infd);
+            stats_inc(closes);
+            continue;
+        }
+
+        http_request_t *request = http_request_alloc(conf.buffer_size);
+        if (!request) {
+            log_err("malloc");
+            close(infd);
+            stats_inc(closes);
+            return;
+        }
+
+        init_http_request(request, infd, epfd, conf.root);
+        request->addr = clientaddr.sin_addr.s_addr;
+        request->port = clientaddr.sin_port;
+        if (tls_enabled() && !tls_start(request)) {
+            http_request_free(request);
+            close(infd);
+            stats_inc(closes);
+            continue;
+        }
+        struct epoll_event event = {
+            .data.ptr = request,
+            .events = EPOLLIN | EPOLLET | EPOLLONESHOT,
+        };
+        epoll_ctl(epfd, EPOLL_CTL_ADD, infd, &event);
+
+        /* waiting for the first request, unless a handshake is under way */
+        if (tls_handshaking(request))
+            add_timer(request, http_keepalive_timeout(), http_close_conn);
+        else
+            add_idle_timer(request, http_keepalive_timeout(), http_close_conn);
+    }
+}
+
+static pid_t upgrade_pid = 0;
+static _Atomic bool draining = false;
+static uint64_t drain_deadline_ns;
+
+/* start the binary at argv[0] again with the listening socket inherited. The
+ * returned descriptor, the read end of a pipe, becomes readable once the new
+ * process serves or has failed to start. Returns -1 on error.
+ */
+static int start_upgrade()
+{
+    int ready[2];
+    if (pipe2(ready, O_CLOEXEC) < 0) {
+        log_err("upgrade: pipe2");
+        return -1;
+    }
+
+    /* only async-signal-safe calls between fork and exec */
+    char env[12 * MAX_WORKERS];
+    size_t len = 0;
+    for (int i = 0; i < nlisteners; i++)
+        len += snprintf(env + len, sizeof(env) - len, "%s%d", i ? "," : "",
+                        listenfds[i]);
+    setenv(ENV_LISTEN_FD, env, 1);
+    snprintf(env, sizeof(env), "%d", ready[1]);
+    setenv(ENV_READY_FD, env, 1);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        for (int i = 0; i < nlisteners; i++)
+            fcntl(listenfds[i], F_SETFD, 0);
+        fcntl(ready[1], F_SETFD, 0);
+        execvp(saved_argv[0], saved_argv);
+        _exit(127);
+    }
+
+    unsetenv(ENV_LISTEN_FD);
+    unsetenv(ENV_READY_FD);
+    close(ready[1]);
+    if (pid < 0) {
+        log_err("upgrade: fork");
+        close(ready[0]);
+        return -1;
+    }
+
+    upgrade_pid = pid;
+    return ready[0];
+}
+
+/* tell the process that started us that we serve now */
+static void signal_ready()
+{
+    const char *env = getenv(ENV_READY_FD);
+    if (!env)
+        return;
+    unsetenv(ENV_READY_FD);
+
+    int fd = atoi(env);
+    ssize_t n UNUSED = write(fd, "", 1);
+    close(fd);
+}
+
+/* stop accepting; the connections left get Connection: close on their next
+ * response and every worker ends once its connections are gone. The socket
+ * stays open, the process that took over shares it.
+ */
+static void start_drain()
+{
+    if (draining)
+        return;
+
+    http_drain();
+    drain_deadline_ns = now_ns() + DRAIN_TIMEOUT * 1000000ULL;
+    atomic_store_explicit(&draining, true, memory_order_release);
+    uint64_t one = 1;
+    ssize_t n UNUSED = write(notify_fd, &one, sizeof(one));
+    printf("Draining.\n");
+    fflush(stdout);
+}
+
+/* re-read the configuration file and apply what can change while serving */
+static void reload()
+{
+    config_t c;
+    config_init(&c);
+    if (!load_options(&c)) {
+        log_err("reload: keeping the current configuration");
+        config_free(&c);
+        return;
+    }
+
+    apply_limits(&c);
+    for (int i = 0; i < nlisteners && c.backlog != conf.backlog; i++) {
+        if (listen(listenfds[i], c.backlog) < 0)
+            log_err("reload: listen");
+    }
+    conf.backlog = c.backlog;
+    config_free(&c);
+    printf("Configuration reloaded.\n");
+    fflush(stdout);
+}
+
+typedef struct {
+    int id;
+    pthread_t thread;
+} worker_t;
+
+/* taken by each worker once registered, so that they register one by one */
+static sem_t worker_started;
+
+static void *serve(void *arg)
+{
+    worker_t *w = arg;
 
-    http_request_t *request = malloc(sizeof(http_request_t));
-    init_http_request(request, listenfd, epfd, root);
+    /* pinned first, so that what the worker allocates is on its node */
+    if (conf.cpu_affinity && affinity_pin(worker_cpus[w->id]))
+        worker_cpu = worker_cpus[w->id];
 
-    struct epoll_event event = {
-        .data.ptr = request,
-        .events = EPOLLIN | EPOLLET,
+    /* level-triggered, so connections left over when the accept budget runs
+     * out are reported again by the next epoll_wait. With several workers
+     * on one listener only one of them is woken up for a new connection.
+     */
+    listenfd = listenfds[w->id % nlisteners];
+    listen_event = (struct epoll_event){
+        .data.ptr = &listen_reqs[w->id % nlisteners],
+        .events = EPOLLIN | (nlisteners < conf.workers ? EPOLLEXCLUSIVE : 0),
     };
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    assert(epfd > 0 && "epoll_create1");
+    if (conf.busy_poll)
+        busy_poll_epoll(epfd);
+
+    struct epoll_event *events =
+        malloc(sizeof(struct epoll_event) * conf.events);
+    assert(events && "epoll_event: malloc");
+
+    struct epoll_event event = listen_event;
     epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &event);
+    event = (struct epoll_event){.data.ptr = &notify_req, .events = EPOLLIN};
+    epoll_ctl(epfd, EPOLL_CTL_ADD, notify_fd, &event);
+
+    /* the inotify descriptor and the upgrade pipe belong to the first worker */
+    int indexfd = w->id == 0 ? file_index_fd() : -1;
+    if (indexfd >= 0) {
+        http_request_t *index_req = malloc(sizeof(http_request_t));
+        init_http_request(index_req, indexfd, epfd, conf.root);
+        event = (struct epoll_event){.data.ptr = index_req, .events = EPOLLIN};
+        epoll_ctl(epfd, EPOLL_CTL_ADD, indexfd, &event);
+    }
+    int readyfd = -1;
+    http_request_t ready_req;
 
     timer_init();
+    stats_register();
+    latency_register();
+    perf_register();
+    access_log_register();
+    file_index_register();
+    hotset_register();
+    sem_post(&worker_started);
 
-    printf("Web server started.\n");
+    bool drained = false;
 
     /* epoll_wait loop */
     while (1) {
+        /* stop polling the listener, once */
+        if (!drained &&
+            atomic_load_explicit(&draining, memory_order_acquire)) {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, listenfd, NULL);
+            epoll_ctl(epfd, EPOLL_CTL_DEL, notify_fd, NULL);
+            drained = true;
+        }
+
+        /* resume before blocking, or nothing may ever wake us up again */
+        if (accept_paused && !drained &&
+            stats_active_conns() < worker_max_conns())
+            set_accept_paused(epfd, false);
+
+        /* connections that yielded go round before new events are taken */
+        http_run_yielded();
+
         int time = find_timer();
+        if (http_yielded())
+            time = 0;
+        int tick = hotset_tick(w->id == 0);
+        if (tick >= 0 && (time < 0 || tick < time))
+            time = tick;
+        if (drained) {
+            if (!stats_active_conns() || now_ns() >= drain_deadline_ns)
+                break;
+            /* wake up to check the deadline */
+            if (time < 0 || time > 1000)
+                time = 1000;
+        }
         debug("wait time = %d", time);
-        int n = epoll_wait(epfd, events, MAXEVENTS, time);
+        file_index_wait();
+        int n = conf.busy_poll
+                    ? busy_poll_wait(epfd, events, conf.events, time)
+                    : epoll_wait(epfd, events, conf.events, time);
+        file_index_wake();
         handle_expired_timers();
 
+        /* the other workers block the signals */
+        if (w->id == 0) {
+            if (dump_requested) {
+                dump_requested = 0;
+                dump_stats();
+            }
+            if (reload_requested) {
+                reload_requested = 0;
+                reload();
+            }
+            if (upgrade_requested) {
+                upgrade_requested = 0;
+                if (draining || readyfd >= 0) {
+                    log_err("upgrade: already in progress");
+                } else if ((readyfd = start_upgrade()) >= 0) {
+                    init_http_request(&ready_req, readyfd, epfd, conf.root);
+                    event = (struct epoll_event){.data.ptr = &ready_req,
+                                                 .events = EPOLLIN};
+                    epoll_ctl(epfd, EPOLL_CTL_ADD, readyfd, &event);
+                }
+            }
+            if (drain_requested) {
+                drain_requested = 0;
+                start_drain();
+            }
+        }
+
         for (int i = 0; i < n; i++) {
             http_request_t *r = events[i].data.ptr;
             int fd = r->fd;
             if (listenfd == fd) {
                 /* we hava one or more incoming connections */
-                while (1) {
-                    socklen_t inlen = 1;
-                    struct sockaddr_in clientaddr;
-                    int infd = accept(listenfd, (struct sockaddr *) &clientaddr,
-                                      &inlen);
-                    if (infd < 0) {
-                        if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
-                            /* we have processed all incoming connections */
-                            break;
-                        }
-                        log_err("accept");
-                        break;
-                    }
+                if (!drained)
+                    accept_connections(epfd);
+            } else if (notify_fd == fd) {
+                ; /* handled at the top of the loop */
+            } else if (indexfd == fd) {
+                file_index_refresh();
+            } else if (readyfd == fd) {
+                /* one byte if the new process serves, EOF if it died */
+                char byte;
+                if (read(readyfd, &byte, 1) == 1) {
+                    start_drain();
+                } else {
+                    log_err("upgrade: the new process failed to start");
+                    waitpid(upgrade_pid, NULL, 0);
+                }
+                epoll_ctl(epfd, EPOLL_CTL_DEL, readyfd, NULL);
+                close(readyfd);
+                readyfd = -1;
+            } else {
+                uint32_t ev = events[i].events;
 
-                    rc = sock_set_non_blocking(infd);
-                    assert(rc == 0 && "sock_set_non_blocking");
+                if (tls_handshaking(r)) {
+                    tls_event(r, ev);
+                    continue;
+                }
+                if (r->proxy) {
+                    proxy_event(r, ev);
+                    continue;
+                }
+                if (r->h2) {
+                    h2_event(r, ev);
+                    continue;
+                }
 
-                    request = malloc(sizeof(http_request_t));
-                    if (!request) {
-                        log_err("malloc");
-                        break;
+                /* EPOLLERR also reports zerocopy completions */
+                if ((ev & EPOLLERR) && r->zc_pending &&
+                    zerocopy_complete(r)) {
+                    ev &= ~EPOLLERR;
+                    if (!(ev & (EPOLLIN | EPOLLOUT | EPOLLHUP))) {
+                        struct epoll_event event = {
+                            .data.ptr = r,
+                            .events = (r->body_rest ? EPOLLOUT : EPOLLIN) |
+                                      EPOLLET | EPOLLONESHOT,
+                        };
+                        epoll_ctl(epfd, EPOLL_CTL_MOD, r->fd, &event);
+                        continue;
                     }
-
-                    init_http_request(request, infd, epfd, root);
-                    event.data.ptr = request;
-                    event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
-                    epoll_ctl(epfd, EPOLL_CTL_ADD, infd, &event);
-
-                    add_timer(request, TIMEOUT_DEFAULT, http_close_conn);
                 }
-            } else {
-                if ((events[i].events & EPOLLERR) ||
-                    (events[i].events & EPOLLHUP) ||
-                    (!(events[i].events & EPOLLIN))) {
+
+                if ((ev & EPOLLERR) || (ev & EPOLLHUP) ||
+                    !(ev & (EPOLLIN | EPOLLOUT))) {
                     log_err("epoll error fd: %d", r->fd);
-                    close(fd);
+                    del_timer(r);
+                    http_close_conn(r);
                     continue;
                 }
 
+                perf_begin(t_perf);
                 do_request(events[i].data.ptr);
+                perf_end(t_perf);
             }
         }
     }
 
+    hotset_merge();
+    free(events);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    /* when a fd is closed by remote, writing to this fd will cause system
+     * send SIGPIPE to this process, which exit the program
+     */
+    if (sigaction(SIGPIPE,
+                  &(struct sigaction){.sa_handler = SIG_IGN, .sa_flags = 0},
+                  NULL)) {
+        log_err("Failed to install sigal handler for SIGPIPE");
+        return 0;
+    }
+
+    /* SIGUSR1 dumps the statistics from the event loop */
+    if (sigaction(
+            SIGUSR1,
+            &(struct sigaction){.sa_handler = request_dump, .sa_flags = 0},
+            NULL)) {
+        log_err("Failed to install sigal handler for SIGUSR1");
+        return 0;
+    }
+
+    /* SIGUSR2 starts a new binary on the same socket, SIGQUIT just drains
+     * and SIGHUP reloads the configuration
+     */
+    if (sigaction(
+            SIGUSR2,
+            &(struct sigaction){.sa_handler = request_upgrade, .sa_flags = 0},
+            NULL) ||
+        sigaction(
+            SIGQUIT,
+            &(struct sigaction){.sa_handler = request_drain, .sa_flags = 0},
+            NULL) ||
+        sigaction(
+            SIGHUP,
+            &(struct sigaction){.sa_handler = request_reload, .sa_flags = 0},
+            NULL)) {
+        log_err("Failed to install sigal handler for SIGUSR2, SIGQUIT or "
+                "SIGHUP");
+        return 0;
+    }
+
+    /* parsing the arguments */
+    saved_argc = argc;
+    saved_argv = argv;
+    config_init(&conf);
+    if (!load_options(&conf))
+        return 1;
+    ring_max_conns = http_ring_max_conns(conf.workers);
+    apply_limits(&conf);
+
+    for (int i = 0; i < conf.nproxies; i++) {
+        if (!proxy_add_route(conf.proxy[i]))
+            return 1;
+    }
+    if (conf.metrics)
+        stats_set_path(conf.metrics);
+    if (conf.upload_dir) {
+        if (access(conf.upload_dir, W_OK | X_OK)) {
+            log_err("cannot write to %s", conf.upload_dir);
+            return 1;
+        }
+        http_use_uploads(conf.upload_dir);
+    }
+    if ((conf.proxy_cache || conf.proxy_cache_dir) &&
+        !proxy_cache_init(conf.proxy_cache, conf.proxy_cache_dir))
+        return 1;
+
+    nlisteners = conf.cpu_affinity ? conf.workers : 1;
+    if (conf.cpu_affinity) {
+        int cpus[MAX_WORKERS];
+        int ncpus = affinity_cpus(cpus, MAX_WORKERS);
+        if (ncpus < conf.workers) {
+            log_err("--cpu-affinity needs a CPU per worker, %d available",
+                    ncpus);
+            return 1;
+        }
+        memcpy(worker_cpus, cpus, sizeof(int) * conf.workers);
+    }
+
+    int inherited = inherited_listenfds(listenfds, MAX_WORKERS);
+    if (inherited < 0)
+        return 1;
+    if (inherited && inherited != nlisteners) {
+        log_err("inherited %d listening sockets, %d needed", inherited,
+                nlisteners);
+        return 1;
+    }
+    for (int i = 0; i < nlisteners; i++) {
+        if (inherited)
+            listen(listenfds[i], conf.backlog);
+        else
+            listenfds[i] =
+                open_listenfd(conf.port, conf.backlog, conf.cpu_affinity);
+        if (listenfds[i] < 0) {
+            log_err("cannot listen on port %d", conf.port);
+            return 1;
+        }
+        set_listen_opts(listenfds[i], &conf.listen_opts);
+        int rc UNUSED = sock_set_non_blocking(listenfds[i]);
+        assert(rc == 0 && "sock_set_non_blocking");
+        init_http_request(&listen_reqs[i], listenfds[i], -1, conf.root);
+    }
+
+    if (conf.busy_poll) {
+        busy_poll_init(conf.busy_poll);
+        for (int i = 0; i < nlisteners; i++)
+            busy_poll_socket(listenfds[i]);
+    }
+
+    /* the group keeps the program across upgrades, attaching replaces it */
+    if (nlisteners > 1 &&
+        !affinity_steer(listenfds[0], worker_cpus, nlisteners))
+        return 1;
+
+    if (conf.tls_cert &&
+        !tls_init(conf.tls_cert, conf.tls_key ? conf.tls_key : conf.tls_cert))
+        return 1;
+
+    /* the kernel TLS layer refuses MSG_ZEROCOPY, sendfile(2) stays */
+    if (conf.zerocopy && tls_enabled())
+        log_err("--zerocopy is ignored with --tls-cert");
+    else if (conf.zerocopy) {
+        bool enabled = true;
+        for (int i = 0; i < nlisteners; i++)
+            enabled = zerocopy_enable(listenfds[i]) && enabled;
+        if (enabled)
+            http_use_zerocopy(conf.zerocopy);
+    }
+
+    notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    assert(notify_fd >= 0 && "eventfd");
+    init_http_request(&notify_req, notify_fd, -1, conf.root);
+
+    file_index_t *index = NULL;
+    if (conf.file_index && !(index = file_index_init(conf.root)))
+        return 1;
+    vhost_set_default(conf.root, index);
+    if (conf.vhosts && !vhost_load(conf.vhosts))
+        return 1;
+
+    /* the pack replaces the webroot: --root, --file-index and --vhosts are
+     * unused
+     */
+    if (conf.pack) {
+        if (!pack_open(conf.pack))
+            return 1;
+        http_use_pack(true);
+    }
+
+    if (!error_page_init(conf.error_pages))
+        return 1;
+
+    /* read ahead while accepting already, with the pack and indexes open */
+    if (conf.hot_set && !hotset_open(conf.hot_set))
+        return 1;
+
+    /* the descriptors the file indexes may hold are not for connections */
+    struct rlimit nofile;
+    uint64_t reserved = FD_RESERVE + file_index_max_fds();
+    if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 &&
+        nofile.rlim_cur != RLIM_INFINITY && nofile.rlim_cur > 2 * reserved)
+        fd_soft_limit = (nofile.rlim_cur - reserved) / conf.workers;
+    else
+        fd_soft_limit = UINT64_MAX;
+
+    latency_init();
+
+    if (conf.access_log && !access_log_open(conf.access_log, conf.log_sample))
+        return 1;
+
+    /* the main thread is the first worker and the only one taking signals */
+    worker_t *workers = calloc(conf.workers, sizeof(worker_t));
+    assert(workers && "workers: calloc");
+    sem_init(&worker_started, 0, 0);
+
+    sigset_t handled, old;
+    sigemptyset(&handled);
+    sigaddset(&handled, SIGUSR1);
+    sigaddset(&handled, SIGUSR2);
+    sigaddset(&handled, SIGQUIT);
+    sigaddset(&handled, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &handled, &old);
+    for (int i = 1; i < conf.workers; i++) {
+        workers[i].id = i;
+        if (pthread_create(&workers[i].thread, NULL, serve, &workers[i])) {
+            log_err("pthread_create");
+            return 1;
+        }
+        sem_wait(&worker_started);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    printf("Web server started.\n");
+    fflush(stdout);
+    signal_ready();
+
+    serve(&workers[0]);
+    for (int i = 1; i < conf.workers; i++)
+        pthread_join(workers[i].thread, NULL);
+    hotset_save();
+
+    access_log_flush();
     return 0;
 }
@@ -0,0 +1,37 @@
+#include <string.h>
+
+#include "http.h"
+
+typedef struct {
+    const char *type;
+    const char *value;
+} mime_type_t;
+
+static mime_type_t mime[] = {{".html", "text/html"},
+                             {".xml", "text/xml"},
+                             {".xhtml", "application/xhtml+xml"},
+                             {".txt", "text/plain"},
+                             {".pdf", "application/pdf"},
+                             {".png", "image/png"},
+                             {".gif", "image/gif"},
+                             {".jpg", "image/jpeg"},
+                             {".css", "text/css"},
+                             {NULL, "text/plain"}};
+
+static const char *get_file_type(const char *type)
+{
+    if (!type)
+        return "text/plain";
+
+    int i;
+    for (i = 0; mime[i].type; ++i) {
+        if (!strcmp(type, mime[i].type))
+            return mime[i].value;
+    }
+    return mime[i].value;
+}
+
+const char *http_mime_type(const char *filename)
+{
+    return get_file_type(strrchr(filename, '.'));
+}
@@ -0,0 +1,115 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "pack.h"
+
+static const char *pack_base;
+static const pack_entry_t *pack_entries;
+static uint32_t pack_count;
+static int pack_fd = -1;
+
+static bool entry_valid(const pack_entry_t *e, uint64_t size)
+{
+    return e->uri_off <= size && e->uri_len <= size - e->uri_off &&
+           e->header_off <= size && e->header_len <= size - e->header_off &&
+           e->body_off <= size && e->body_len <= size - e->body_off;
+}
+
+/* map the pack file. Nothing is read up front: the entry table and the bodies
+ * are paged in on first use and stay in the page cache shared by all workers.
+ */
+bool pack_open(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        log_err("pack_open: %s", path);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(pack_header_t)) {
+        log_err("pack_open: %s is not a pack file", path);
+        goto fail;
+    }
+
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        log_err("pack_open: mmap %s", path);
+        goto fail;
+    }
+
+    const pack_header_t *hdr = base;
+    uint64_t size = st.st_size;
+    if (memcmp(hdr->magic, PACK_MAGIC, sizeof(hdr->magic)) ||
+        hdr->version != PACK_VERSION || hdr->size != size ||
+        hdr->entries_off > size ||
+        hdr->count > (size - hdr->entries_off) / sizeof(pack_entry_t)) {
+        log_err("pack_open: %s is corrupt or from another version", path);
+        munmap(base, st.st_size);
+        goto fail;
+    }
+
+    const pack_entry_t *entries =
+        (const pack_entry_t *) ((const char *) base + hdr->entries_off);
+    for (uint32_t i = 0; i < hdr->count; i++) {
+        if (!entry_valid(&entries[i], size)) {
+            log_err("pack_open: %s has a bad entry", path);
+            munmap(base, st.st_size);
+            goto fail;
+        }
+    }
+
+    /* the lookup table is touched by every request */
+    madvise(base, hdr->entries_off + hdr->count * sizeof(pack_entry_t),
+            MADV_WILLNEED);
+
+    pack_base = base;
+    pack_entries = entries;
+    pack_count = hdr->count;
+    pack_fd = fd;
+    return true;
+
+fail:
+    close(fd);
+    return false;
+}
+
+/* binary search of the sorted entry table, filling *file on a hit */
+bool pack_lookup(const char *uri, size_t len, file_entry_t *file)
+{
+    const char *query = memchr(uri, '?', len);
+    if (query)
+        len = query - uri;
+
+    size_t lo = 0, hi = pack_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const pack_entry_t *e = &pack_entries[mid];
+        int c = pack_uri_cmp(uri, len, pack_base + e->uri_off, e->uri_len);
+        if (c < 0) {
+            hi = mid;
+        } else if (c > 0) {
+            lo = mid + 1;
+        } else {
+            *file = (file_entry_t){
+                .path = NULL,
+                .fd = pack_fd,
+                .size = e->body_len,
+                .mtime = e->mtime,
+                .mime = NULL,
+                .etag = NULL,
+                .offset = e->body_off,
+                .data = pack_base + e->body_off,
+                .header = pack_base + e->header_off,
+                .header_len = e->header_len,
+            };
+            return true;
+        }
+    }
+    return false;
+}
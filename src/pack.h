@@ -0,0 +1,60 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "file_index.h"
+
+/* Webroot pack file, written by sepack and mapped by "sehttpd --pack".
+ *
+ *   pack_header_t
+ *   pack_entry_t[count]   sorted by URI, see pack_uri_cmp()
+ *   URI strings
+ *   per-file header lines (Content-type ... ETag, each ending in CRLF)
+ *   file bodies, each starting on a PACK_ALIGN boundary
+ *
+ * All offsets are from the start of the file. URIs that alias the same file
+ * ("/", "/dir", "/dir/" and their index.html) share one header and body.
+ */
+
+#define PACK_MAGIC "SEPACK\r\n"
+#define PACK_VERSION 1
+#define PACK_ALIGN 64
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint64_t size; /* of the whole file */
+    uint64_t entries_off;
+} pack_header_t;
+
+typedef struct {
+    uint64_t uri_off;
+    uint64_t header_off;
+    uint64_t body_off;
+    uint64_t body_len;
+    int64_t mtime;
+    uint32_t uri_len;
+    uint32_t header_len;
+} pack_entry_t;
+
+/* order of the entry table: bytewise, shorter first on a common prefix */
+static inline int pack_uri_cmp(const char *a,
+                               size_t alen,
+                               const char *b,
+                               size_t blen)
+{
+    int c = memcmp(a, b, alen < blen ? alen : blen);
+    if (c)
+        return c;
+    return alen < blen ? -1 : alen > blen;
+}
+
+bool pack_open(const char *path);
+bool pack_lookup(const char *uri, size_t len, file_entry_t *file);
+
+#endif
@@ -0,0 +1,235 @@
+#ifdef PERF_COUNTERS
+
+#include <errno.h>
+#include <inttypes.h>
+#include <linux/perf_event.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "perf_counters.h"
+#include "stats.h"
+
+#define PERF_MAX_WORKERS 64
+
+typedef struct {
+    uint64_t count[PERF_MAX];
+    uint64_t requests;
+    uint64_t samples;
+    int switches_fd; /* context switches of the whole thread, -1 if none */
+} perf_totals_t;
+
+static __thread perf_totals_t totals = {.switches_fd = -1};
+static __thread int fds[PERF_MAX];
+static __thread struct perf_event_mmap_page *pages[PERF_MAX];
+static __thread bool counting;
+
+static perf_totals_t *workers[PERF_MAX_WORKERS];
+static _Atomic int nworkers;
+
+#define perf_name_entry(name) #name
+static const char *event_names[] = {PERF_EVENTS(perf_name_entry)};
+#undef perf_name_entry
+
+static const uint64_t event_configs[] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+};
+
+static int open_event(uint32_t type, uint64_t config, int group, bool user)
+{
+    struct perf_event_attr attr = {
+        .type = type,
+        .size = sizeof(attr),
+        .config = config,
+        .read_format = PERF_FORMAT_GROUP,
+        .exclude_kernel = user,
+        .exclude_hv = user,
+    };
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group,
+                   PERF_FLAG_FD_CLOEXEC);
+}
+
+/* open the counters of the calling worker: a group, so that all of them run
+ * at once, with its pages mapped for rdpmc. The kernel's share of a request
+ * is counted too where perf_event_paranoid allows it.
+ */
+static bool open_group()
+{
+    bool user = false;
+    for (int i = 0; i < PERF_MAX; i++) {
+        int group = i ? fds[0] : -1;
+        fds[i] = open_event(PERF_TYPE_HARDWARE, event_configs[i], group, user);
+        if (fds[i] < 0 && i == 0 && (errno == EACCES || errno == EPERM)) {
+            user = true;
+            fds[i] = open_event(PERF_TYPE_HARDWARE, event_configs[i], -1, user);
+        }
+        if (fds[i] < 0) {
+            /* ENOENT: no PMU, as in most virtual machines */
+            log_err("perf_event_open(%s)", event_names[i]);
+            for (int j = 0; j < i; j++)
+                close(fds[j]);
+            return false;
+        }
+        pages[i] = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED,
+                        fds[i], 0);
+        if (pages[i] == MAP_FAILED)
+            pages[i] = NULL;
+    }
+    return true;
+}
+
+/* without hardware counters, requests and context switches are still
+ * counted
+ */
+void perf_register()
+{
+    counting = open_group();
+    totals.switches_fd = syscall(SYS_perf_event_open,
+                                 &(struct perf_event_attr){
+                                     .type = PERF_TYPE_SOFTWARE,
+                                     .size = sizeof(struct perf_event_attr),
+                                     .config = PERF_COUNT_SW_CONTEXT_SWITCHES,
+                                 },
+                                 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+
+    int n = atomic_load(&nworkers);
+    if (n >= PERF_MAX_WORKERS)
+        return;
+    workers[n] = &totals;
+    atomic_store_explicit(&nworkers, n + 1, memory_order_release);
+}
+
+/* the counter behind page without a system call, as the kernel documents in
+ * linux/perf_event.h; false if it cannot be read that way
+ */
+static bool read_user(struct perf_event_mmap_page *page, uint64_t *value)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t seq;
+    do {
+        seq = page->lock;
+        __asm__ __volatile__("" ::: "memory");
+        uint32_t index = page->index;
+        if (!page->cap_user_rdpmc || !index)
+            return false;
+        uint32_t lo, hi;
+        __asm__ __volatile__("rdpmc" : "=a"(lo), "=d"(hi) : "c"(index - 1));
+        int64_t pmc = ((uint64_t) hi << 32) | lo;
+        int shift = 64 - page->pmc_width;
+        *value = page->offset + ((pmc << shift) >> shift);
+        __asm__ __volatile__("" ::: "memory");
+    } while (page->lock != seq);
+    return true;
+#else
+    (void) page;
+    (void) value;
+    return false;
+#endif
+}
+
+void perf_read(perf_sample_t *s)
+{
+    s->requests = 0;
+    for (int i = 0; i < STATS_STATUS_MAX; i++)
+        s->requests += stats_local.requests[i];
+    if (!counting)
+        return;
+
+    bool user = true;
+    for (int i = 0; i < PERF_MAX && user; i++)
+        user = pages[i] && read_user(pages[i], &s->count[i]);
+    if (user)
+        return;
+
+    /* rdpmc is not permitted, or the group is not on the PMU right now */
+    struct {
+        uint64_t nr;
+        uint64_t values[PERF_MAX];
+    } group;
+    if (read(fds[0], &group, sizeof(group)) == sizeof(group))
+        memcpy(s->count, group.values, sizeof(s->count));
+    else
+        memset(s->count, 0, sizeof(s->count));
+}
+
+/* add what happened since start to the worker's totals */
+void perf_record(const perf_sample_t *start)
+{
+    perf_sample_t end;
+    perf_read(&end);
+    totals.requests += end.requests - start->requests;
+    totals.samples++;
+    if (!counting)
+        return;
+    for (int i = 0; i < PERF_MAX; i++)
+        totals.count[i] += end.count[i] - start->count[i];
+}
+
+#define render(...)                                              \
+    do {                                                         \
+        int _n = snprintf(buf + len, size - len, ##__VA_ARGS__); \
+        if (_n < 0 || (size_t) _n >= size - len)                 \
+            return len;                                          \
+        len += _n;                                               \
+    } while (0)
+
+/* the counts of all workers, and what they come to per request */
+size_t perf_render(char *buf, size_t size)
+{
+    size_t len = 0;
+    perf_totals_t sum = {0};
+    uint64_t switches = 0;
+
+    int n = atomic_load_explicit(&nworkers, memory_order_acquire);
+    for (int w = 0; w < n; w++) {
+        for (int i = 0; i < PERF_MAX; i++)
+            sum.count[i] += workers[w]->count[i];
+        sum.requests += workers[w]->requests;
+        sum.samples += workers[w]->samples;
+
+        uint64_t v[2]; /* PERF_FORMAT_GROUP is not set: the value alone */
+        if (workers[w]->switches_fd >= 0 &&
+            read(workers[w]->switches_fd, v, sizeof(v)) >= 8)
+            switches += v[0];
+    }
+
+    for (int i = 0; i < PERF_MAX; i++) {
+        render("# TYPE sehttpd_perf_%s_total counter\n"
+               "sehttpd_perf_%s_total %" PRIu64 "\n",
+               event_names[i], event_names[i], sum.count[i]);
+    }
+    render("# TYPE sehttpd_perf_context_switches_total counter\n"
+           "sehttpd_perf_context_switches_total %" PRIu64 "\n"
+           "# TYPE sehttpd_perf_requests_total counter\n"
+           "sehttpd_perf_requests_total %" PRIu64 "\n"
+           "# TYPE sehttpd_perf_wakeups_total counter\n"
+           "sehttpd_perf_wakeups_total %" PRIu64 "\n",
+           switches, sum.requests, sum.samples);
+
+    double requests = sum.requests ? sum.requests : 1;
+    render("# TYPE sehttpd_perf_cycles_per_request gauge\n"
+           "sehttpd_perf_cycles_per_request %.1f\n"
+           "# TYPE sehttpd_perf_instructions_per_request gauge\n"
+           "sehttpd_perf_instructions_per_request %.1f\n"
+           "# TYPE sehttpd_perf_cache_misses_per_request gauge\n"
+           "sehttpd_perf_cache_misses_per_request %.2f\n"
+           "# TYPE sehttpd_perf_instructions_per_cycle gauge\n"
+           "sehttpd_perf_instructions_per_cycle %.3f\n",
+           sum.count[PERF_cycles] / requests,
+           sum.count[PERF_instructions] / requests,
+           sum.count[PERF_cache_misses] / requests,
+           sum.count[PERF_cycles]
+               ? (double) sum.count[PERF_instructions] / sum.count[PERF_cycles]
+               : 0.0);
+
+    return len;
+}
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* hardware counters around request handling, compiled in with
+ * "make PERF=1". Without PERF_COUNTERS every hook below expands to nothing.
+ */
+#ifdef PERF_COUNTERS
+
+#define PERF_EVENTS(X) X(cycles), X(instructions), X(cache_misses)
+
+#define perf_event_entry(name) PERF_##name
+enum { PERF_EVENTS(perf_event_entry), PERF_MAX };
+#undef perf_event_entry
+
+typedef struct {
+    uint64_t count[PERF_MAX];
+    uint64_t requests; /* responses counted by the stats */
+} perf_sample_t;
+
+void perf_register();
+void perf_read(perf_sample_t *s);
+void perf_record(const perf_sample_t *start);
+size_t perf_render(char *buf, size_t size);
+
+#define perf_begin(s) \
+    perf_sample_t s;  \
+    perf_read(&s)
+#define perf_end(s) perf_record(&s)
+
+#else
+
+#define perf_register()
+#define perf_render(buf, size) ((size_t) 0)
+#define perf_begin(s)
+#define perf_end(s)
+
+#endif
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef PROBE_H
+#define PROBE_H
+
+#include <stdint.h>
+
+/* USDT (user-level statically defined tracing) probes.
+ *
+ * Each probe is a single nop plus an entry in the .note.stapsdt ELF section
+ * telling tracers where the nop is and where to find the arguments, the same
+ * layout <sys/sdt.h> emits. Nothing happens at run time until a tracer such
+ * as bpftrace or BCC attaches and patches the nop into a breakpoint. All
+ * arguments are passed as signed 64-bit values. List them with
+ *     readelf -n sehttpd
+ */
+#if defined(__x86_64__) || defined(__aarch64__)
+
+#define _PROBE_NOTE(name, args)                       \
+    "990: nop\n"                                      \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n"     \
+    ".balign 4\n"                                     \
+    ".4byte 992f-991f, 994f-993f, 3\n"                \
+    "991: .asciz \"stapsdt\"\n"                       \
+    "992: .balign 4\n"                                \
+    "993: .8byte 990b\n"                              \
+    ".8byte _.stapsdt.base\n"                         \
+    ".8byte 0\n"                                      \
+    ".asciz \"sehttpd\"\n"                            \
+    ".asciz \"" #name "\"\n"                          \
+    ".asciz \"" args "\"\n"                           \
+    "994: .balign 4\n"                                \
+    ".popsection\n"                                   \
+    ".ifndef _.stapsdt.base\n"                        \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\"," \
+    ".stapsdt.base,comdat\n"                          \
+    ".weak _.stapsdt.base\n"                          \
+    ".hidden _.stapsdt.base\n"                        \
+    "_.stapsdt.base: .space 1\n"                      \
+    ".size _.stapsdt.base, 1\n"                       \
+    ".popsection\n"                                   \
+    ".endif\n"
+
+#define _PROBE_ARG(x) "nor"((int64_t)(x))
+
+#define PROBE1(name, a1) \
+    __asm__ __volatile__(_PROBE_NOTE(name, "-8@%0") : : _PROBE_ARG(a1))
+#define PROBE2(name, a1, a2)                              \
+    __asm__ __volatile__(_PROBE_NOTE(name, "-8@%0 -8@%1") \
+                         :                                \
+                         : _PROBE_ARG(a1), _PROBE_ARG(a2))
+#define PROBE3(name, a1, a2, a3)                                \
+    __asm__ __volatile__(_PROBE_NOTE(name, "-8@%0 -8@%1 -8@%2") \
+                         :                                      \
+                         : _PROBE_ARG(a1), _PROBE_ARG(a2), _PROBE_ARG(a3))
+#define PROBE4(name, a1, a2, a3, a4)                                       \
+    __asm__ __volatile__(_PROBE_NOTE(name, "-8@%0 -8@%1 -8@%2 -8@%3")      \
+                         :                                                 \
+                         : _PROBE_ARG(a1), _PROBE_ARG(a2), _PROBE_ARG(a3), \
+                           _PROBE_ARG(a4))
+
+#else
+
+#define PROBE1(name, a1)
+#define PROBE2(name, a1, a2)
+#define PROBE3(name, a1, a2, a3)
+#define PROBE4(name, a1, a2, a3, a4)
+
+#endif
+
+/* request lifecycle, see ebpf/sehttpd-lifecycle.bt */
+#define probe_accept(fd) PROBE1(accept, fd)
+#define probe_request_parsed(fd, method, uri, uri_len) \
+    PROBE4(request_parsed, fd, method, uri, uri_len)
+#define probe_response_start(fd, status) PROBE2(response_start, fd, status)
+#define probe_response_done(fd, status, bytes) \
+    PROBE3(response_done, fd, status, bytes)
+#define probe_timer_expire(fd) PROBE1(timer_expire, fd)
+#define probe_close(fd) PROBE1(close, fd)
+
+#endif
@@ -0,0 +1,1043 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for the sake of splice(2) and memmem(3) */
+#endif
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "access_log.h"
+#include "logger.h"
+#include "probe.h"
+#include "proxy.h"
+#include "proxy_cache.h"
+#include "stats.h"
+#include "timer.h"
+#include "zerocopy.h"
+
+#define PROXY_MAX_ROUTES 16
+
+/* idle connections kept per upstream, and for how long (ms) */
+#define PROXY_POOL_MAX 32
+#define PROXY_IDLE_TIMEOUT 30000
+
+/* longest wait for the upstream before the client gets a 504 (ms) */
+#define PROXY_TIMEOUT 10000
+
+/* bytes moved into the pipe per splice(2) */
+#define PROXY_SPLICE_MAX (64 * 1024)
+
+/* room for the upstream response header */
+#define PROXY_HEADER_MAX 8192
+
+/* longest cache key, Host and URI */
+#define PROXY_KEY_MAX 1024
+
+typedef struct {
+    char *prefix;
+    size_t prefix_len;
+    char *authority; /* Host header for clients that sent none */
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+} route_t;
+
+typedef struct {
+    http_request_t conn; /* first, so epoll hands out the upstream_t too */
+    int pipe[2];
+    int route;
+    char buf[PROXY_HEADER_MAX]; /* conn.buf */
+} upstream_t;
+
+typedef struct {
+    upstream_t *idle[PROXY_POOL_MAX];
+    int n;
+} pool_t;
+
+enum {
+    PROXY_CONNECTING,
+    PROXY_REQUEST_BODY, /* streaming the client's body upstream */
+    PROXY_HEADER,
+    PROXY_BODY,
+    PROXY_FILL,    /* reading a body into the cache */
+    PROXY_WAITING, /* queued on a pending cache entry */
+    PROXY_SEND,    /* sending a cached response */
+};
+
+typedef struct {
+    http_request_t *client;
+    upstream_t *up;
+    int route;
+    int state;
+    bool keep_alive; /* of the client connection */
+    bool head;
+    bool reused;   /* the upstream connection came from the pool */
+    bool reusable; /* and may go back to it */
+    bool streamed; /* a request body went upstream, there is no retry */
+    bool chunked;  /* the response body ends with its last chunk */
+    int status;    /* set once the response header went out */
+    int64_t remaining; /* body bytes still to relay, -1 until upstream EOF */
+    size_t piped;      /* bytes sitting in the pipe */
+    ssize_t sent;
+    uint64_t start_ns;
+
+    bool cacheable;        /* the request may be answered from the cache */
+    cache_entry_t *fill;   /* pending entry this fetch fills */
+    cache_entry_t *entry;  /* cached response being sent */
+    list_head wait;        /* on fill->waiters while PROXY_WAITING */
+    char *body;            /* body read for the cache */
+    size_t body_len, body_got;
+    time_t expires;
+    size_t out_off;        /* of the response header in req */
+    size_t body_off;       /* of the cached body */
+    bool client_timer;
+    size_t key_len;
+    char key[PROXY_KEY_MAX];
+
+    size_t req_len;
+    char req[PROXY_HEADER_MAX + 512]; /* upstream request, then header */
+} proxy_t;
+
+static route_t routes[PROXY_MAX_ROUTES];
+static int nroutes;
+static __thread pool_t pools[PROXY_MAX_ROUTES];
+
+static void upstream_close(upstream_t *up)
+{
+    close(up->conn.fd);
+    close(up->pipe[0]);
+    close(up->pipe[1]);
+    free(up);
+}
+
+/* timer callback of an idle pooled connection */
+static int upstream_expire(http_request_t *conn)
+{
+    upstream_t *up = (upstream_t *) conn;
+    pool_t *pool = &pools[up->route];
+    for (int i = 0; i < pool->n; i++) {
+        if (pool->idle[i] == up) {
+            pool->idle[i] = pool->idle[--pool->n];
+            break;
+        }
+    }
+    upstream_close(up);
+    return 0;
+}
+
+static void upstream_put(upstream_t *up)
+{
+    pool_t *pool = &pools[up->route];
+    if (pool->n == PROXY_POOL_MAX) {
+        upstream_close(up);
+        return;
+    }
+
+    /* left disarmed in epoll; a connection the upstream closed meanwhile is
+     * noticed when it is next used
+     */
+    pool->idle[pool->n++] = up;
+    add_timer(&up->conn, PROXY_IDLE_TIMEOUT, upstream_expire);
+}
+
+static upstream_t *upstream_connect(int route, int epfd)
+{
+    const route_t *rt = &routes[route];
+    int fd = socket(rt->addr.ss_family,
+                    SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_err("proxy: socket");
+        return NULL;
+    }
+
+    if (rt->addr.ss_family != AF_UNIX) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    if (connect(fd, (const struct sockaddr *) &rt->addr, rt->addr_len) < 0 &&
+        errno != EINPROGRESS) {
+        log_err("proxy: connect to upstream of %s", rt->prefix);
+        close(fd);
+        return NULL;
+    }
+
+    upstream_t *up = malloc(sizeof(upstream_t));
+    if (!up || pipe2(up->pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        log_err("proxy: no upstream connection");
+        free(up);
+        close(fd);
+        return NULL;
+    }
+
+    init_http_request(&up->conn, fd, epfd, NULL);
+    up->conn.buf = up->buf;
+    up->conn.buf_size = sizeof(up->buf);
+    up->route = route;
+
+    /* writable once connected */
+    struct epoll_event event = {
+        .data.ptr = &up->conn,
+        .events = EPOLLOUT | EPOLLONESHOT,
+    };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event);
+    return up;
+}
+
+static void arm(http_request_t *conn, uint32_t events)
+{
+    struct epoll_event event = {
+        .data.ptr = conn,
+        .events = events | EPOLLONESHOT,
+    };
+    epoll_ctl(conn->epfd, EPOLL_CTL_MOD, conn->fd, &event);
+}
+
+static int proxy_timeout(http_request_t *conn);
+
+/* restart the upstream timer, every event is progress */
+static void touch(proxy_t *p)
+{
+    del_timer(&p->up->conn);
+    add_timer(&p->up->conn, PROXY_TIMEOUT, proxy_timeout);
+}
+
+static void release_upstream(proxy_t *p, bool ok)
+{
+    upstream_t *up = p->up;
+    if (!up)
+        return;
+
+    del_timer(&up->conn);
+    up->conn.proxy = NULL;
+    if (ok && p->reusable && !p->piped)
+        upstream_put(up);
+    else
+        upstream_close(up);
+    p->up = NULL;
+}
+
+static void abort_fill(proxy_t *p);
+
+static void finish(proxy_t *p, bool ok)
+{
+    release_upstream(p, ok);
+    if (p->fill)
+        abort_fill(p);
+    free(p->body);
+    if (p->entry)
+        proxy_cache_put(p->entry);
+
+    http_request_t *r = p->client;
+    if (p->client_timer)
+        del_timer(r);
+    probe_response_done(r->fd, p->status, p->sent);
+    if (access_log_enabled && p->status)
+        access_log_append(r, p->status, p->sent, p->start_ns);
+
+    r->proxy = NULL;
+    if (ok && p->keep_alive && r->pos != r->last) {
+        /* a pipelined request is buffered already, no event will come */
+        http_requeue(r);
+    } else if (ok && p->keep_alive) {
+        arm(r, EPOLLIN | EPOLLET);
+        add_idle_timer(r, http_keepalive_timeout(), http_close_conn);
+    } else {
+        http_close_conn(r);
+    }
+    free(p);
+}
+
+/* give up on the exchange, telling the client if nothing was sent yet */
+static void fail(proxy_t *p, int status)
+{
+    if (!p->status) {
+        p->status = status;
+        ssize_t n = http_send_error(p->client->fd, status);
+        p->sent = n > 0 ? n : 0;
+    }
+    finish(p, false);
+}
+
+static int proxy_timeout(http_request_t *conn)
+{
+    fail(conn->proxy, 504);
+    return 0;
+}
+
+static int send_timeout(http_request_t *r)
+{
+    finish(r->proxy, false);
+    return 0;
+}
+
+/* send the response header in req, then the cached body */
+static void send_entry(proxy_t *p)
+{
+    http_request_t *r = p->client;
+    const cache_entry_t *e = p->entry;
+
+    while (p->out_off < p->req_len) {
+        ssize_t n = send(r->fd, p->req + p->out_off, p->req_len - p->out_off,
+                         MSG_NOSIGNAL | (p->remaining ? MSG_MORE : 0));
+        if (n < 0)
+            goto blocked;
+        p->out_off += n;
+        p->sent += n;
+        stats_add(bytes_sent, n);
+    }
+
+    while (p->remaining > 0) {
+        ssize_t n;
+        if (e->fd >= 0) {
+            off_t off = p->body_off;
+            n = sendfile(r->fd, e->fd, &off, p->remaining);
+        } else {
+            n = send(r->fd, e->body + p->body_off, p->remaining, MSG_NOSIGNAL);
+        }
+        if (n == 0)
+            errno = EIO; /* the cache file came up short */
+        if (n <= 0)
+            goto blocked;
+        p->body_off += n;
+        p->remaining -= n;
+        p->sent += n;
+        stats_add(bytes_sent, n);
+    }
+
+    finish(p, true);
+    return;
+
+blocked:
+    if (errno != EAGAIN) {
+        finish(p, false);
+        return;
+    }
+    if (p->client_timer)
+        del_timer(r);
+    add_timer(r, PROXY_TIMEOUT, send_timeout);
+    p->client_timer = true;
+    arm(r, EPOLLOUT);
+}
+
+/* answer from a fresh cache entry */
+static void serve_entry(proxy_t *p, cache_entry_t *e)
+{
+    proxy_cache_get(e);
+    p->entry = e;
+    p->state = PROXY_SEND;
+    p->status = atoi(e->header + 9);
+    p->remaining = p->head ? 0 : (int64_t) e->body_len;
+
+    size_t len = e->header_len;
+    memcpy(p->req, e->header, len);
+    len += sprintf(p->req + len, "Age: %ld\r\nConnection: %s\r\n\r\n",
+                   (long) (time(NULL) - e->stored),
+                   p->keep_alive ? "keep-alive" : "close");
+    p->req_len = len;
+    p->out_off = 0;
+    p->body_off = 0;
+
+    probe_response_start(p->client->fd, p->status);
+    stats_count_status(p->status);
+    send_entry(p);
+}
+
+static bool attach_upstream(proxy_t *p)
+{
+    pool_t *pool = &pools[p->route];
+    upstream_t *up;
+    if (pool->n) {
+        up = pool->idle[--pool->n];
+        del_timer(&up->conn);
+        p->reused = true;
+        p->state = PROXY_HEADER;
+    } else {
+        up = upstream_connect(p->route, p->client->epfd);
+        if (!up)
+            return false;
+        p->reused = false;
+        p->state = PROXY_CONNECTING;
+    }
+
+    p->up = up;
+    up->conn.proxy = p;
+    add_timer(&up->conn, PROXY_TIMEOUT, proxy_timeout);
+    return true;
+}
+
+static void send_request(proxy_t *p);
+static void send_body(proxy_t *p);
+
+/* a pooled connection turned out to be closed by the upstream, start over on
+ * the next one
+ */
+static void retry(proxy_t *p)
+{
+    del_timer(&p->up->conn);
+    upstream_close(p->up);
+    p->up = NULL;
+
+    if (!attach_upstream(p))
+        fail(p, 502);
+    else if (p->state == PROXY_HEADER)
+        send_request(p);
+}
+
+static void send_request(proxy_t *p)
+{
+    http_request_t *conn = &p->up->conn;
+    size_t off = 0;
+    while (off < p->req_len) {
+        ssize_t n =
+            send(conn->fd, p->req + off, p->req_len - off, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            if (p->reused && off == 0)
+                retry(p);
+            else
+                fail(p, 502);
+            return;
+        }
+        off += n;
+    }
+
+    if (p->client->body_state) {
+        p->state = PROXY_REQUEST_BODY;
+        p->streamed = true;
+        http_body_continue(p->client);
+        send_body(p);
+        return;
+    }
+
+    conn->pos = conn->last = 0;
+    p->state = PROXY_HEADER;
+    arm(conn, EPOLLIN);
+}
+
+/* stream the request body upstream as it arrives, chunk framing included,
+ * through the upstream's pipe; then wait for the response
+ */
+static void send_body(proxy_t *p)
+{
+    http_request_t *conn = &p->up->conn;
+    int rc = http_body_pump(p->client, conn->fd, p->up->pipe, &p->piped, true);
+    if (rc == EAGAIN) {
+        arm(p->client, EPOLLIN);
+        return;
+    }
+    if (rc == HTTP_BODY_BLOCKED) {
+        arm(conn, EPOLLOUT);
+        return;
+    }
+    if (rc != 0) {
+        fail(p, errno == EFBIG ? 413 : errno == EINVAL ? 400 : 502);
+        return;
+    }
+
+    conn->pos = conn->last = 0;
+    p->state = PROXY_HEADER;
+    arm(conn, EPOLLIN);
+}
+
+/* move the next part of a chunked body into the pipe. Chunk data is spliced,
+ * the framing read into the upstream buffer and followed to the end of the
+ * body. Returns what read(2) would.
+ */
+static ssize_t pull_chunked(proxy_t *p)
+{
+    http_request_t *conn = &p->up->conn;
+    int64_t data = http_body_data_left(conn);
+    ssize_t n;
+    if (data)
+        n = splice(conn->fd, NULL, p->up->pipe[1], NULL,
+                   data < PROXY_SPLICE_MAX ? data : PROXY_SPLICE_MAX,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    else
+        n = read(conn->fd, conn->buf, conn->buf_size);
+    if (n <= 0)
+        return n;
+
+    conn->pos = 0;
+    ssize_t body = http_body_scan(conn, n);
+    if (body < 0) {
+        errno = EPROTO;
+        return -1;
+    }
+    if (!data && write(p->up->pipe[1], conn->buf, body) != body)
+        return -1;
+    if (body < n) /* more than the response, the connection is not reused */
+        p->reusable = false;
+    if (!conn->body_state)
+        p->remaining = 0;
+    return body;
+}
+
+static void relay(proxy_t *p)
+{
+    upstream_t *up = p->up;
+    http_request_t *r = p->client;
+
+    for (;;) {
+        if (!p->piped) {
+            if (p->remaining == 0) {
+                finish(p, true);
+                return;
+            }
+
+            size_t want = PROXY_SPLICE_MAX;
+            if (p->remaining > 0 && p->remaining < PROXY_SPLICE_MAX)
+                want = p->remaining;
+            ssize_t n =
+                p->chunked ? pull_chunked(p)
+                           : splice(up->conn.fd, NULL, up->pipe[1], NULL, want,
+                                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n == 0) { /* a body without a length ends here */
+                finish(p, p->remaining < 0 && !p->chunked);
+                return;
+            }
+            if (n < 0) {
+                if (errno == EAGAIN) {
+                    arm(&up->conn, EPOLLIN);
+                    return;
+                }
+                finish(p, false);
+                return;
+            }
+            p->piped = n;
+        }
+
+        ssize_t n = splice(up->pipe[0], NULL, r->fd, NULL, p->piped,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0) {
+            if (errno == EAGAIN) {
+                arm(r, EPOLLOUT);
+                return;
+            }
+            finish(p, false);
+            return;
+        }
+        p->piped -= n;
+        p->sent += n;
+        if (p->remaining > 0)
+            p->remaining -= n;
+        stats_add(bytes_sent, n);
+    }
+}
+
+/* the fetch for a pending entry ended without a response to store. The
+ * queued requests go upstream on their own, or share the failure when the
+ * upstream could not be reached.
+ */
+static void abort_fill(proxy_t *p)
+{
+    cache_entry_t *e = p->fill;
+    p->fill = NULL;
+    proxy_cache_abort(e);
+
+    while (!list_empty(&e->waiters)) {
+        proxy_t *w = list_entry(e->waiters.next, proxy_t, wait);
+        list_del(&w->wait);
+        if (p->status == 502 || p->status == 504)
+            fail(w, p->status);
+        else if (!attach_upstream(w))
+            fail(w, 502);
+        else if (w->state == PROXY_HEADER)
+            send_request(w);
+    }
+    proxy_cache_put(e);
+}
+
+static void fill_body(proxy_t *p)
+{
+    http_request_t *conn = &p->up->conn;
+    while (p->body_got < p->body_len) {
+        ssize_t n =
+            read(conn->fd, p->body + p->body_got, p->body_len - p->body_got);
+        if (n < 0 && errno == EAGAIN) {
+            arm(conn, EPOLLIN);
+            return;
+        }
+        if (n <= 0) {
+            fail(p, 502);
+            return;
+        }
+        p->body_got += n;
+    }
+
+    release_upstream(p, true);
+
+    /* without memory for the entry the waiters share the failure */
+    cache_entry_t *e = p->fill;
+    if (!proxy_cache_commit(e, p->req, p->req_len, p->body, p->body_len,
+                            p->expires)) {
+        fail(p, 502);
+        return;
+    }
+    p->fill = NULL;
+    p->body = NULL;
+
+    while (!list_empty(&e->waiters)) {
+        proxy_t *w = list_entry(e->waiters.next, proxy_t, wait);
+        list_del(&w->wait);
+        serve_entry(w, e);
+    }
+    serve_entry(p, e);
+    proxy_cache_put(e);
+}
+
+/* read a storable response whole before answering from the cache */
+static void start_fill(proxy_t *p,
+                       const char *hdr,
+                       size_t len,
+                       const char *body,
+                       size_t body_len)
+{
+    p->body_len = p->remaining;
+    p->body = malloc(p->body_len ? p->body_len : 1);
+    if (!p->body) {
+        fail(p, 502);
+        return;
+    }
+    memcpy(p->body, body, body_len);
+    p->body_got = body_len;
+
+    /* the request is sent, req now keeps the header to store */
+    memcpy(p->req, hdr, len);
+    p->req_len = len;
+    p->state = PROXY_FILL;
+    fill_body(p);
+}
+
+static bool header_is(const char *line, size_t len, const char *name)
+{
+    size_t n = strlen(name);
+    return len > n && line[n] == ':' && !strncasecmp(line, name, n);
+}
+
+/* read and rewrite the response header, then relay what came with it */
+static void read_header(proxy_t *p)
+{
+    http_request_t *conn = &p->up->conn;
+    char *end;
+    for (;;) {
+        ssize_t n =
+            read(conn->fd, conn->buf + conn->last, conn->buf_size - conn->last);
+        if (n < 0 && errno == EAGAIN) {
+            arm(conn, EPOLLIN);
+            return;
+        }
+        if (n <= 0) {
+            if (p->reused && conn->last == 0 && !p->streamed)
+                retry(p);
+            else
+                fail(p, 502);
+            return;
+        }
+
+        conn->last += n;
+        end = memmem(conn->buf, conn->last, "\r\n\r\n", 4);
+        if (end)
+            break;
+        if (conn->last == conn->buf_size) {
+            fail(p, 502);
+            return;
+        }
+    }
+
+    char *line = conn->buf;
+    char *eol = memchr(line, '\r', end + 2 - line);
+    if (strncmp(line, "HTTP/1.", 7) || eol - line < 12) {
+        fail(p, 502);
+        return;
+    }
+    int status = atoi(line + 9);
+
+    p->remaining = -1;
+    p->chunked = false;
+    p->reusable = strncmp(line, "HTTP/1.0", 8) != 0;
+    if (p->head || status == 204 || status == 304 || status / 100 == 1)
+        p->remaining = 0;
+
+    /* the status line and every header but the hop-by-hop ones */
+    char hdr[PROXY_HEADER_MAX + 64];
+    size_t len = eol + 2 - line;
+    memcpy(hdr, line, len);
+    const char *cc = NULL, *expires = NULL;
+    size_t cc_len = 0, expires_len = 0;
+    bool storable = p->fill && status == HTTP_OK;
+    for (line = eol + 2; line < end + 2; line = eol + 2) {
+        eol = memchr(line, '\r', end + 2 - line);
+        size_t n = eol - line;
+        if (header_is(line, n, "Content-Length")) {
+            if (p->remaining && !p->chunked)
+                p->remaining = strtoll(line + 15, NULL, 10);
+        } else if (header_is(line, n, "Transfer-Encoding")) {
+            /* the framing is relayed as is, and read along */
+            if (p->remaining && memmem(line, n, "chunked", 7)) {
+                p->chunked = true;
+                p->remaining = -1;
+            }
+        } else if (header_is(line, n, "Cache-Control")) {
+            cc = line + 14;
+            cc_len = n - 14;
+        } else if (header_is(line, n, "Expires")) {
+            expires = line + 8;
+            expires_len = n - 8;
+            while (expires_len && *expires == ' ')
+                expires++, expires_len--;
+        } else if (header_is(line, n, "Set-Cookie") ||
+                   header_is(line, n, "Vary")) {
+            storable = false;
+        } else if (header_is(line, n, "Connection")) {
+            if (memmem(line, n, "close", 5))
+                p->reusable = false;
+            continue;
+        } else if (header_is(line, n, "Keep-Alive")) {
+            continue;
+        }
+        memcpy(hdr + len, line, n + 2);
+        len += n + 2;
+    }
+
+    /* without a length the body ends with the upstream connection */
+    if (p->remaining < 0 && !p->chunked) {
+        p->reusable = false;
+        p->keep_alive = false;
+    }
+
+    size_t body = conn->last - (end + 4 - conn->buf);
+    if (p->remaining >= 0 && (int64_t) body > p->remaining)
+        body = p->remaining;
+
+    if (p->chunked) {
+        http_body_chunked(conn);
+        conn->pos = end + 4 - conn->buf;
+        ssize_t n = http_body_scan(conn, body);
+        if (n < 0) {
+            fail(p, 502);
+            return;
+        }
+        if ((size_t) n < body)
+            p->reusable = false;
+        body = n;
+        if (!conn->body_state)
+            p->remaining = 0;
+    }
+
+    if (storable && p->remaining >= 0 &&
+        (size_t) p->remaining <= proxy_cache_max_object() &&
+        (p->expires = proxy_cache_lifetime(cc, cc_len, expires, expires_len))) {
+        start_fill(p, hdr, len, end + 4, body);
+        return;
+    }
+    if (p->fill)
+        abort_fill(p);
+
+    len += sprintf(hdr + len, "Connection: %s\r\n\r\n",
+                   p->keep_alive ? "keep-alive" : "close");
+
+    probe_response_start(p->client->fd, status);
+    stats_count_status(status);
+    p->status = status;
+
+    if (p->remaining > 0)
+        p->remaining -= body;
+
+    ssize_t sent = send(p->client->fd, hdr, len, MSG_NOSIGNAL | MSG_MORE);
+    if (sent == (ssize_t) len && body)
+        sent += send(p->client->fd, end + 4, body, MSG_NOSIGNAL);
+    if (sent != (ssize_t) (len + body)) {
+        finish(p, false);
+        return;
+    }
+    p->sent = sent;
+    stats_add(bytes_sent, sent);
+
+    p->state = PROXY_BODY;
+    relay(p);
+}
+
+static const char *method_name(int method)
+{
+    switch (method) {
+    case HTTP_GET:
+        return "GET";
+    case HTTP_HEAD:
+        return "HEAD";
+    case HTTP_POST:
+        return "POST";
+    default:
+        return NULL;
+    }
+}
+
+#define append(...)                                           \
+    do {                                                      \
+        int _n = snprintf(p->req + len, sizeof(p->req) - len, \
+                          ##__VA_ARGS__);                     \
+        if (_n < 0 || (size_t) _n >= sizeof(p->req) - len)    \
+            return false;                                     \
+        len += _n;                                            \
+    } while (0)
+
+/* the cache key: Host, a space and the URI */
+static void set_key(proxy_t *p, const char *host, size_t len)
+{
+    http_request_t *r = p->client;
+    size_t uri_len = (char *) r->uri_end - (char *) r->uri_start;
+    if (len + 1 + uri_len > PROXY_KEY_MAX) {
+        p->cacheable = false;
+        return;
+    }
+    memcpy(p->key, host, len);
+    p->key[len] = ' ';
+    memcpy(p->key + len + 1, r->uri_start, uri_len);
+    p->key_len = len + 1 + uri_len;
+}
+
+/* the upstream request: the client's, minus its hop-by-hop headers */
+static bool build_request(proxy_t *p)
+{
+    http_request_t *r = p->client;
+    const char *method = method_name(r->method);
+    if (!method)
+        return false;
+
+    size_t len = 0;
+    append("%s %.*s HTTP/1.1\r\n", method,
+           (int) ((char *) r->uri_end - (char *) r->uri_start),
+           (char *) r->uri_start);
+
+    bool has_host = false;
+    p->cacheable =
+        proxy_cache_enabled() && r->method != HTTP_POST && !r->body_state;
+    p->key_len = 0;
+    list_head *pos;
+    list_for_each (pos, &(r->list)) {
+        http_header_t *h = list_entry(pos, http_header_t, list);
+        int klen = (char *) h->key_end - (char *) h->key_start;
+        int vlen = (char *) h->value_end - (char *) h->value_start;
+        const char *key = h->key_start;
+        /* 100 Continue comes from here, once the upstream is connected */
+        if ((klen == 10 && !strncasecmp(key, "Connection", 10)) ||
+            (klen == 10 && !strncasecmp(key, "Keep-Alive", 10)) ||
+            (klen == 6 && !strncasecmp(key, "Expect", 6)))
+            continue;
+        if (klen == 4 && !strncasecmp(key, "Host", 4)) {
+            has_host = true;
+            set_key(p, h->value_start, vlen);
+        }
+        if (klen == 13 && !strncasecmp(key, "Authorization", 13))
+            p->cacheable = false;
+        append("%.*s: %.*s\r\n", klen, key, vlen, (char *) h->value_start);
+    }
+    if (!has_host) {
+        append("Host: %s\r\n", routes[p->route].authority);
+        set_key(p, routes[p->route].authority,
+                strlen(routes[p->route].authority));
+    }
+
+    char addr[INET_ADDRSTRLEN];
+    struct in_addr in = {.s_addr = r->addr};
+    inet_ntop(AF_INET, &in, addr, sizeof(addr));
+    append("X-Forwarded-For: %s\r\nConnection: keep-alive\r\n\r\n", addr);
+
+    p->req_len = len;
+    return true;
+}
+
+#undef append
+
+void proxy_start(http_request_t *r, int route, uint64_t start_ns)
+{
+    proxy_t *p = malloc(sizeof(proxy_t));
+    if (!p) {
+        log_err("no enough space for proxy_t");
+        http_close_conn(r);
+        return;
+    }
+
+    p->client = r;
+    p->up = NULL;
+    p->route = route;
+    p->head = r->method == HTTP_HEAD;
+    p->status = 0;
+    p->piped = 0;
+    p->sent = 0;
+    p->start_ns = start_ns;
+    p->fill = NULL;
+    p->entry = NULL;
+    p->body = NULL;
+    p->client_timer = false;
+    p->streamed = false;
+    r->proxy = p;
+
+    bool ok = build_request(p);
+
+    /* the header list is consumed here, only Connection matters */
+    http_out_t out = {.fd = r->fd, .keep_alive = false, .modified = true};
+    http_handle_header(r, &out);
+    p->keep_alive = out.keep_alive;
+
+    if (ok && p->cacheable) {
+        cache_entry_t *e = proxy_cache_lookup(p->key, p->key_len);
+        if (e && !e->pending) {
+            serve_entry(p, e);
+            return;
+        }
+        if (e) {
+            list_add_tail(&p->wait, &e->waiters);
+            p->state = PROXY_WAITING;
+            return;
+        }
+        if (r->method == HTTP_GET) {
+            p->fill = proxy_cache_begin(p->key, p->key_len);
+            if (p->fill)
+                proxy_cache_get(p->fill);
+        }
+    }
+
+    if (!ok || !attach_upstream(p)) {
+        fail(p, 502);
+        return;
+    }
+    if (p->state == PROXY_HEADER)
+        send_request(p);
+}
+
+void proxy_event(http_request_t *conn, uint32_t events)
+{
+    proxy_t *p = conn->proxy;
+
+    if (conn == p->client) {
+        /* zerocopy completions of an earlier response are not errors */
+        if ((events & EPOLLERR) && conn->zc_pending &&
+            zerocopy_complete(conn))
+            events &= ~EPOLLERR;
+        if (events & (EPOLLERR | EPOLLHUP)) {
+            finish(p, false);
+            return;
+        }
+        /* a client that takes the body is progress as well */
+        if (p->up)
+            touch(p);
+        if (p->state == PROXY_REQUEST_BODY) {
+            send_body(p);
+            return;
+        }
+        if (!(events & EPOLLOUT))
+            arm(conn, EPOLLOUT);
+        else if (p->state == PROXY_SEND)
+            send_entry(p);
+        else
+            relay(p);
+        return;
+    }
+
+    touch(p);
+    switch (p->state) {
+    case PROXY_CONNECTING: {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 ||
+            err) {
+            errno = err;
+            log_err("proxy: connect to upstream of %s",
+                    routes[p->route].prefix);
+            fail(p, 502);
+            return;
+        }
+        send_request(p);
+        break;
+    }
+    case PROXY_REQUEST_BODY:
+        send_body(p);
+        break;
+    case PROXY_HEADER:
+        read_header(p);
+        break;
+    case PROXY_BODY:
+        relay(p);
+        break;
+    case PROXY_FILL:
+        fill_body(p);
+        break;
+    }
+}
+
+int proxy_match(const char *uri, size_t len)
+{
+    for (int i = 0; i < nroutes; i++) {
+        if (len >= routes[i].prefix_len &&
+            !memcmp(uri, routes[i].prefix, routes[i].prefix_len))
+            return i;
+    }
+    return -1;
+}
+
+/* "PREFIX=HOST:PORT" or "PREFIX=unix:PATH" */
+bool proxy_add_route(const char *spec)
+{
+    if (nroutes == PROXY_MAX_ROUTES) {
+        log_err("proxy: at most %d routes", PROXY_MAX_ROUTES);
+        return false;
+    }
+
+    const char *eq = strchr(spec, '=');
+    if (!eq || eq == spec || spec[0] != '/') {
+        log_err("proxy: expected PREFIX=ADDRESS, got %s", spec);
+        return false;
+    }
+
+    route_t *rt = &routes[nroutes];
+    memset(rt, 0, sizeof(route_t));
+    rt->prefix = strndup(spec, eq - spec);
+    rt->prefix_len = eq - spec;
+    const char *target = eq + 1;
+
+    if (!strncmp(target, "unix:", 5)) {
+        struct sockaddr_un *un = (struct sockaddr_un *) &rt->addr;
+        if (strlen(target + 5) >= sizeof(un->sun_path)) {
+            log_err("proxy: socket path too long: %s", target + 5);
+            return false;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, target + 5);
+        rt->addr_len = sizeof(struct sockaddr_un);
+        rt->authority = "localhost";
+    } else {
+        const char *colon = strrchr(target, ':');
+        if (!colon) {
+            log_err("proxy: expected HOST:PORT, got %s", target);
+            return false;
+        }
+        char *host = strndup(target, colon - target);
+        struct addrinfo hints = {.ai_socktype = SOCK_STREAM}, *res;
+        int rc = getaddrinfo(host, colon + 1, &hints, &res);
+        free(host);
+        if (rc) {
+            log_err("proxy: %s: %s", target, gai_strerror(rc));
+            return false;
+        }
+        memcpy(&rt->addr, res->ai_addr, res->ai_addrlen);
+        rt->addr_len = res->ai_addrlen;
+        freeaddrinfo(res);
+        rt->authority = strdup(target);
+    }
+
+    nroutes++;
+    return true;
+}
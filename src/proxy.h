@@ -0,0 +1,27 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "http.h"
+
+/* Reverse proxy.
+ *
+ * Requests whose path starts with a configured prefix are forwarded to an
+ * upstream HTTP/1.1 server over TCP or a Unix socket. Every worker keeps a
+ * pool of idle keep-alive connections to each upstream. The response header
+ * is read into the upstream connection's buffer and rewritten for the
+ * client; the body is moved with splice(2) through a pipe and never copied
+ * to user space. Responses without a Content-length are relayed until the
+ * upstream closes, and both connections are closed after them. Request
+ * bodies take the same way upstream, chunk framing included, before the
+ * response is awaited.
+ */
+bool proxy_add_route(const char *spec);
+int proxy_match(const char *uri, size_t len);
+void proxy_start(http_request_t *r, int route, uint64_t start_ns);
+void proxy_event(http_request_t *r, uint32_t events);
+
+#endif
@@ -0,0 +1,290 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for the sake of O_TMPFILE, strptime(3) and timegm(3) */
+#endif
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "proxy_cache.h"
+
+/* hash buckets per worker, must be a power of 2 */
+#define CACHE_BUCKETS 4096
+
+typedef struct {
+    cache_entry_t *buckets[CACHE_BUCKETS];
+    list_head lru; /* most recently used first */
+    size_t used;
+} cache_t;
+
+static _Atomic size_t cache_budget; /* per worker, changed by a reload */
+static const char *cache_dir;
+static __thread cache_t *cache;
+
+bool proxy_cache_init(size_t budget, const char *dir)
+{
+    if (dir) {
+        int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+        if (fd < 0) {
+            log_err("proxy_cache_init: cannot create files in %s", dir);
+            return false;
+        }
+        close(fd);
+    }
+
+    cache_budget = budget;
+    cache_dir = dir;
+    return true;
+}
+
+/* a new budget, applied by each worker at its next store */
+void proxy_cache_resize(size_t budget)
+{
+    cache_budget = budget;
+}
+
+bool proxy_cache_enabled()
+{
+    return cache_budget > 0;
+}
+
+/* larger responses are relayed without being stored */
+size_t proxy_cache_max_object()
+{
+    return cache_budget / 8;
+}
+
+static cache_t *local_cache()
+{
+    if (!cache) {
+        cache = calloc(1, sizeof(cache_t));
+        if (!cache) {
+            log_err("proxy_cache: calloc");
+            return NULL;
+        }
+        INIT_LIST_HEAD(&cache->lru);
+    }
+    return cache;
+}
+
+static uint32_t hash_key(const char *key, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ (uint8_t) key[i]) * 16777619u;
+    return hash;
+}
+
+static void entry_free(cache_entry_t *e)
+{
+    if (e->fd >= 0)
+        close(e->fd);
+    free(e->header);
+    free(e->body);
+    free(e);
+}
+
+/* drop the table's hold on e; it lives on while responses still send it */
+static void unlink_entry(cache_entry_t *e)
+{
+    if (!e->linked)
+        return;
+
+    cache_entry_t **pp = &cache->buckets[e->hash & (CACHE_BUCKETS - 1)];
+    while (*pp != e)
+        pp = &(*pp)->next;
+    *pp = e->next;
+
+    if (!e->pending) {
+        list_del(&e->lru);
+        cache->used -= e->header_len + e->body_len;
+    }
+    e->linked = false;
+    if (!e->refs)
+        entry_free(e);
+}
+
+/* the entry for key, fresh or pending, or NULL. Expired entries are dropped
+ * on the way.
+ */
+cache_entry_t *proxy_cache_lookup(const char *key, size_t len)
+{
+    if (!local_cache())
+        return NULL;
+
+    uint32_t hash = hash_key(key, len);
+    cache_entry_t *e = cache->buckets[hash & (CACHE_BUCKETS - 1)];
+    for (; e; e = e->next) {
+        if (e->hash == hash && e->key_len == len && !memcmp(e->key, key, len))
+            break;
+    }
+    if (!e || e->pending)
+        return e;
+
+    if (e->expires <= time(NULL)) {
+        unlink_entry(e);
+        return NULL;
+    }
+
+    list_del(&e->lru);
+    list_add(&e->lru, &cache->lru);
+    return e;
+}
+
+/* a pending entry that coalesces requests for key until it is committed or
+ * aborted
+ */
+cache_entry_t *proxy_cache_begin(const char *key, size_t len)
+{
+    if (!local_cache())
+        return NULL;
+
+    cache_entry_t *e = calloc(1, sizeof(cache_entry_t) + len);
+    if (!e)
+        return NULL;
+    memcpy(e->key, key, len);
+    e->key_len = len;
+    e->hash = hash_key(key, len);
+    e->fd = -1;
+    e->pending = true;
+    e->linked = true;
+    INIT_LIST_HEAD(&e->waiters);
+
+    cache_entry_t **bucket = &cache->buckets[e->hash & (CACHE_BUCKETS - 1)];
+    e->next = *bucket;
+    *bucket = e;
+    return e;
+}
+
+/* move the body to an unlinked file, keeping it on the heap on failure */
+static void store_on_disk(cache_entry_t *e)
+{
+    int fd = open(cache_dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return;
+
+    for (size_t off = 0; off < e->body_len;) {
+        ssize_t n = write(fd, e->body + off, e->body_len - off);
+        if (n <= 0) {
+            close(fd);
+            return;
+        }
+        off += n;
+    }
+
+    free(e->body);
+    e->body = NULL;
+    e->fd = fd;
+}
+
+/* fill a pending entry, which takes ownership of body. False without memory
+ * for the header; the entry stays pending and body stays the caller's.
+ */
+bool proxy_cache_commit(cache_entry_t *e,
+                        const char *header,
+                        size_t header_len,
+                        char *body,
+                        size_t body_len,
+                        time_t expires)
+{
+    e->header = malloc(header_len);
+    if (!e->header)
+        return false;
+    memcpy(e->header, header, header_len);
+    e->header_len = header_len;
+    e->body = body;
+    e->body_len = body_len;
+    e->stored = time(NULL);
+    e->expires = expires;
+    e->pending = false;
+    if (cache_dir && body_len)
+        store_on_disk(e);
+
+    if (!e->linked)
+        return true;
+    list_add(&e->lru, &cache->lru);
+    cache->used += header_len + body_len;
+
+    while (cache->used > cache_budget) {
+        cache_entry_t *victim =
+            list_entry(cache->lru.prev, cache_entry_t, lru);
+        unlink_entry(victim);
+    }
+    return true;
+}
+
+/* the fetch behind a pending entry produced nothing storable */
+void proxy_cache_abort(cache_entry_t *e)
+{
+    unlink_entry(e);
+    e->pending = false;
+}
+
+void proxy_cache_get(cache_entry_t *e)
+{
+    e->refs++;
+}
+
+void proxy_cache_put(cache_entry_t *e)
+{
+    if (--e->refs == 0 && !e->linked)
+        entry_free(e);
+}
+
+static long directive(const char *cc, size_t len, const char *name)
+{
+    size_t n = strlen(name);
+    for (const char *p = cc; p + n <= cc + len; p++) {
+        if (strncasecmp(p, name, n) || (p > cc && p[-1] != ' ' &&
+                                         p[-1] != ',' && p[-1] != ':'))
+            continue;
+        if (p + n < cc + len && p[n] == '=')
+            return strtol(p + n + 1, NULL, 10);
+        return 0;
+    }
+    return -1;
+}
+
+/* when a response with these headers goes stale, 0 if it must not be stored.
+ * Cache-Control s-maxage and max-age come before Expires; without either the
+ * response is not cached.
+ */
+time_t proxy_cache_lifetime(const char *cache_control,
+                            size_t cc_len,
+                            const char *expires,
+                            size_t expires_len)
+{
+    time_t now = time(NULL);
+
+    if (cache_control) {
+        if (directive(cache_control, cc_len, "no-store") >= 0 ||
+            directive(cache_control, cc_len, "no-cache") >= 0 ||
+            directive(cache_control, cc_len, "private") >= 0)
+            return 0;
+
+        long age = directive(cache_control, cc_len, "s-maxage");
+        if (age < 0)
+            age = directive(cache_control, cc_len, "max-age");
+        if (age >= 0)
+            return age > 0 ? now + age : 0;
+    }
+
+    if (expires) {
+        char date[64];
+        struct tm tm = {0};
+        if (expires_len >= sizeof(date))
+            return 0;
+        memcpy(date, expires, expires_len);
+        date[expires_len] = '\0';
+        if (!strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm))
+            return 0;
+        time_t t = timegm(&tm);
+        return t > now ? t : 0;
+    }
+
+    return 0;
+}
@@ -0,0 +1,61 @@
+#ifndef PROXY_CACHE_H
+#define PROXY_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "list.h"
+
+/* Cache of proxied responses.
+ *
+ * Every worker keeps its own table of responses keyed by Host and URI, with
+ * a byte budget enforced by evicting the least recently used entries. Bodies
+ * live on the heap, or in unlinked files below a cache directory so the
+ * budget can exceed memory. An entry is reference counted: eviction only
+ * unlinks it, and it is freed once the last response sending it is done.
+ *
+ * A pending entry marks a fetch in flight. Requests for the same key queue on
+ * its waiters list instead of going upstream themselves.
+ */
+typedef struct cache_entry {
+    struct cache_entry *next; /* hash chain */
+    list_head lru;
+    list_head waiters;
+    uint32_t hash;
+    int refs;
+    bool pending;
+    bool linked; /* still reachable from the table */
+    time_t stored, expires;
+    char *header; /* status line and end-to-end headers */
+    size_t header_len;
+    char *body;
+    int fd; /* body file when disk backed, else -1 */
+    size_t body_len;
+    size_t key_len;
+    char key[];
+} cache_entry_t;
+
+bool proxy_cache_init(size_t budget, const char *dir);
+void proxy_cache_resize(size_t budget);
+bool proxy_cache_enabled();
+size_t proxy_cache_max_object();
+time_t proxy_cache_lifetime(const char *cache_control,
+                            size_t cc_len,
+                            const char *expires,
+                            size_t expires_len);
+
+cache_entry_t *proxy_cache_lookup(const char *key, size_t len);
+cache_entry_t *proxy_cache_begin(const char *key, size_t len);
+bool proxy_cache_commit(cache_entry_t *e,
+                        const char *header,
+                        size_t header_len,
+                        char *body,
+                        size_t body_len,
+                        time_t expires);
+void proxy_cache_abort(cache_entry_t *e);
+void proxy_cache_get(cache_entry_t *e);
+void proxy_cache_put(cache_entry_t *e);
+
+#endif
@@ -0,0 +1,256 @@
+/* sepack: pack a webroot into a single file served by "sehttpd --pack".
+ *
+ * Usage: sepack ROOT OUT
+ *
+ * Every file gets its response header lines rendered once, here, and its body
+ * copied to an aligned offset, so the server needs no stat(2), open(2) or
+ * header formatting per request.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "http.h"
+#include "logger.h"
+#include "pack.h"
+
+#define PATH_MAX_LEN 4096
+#define HEADER_MAX 512
+
+typedef struct {
+    char *path;
+    struct stat st;
+    char header[HEADER_MAX];
+    uint32_t header_len;
+    uint64_t header_off, body_off;
+} file_t;
+
+typedef struct {
+    char *uri;
+    size_t file;
+} uri_key_t;
+
+static file_t *files;
+static size_t nfiles, files_cap;
+static uri_key_t *keys;
+static size_t nkeys, keys_cap;
+
+static void *grow(void *array, size_t *cap, size_t size)
+{
+    *cap = *cap ? *cap * 2 : 64;
+    void *p = realloc(array, *cap * size);
+    if (!p) {
+        log_err("realloc");
+        exit(1);
+    }
+    return p;
+}
+
+static void add_key(const char *uri, size_t file)
+{
+    if (nkeys == keys_cap)
+        keys = grow(keys, &keys_cap, sizeof(uri_key_t));
+    keys[nkeys].uri = strdup(uri);
+    keys[nkeys].file = file;
+    nkeys++;
+}
+
+static size_t add_file(const char *path, const struct stat *st)
+{
+    if (nfiles == files_cap)
+        files = grow(files, &files_cap, sizeof(file_t));
+
+    file_t *f = &files[nfiles];
+    f->path = strdup(path);
+    f->st = *st;
+
+    char date[64];
+    struct tm tm;
+    gmtime_r(&st->st_mtime, &tm);
+    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+    f->header_len = snprintf(f->header, HEADER_MAX,
+                             "Content-type: %s; charset=ISO-8859-1\r\n"
+                             "Content-length: %zu\r\n"
+                             "Last-Modified: %s\r\n"
+                             "ETag: \"%lx-%lx\"\r\n",
+                             http_mime_type(path), (size_t) st->st_size, date,
+                             (unsigned long) st->st_mtime,
+                             (unsigned long) st->st_size);
+    return nfiles++;
+}
+
+/* the same URIs the server resolves, see walk() in file_index.c */
+static void walk(char *path, char *uri)
+{
+    DIR *dir = opendir(path);
+    if (!dir)
+        return;
+
+    size_t path_len = strlen(path), uri_len = strlen(uri);
+    struct dirent *de;
+    while ((de = readdir(dir))) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+
+        size_t name_len = strlen(de->d_name);
+        if (path_len + name_len + 2 >= PATH_MAX_LEN ||
+            uri_len + name_len + 2 >= PATH_MAX_LEN)
+            continue;
+        sprintf(path + path_len, "/%s", de->d_name);
+        sprintf(uri + uri_len, "%s", de->d_name);
+
+        struct stat st;
+        if (stat(path, &st) < 0) {
+            ;
+        } else if (S_ISDIR(st.st_mode)) {
+            strcat(uri, "/");
+            walk(path, uri);
+        } else if (S_ISREG(st.st_mode) && (st.st_mode & S_IRUSR) &&
+                   strchr(de->d_name, '.')) {
+            size_t file = add_file(path, &st);
+            add_key(uri, file);
+
+            if (!strcmp(de->d_name, "index.html")) {
+                uri[uri_len] = '\0';
+                add_key(uri, file);
+                if (uri_len > 1) {
+                    uri[uri_len - 1] = '\0';
+                    add_key(uri, file);
+                    uri[uri_len - 1] = '/';
+                }
+            }
+        }
+
+        path[path_len] = '\0';
+        uri[uri_len] = '\0';
+    }
+
+    closedir(dir);
+}
+
+static int key_cmp(const void *a, const void *b)
+{
+    const uri_key_t *ka = a, *kb = b;
+    return pack_uri_cmp(ka->uri, strlen(ka->uri), kb->uri, strlen(kb->uri));
+}
+
+static bool pad(FILE *out, uint64_t *off, uint64_t to)
+{
+    for (; *off < to; (*off)++) {
+        if (fputc(0, out) == EOF)
+            return false;
+    }
+    return true;
+}
+
+static bool copy_body(FILE *out, const file_t *f)
+{
+    FILE *in = fopen(f->path, "rb");
+    if (!in) {
+        log_err("%s", f->path);
+        return false;
+    }
+
+    char buf[65536];
+    size_t left = f->st.st_size;
+    while (left > 0) {
+        size_t n = fread(buf, 1, left < sizeof(buf) ? left : sizeof(buf), in);
+        if (n == 0 || fwrite(buf, 1, n, out) != n) {
+            log_err("%s changed while packing", f->path);
+            fclose(in);
+            return false;
+        }
+        left -= n;
+    }
+
+    fclose(in);
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s ROOT OUT\n", argv[0]);
+        return 1;
+    }
+
+    char path[PATH_MAX_LEN], uri[PATH_MAX_LEN];
+    snprintf(path, sizeof(path), "%s", argv[1]);
+    strcpy(uri, "/");
+    walk(path, uri);
+    qsort(keys, nkeys, sizeof(uri_key_t), key_cmp);
+
+    /* lay out the file: entries, URIs, header lines, then aligned bodies */
+    pack_header_t hdr = {.version = PACK_VERSION, .count = nkeys};
+    memcpy(hdr.magic, PACK_MAGIC, sizeof(hdr.magic));
+    hdr.entries_off = sizeof(pack_header_t);
+
+    uint64_t off = hdr.entries_off + nkeys * sizeof(pack_entry_t);
+    for (size_t i = 0; i < nkeys; i++)
+        off += strlen(keys[i].uri);
+    for (size_t i = 0; i < nfiles; i++) {
+        files[i].header_off = off;
+        off += files[i].header_len;
+    }
+    for (size_t i = 0; i < nfiles; i++) {
+        off = (off + PACK_ALIGN - 1) & ~(uint64_t) (PACK_ALIGN - 1);
+        files[i].body_off = off;
+        off += files[i].st.st_size;
+    }
+    hdr.size = off;
+
+    char tmp[PATH_MAX_LEN];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", argv[2]);
+    FILE *out = fopen(tmp, "wb");
+    if (!out) {
+        log_err("%s", tmp);
+        return 1;
+    }
+
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, out) == 1;
+
+    uint64_t uri_off = hdr.entries_off + nkeys * sizeof(pack_entry_t);
+    for (size_t i = 0; ok && i < nkeys; i++) {
+        const file_t *f = &files[keys[i].file];
+        pack_entry_t e = {
+            .uri_off = uri_off,
+            .header_off = f->header_off,
+            .body_off = f->body_off,
+            .body_len = f->st.st_size,
+            .mtime = f->st.st_mtime,
+            .uri_len = strlen(keys[i].uri),
+            .header_len = f->header_len,
+        };
+        ok = fwrite(&e, sizeof(e), 1, out) == 1;
+        uri_off += e.uri_len;
+    }
+    for (size_t i = 0; ok && i < nkeys; i++)
+        ok = fputs(keys[i].uri, out) != EOF;
+    for (size_t i = 0; ok && i < nfiles; i++)
+        ok = fwrite(files[i].header, 1, files[i].header_len, out) ==
+             files[i].header_len;
+
+    off = uri_off;
+    for (size_t i = 0; i < nfiles; i++)
+        off += files[i].header_len;
+    for (size_t i = 0; ok && i < nfiles; i++) {
+        ok = pad(out, &off, files[i].body_off) && copy_body(out, &files[i]);
+        off += files[i].st.st_size;
+    }
+
+    if (fclose(out) != 0 || !ok || rename(tmp, argv[2]) < 0) {
+        log_err("failed to write %s", argv[2]);
+        remove(tmp);
+        return 1;
+    }
+
+    printf("%s: %zu files, %zu URIs, %llu bytes\n", argv[2], nfiles, nkeys,
+           (unsigned long long) hdr.size);
+    return 0;
+}
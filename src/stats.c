@@ -0,0 +1,152 @@
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "stats.h"
+
+#define STATS_MAX_WORKERS 64
+
+__thread stats_t stats_local;
+
+static stats_t *workers[STATS_MAX_WORKERS];
+static _Atomic int nworkers;
+static const char *stats_path;
+static size_t stats_path_len;
+
+#define stats_code_entry(code) code
+static const int status_codes[] = {STATS_STATUS_CODES(stats_code_entry)};
+#undef stats_code_entry
+
+/* called once by every worker before it starts serving, one worker at a
+ * time. Counters of threads that never register are still valid, they are
+ * just not reported.
+ */
+void stats_register()
+{
+    int n = atomic_load(&nworkers);
+    if (n >= STATS_MAX_WORKERS)
+        return;
+    workers[n] = &stats_local;
+    atomic_store_explicit(&nworkers, n + 1, memory_order_release);
+}
+
+void stats_count_status(int status)
+{
+    int i;
+    for (i = 0; i < STATS_STATUS_OTHER; i++) {
+        if (status_codes[i] == status)
+            break;
+    }
+    stats_local.requests[i]++;
+}
+
+void stats_sum(stats_t *sum)
+{
+    memset(sum, 0, sizeof(stats_t));
+    int n = atomic_load_explicit(&nworkers, memory_order_acquire);
+    for (int w = 0; w < n; w++) {
+        const stats_t *s = workers[w];
+        sum->accepts += s->accepts;
+        sum->accept_errors += s->accept_errors;
+        sum->closes += s->closes;
+        sum->evictions += s->evictions;
+        for (int i = 0; i < STATS_STATUS_MAX; i++)
+            sum->requests[i] += s->requests[i];
+        sum->bytes_sent += s->bytes_sent;
+        sum->parse_errors += s->parse_errors;
+        sum->timer_expirations += s->timer_expirations;
+        sum->log_records += s->log_records;
+        sum->log_dropped += s->log_dropped;
+        sum->zerocopy_sends += s->zerocopy_sends;
+        sum->zerocopy_copied += s->zerocopy_copied;
+        sum->tls_handshakes += s->tls_handshakes;
+        sum->tls_handshake_errors += s->tls_handshake_errors;
+        sum->yields += s->yields;
+        sum->remote_cpu_accepts += s->remote_cpu_accepts;
+    }
+}
+
+void stats_set_path(const char *path)
+{
+    stats_path = path;
+    stats_path_len = path ? strlen(path) : 0;
+}
+
+bool stats_match(const char *uri, size_t len)
+{
+    return stats_path && len == stats_path_len &&
+           !memcmp(uri, stats_path, len);
+}
+
+#define render(...)                                              \
+    do {                                                         \
+        int _n = snprintf(buf + len, size - len, ##__VA_ARGS__); \
+        if (_n < 0 || (size_t) _n >= size - len)                 \
+            return len;                                          \
+        len += _n;                                               \
+    } while (0)
+
+/* format the aggregated counters in Prometheus text exposition format */
+size_t stats_render(char *buf, size_t size)
+{
+    stats_t s;
+    size_t len = 0;
+
+    stats_sum(&s);
+
+    render(
+        "# TYPE sehttpd_accepts_total counter\n"
+        "sehttpd_accepts_total %" PRIu64 "\n"
+        "# TYPE sehttpd_accept_errors_total counter\n"
+        "sehttpd_accept_errors_total %" PRIu64 "\n"
+        "# TYPE sehttpd_connections_active gauge\n"
+        "sehttpd_connections_active %" PRIu64 "\n"
+        "# TYPE sehttpd_idle_evictions_total counter\n"
+        "sehttpd_idle_evictions_total %" PRIu64 "\n",
+        s.accepts, s.accept_errors, s.accepts - s.closes, s.evictions);
+
+    render("# TYPE sehttpd_requests_total counter\n");
+    for (int i = 0; i < STATS_STATUS_OTHER; i++)
+        render("sehttpd_requests_total{code=\"%d\"} %" PRIu64 "\n",
+               status_codes[i], s.requests[i]);
+    render("sehttpd_requests_total{code=\"other\"} %" PRIu64 "\n",
+           s.requests[STATS_STATUS_OTHER]);
+
+    render(
+        "# TYPE sehttpd_sent_bytes_total counter\n"
+        "sehttpd_sent_bytes_total %" PRIu64 "\n"
+        "# TYPE sehttpd_parse_errors_total counter\n"
+        "sehttpd_parse_errors_total %" PRIu64 "\n"
+        "# TYPE sehttpd_timer_expirations_total counter\n"
+        "sehttpd_timer_expirations_total %" PRIu64 "\n"
+        "# TYPE sehttpd_access_log_records_total counter\n"
+        "sehttpd_access_log_records_total %" PRIu64 "\n"
+        "# TYPE sehttpd_access_log_dropped_total counter\n"
+        "sehttpd_access_log_dropped_total %" PRIu64 "\n",
+        s.bytes_sent, s.parse_errors, s.timer_expirations, s.log_records,
+        s.log_dropped);
+
+    render(
+        "# TYPE sehttpd_zerocopy_sends_total counter\n"
+        "sehttpd_zerocopy_sends_total %" PRIu64 "\n"
+        "# TYPE sehttpd_zerocopy_copied_total counter\n"
+        "sehttpd_zerocopy_copied_total %" PRIu64 "\n",
+        s.zerocopy_sends, s.zerocopy_copied);
+
+    render(
+        "# TYPE sehttpd_tls_handshakes_total counter\n"
+        "sehttpd_tls_handshakes_total %" PRIu64 "\n"
+        "# TYPE sehttpd_tls_handshake_errors_total counter\n"
+        "sehttpd_tls_handshake_errors_total %" PRIu64 "\n",
+        s.tls_handshakes, s.tls_handshake_errors);
+
+    render(
+        "# TYPE sehttpd_yields_total counter\n"
+        "sehttpd_yields_total %" PRIu64 "\n"
+        "# TYPE sehttpd_remote_cpu_accepts_total counter\n"
+        "sehttpd_remote_cpu_accepts_total %" PRIu64 "\n",
+        s.yields, s.remote_cpu_accepts);
+
+    return len;
+}
@@ -0,0 +1,68 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* response codes with a dedicated counter, anything else is "other" */
+#define STATS_STATUS_CODES(X)                                               \
+    X(200), X(304), X(400), X(403), X(404), X(413), X(431), X(502), X(503), \
+        X(504)
+
+#define stats_status_entry(code) STATS_STATUS_##code
+enum {
+    STATS_STATUS_CODES(stats_status_entry),
+    STATS_STATUS_OTHER,
+    STATS_STATUS_MAX
+};
+#undef stats_status_entry
+
+/* per-worker counters. Each worker owns one instance and bumps it with plain
+ * increments; readers sum all registered instances, so a scrape may see a
+ * value a few increments behind but never pays for atomics on the hot path.
+ */
+typedef struct {
+    uint64_t accepts;
+    uint64_t accept_errors;
+    uint64_t closes;
+    uint64_t evictions;
+    uint64_t requests[STATS_STATUS_MAX];
+    uint64_t bytes_sent;
+    uint64_t parse_errors;
+    uint64_t timer_expirations;
+    uint64_t log_records;
+    uint64_t log_dropped;
+    uint64_t zerocopy_sends;
+    uint64_t zerocopy_copied; /* completions where the kernel copied anyway */
+    uint64_t tls_handshakes;
+    uint64_t tls_handshake_errors;
+    uint64_t yields; /* connections that gave up a wakeup to the others */
+    uint64_t remote_cpu_accepts; /* received on a CPU other than the worker's */
+} stats_t;
+
+/* large enough for the counters, the optional latency histograms and the
+ * hardware counters
+ */
+#define STATS_BUFSIZE 32768
+
+extern __thread stats_t stats_local;
+
+#define stats_inc(field) (stats_local.field++)
+#define stats_add(field, n) (stats_local.field += (n))
+
+/* connections currently open on the calling worker */
+static inline uint64_t stats_active_conns()
+{
+    return stats_local.accepts - stats_local.closes;
+}
+
+void stats_register();
+void stats_count_status(int status);
+void stats_sum(stats_t *sum);
+
+void stats_set_path(const char *path);
+bool stats_match(const char *uri, size_t len);
+size_t stats_render(char *buf, size_t size);
+
+#endif
@@ -4,6 +4,8 @@
 #include <sys/time.h>
 
 #include "logger.h"
+#include "probe.h"
+#include "stats.h"
 #include "timer.h"
 
 #define TIMER_INFINITE (-1)
@@ -137,8 +139,22 @@ static int timer_comp(void *ti, void *tj)
     return ((timer_node *) ti)->key < ((timer_node *) tj)->key ? 1 : 0;
 }
 
-static prio_queue_t timer;
-static size_t current_msec;
+/* every worker has its own heap */
+static __thread prio_queue_t timer;
+static __thread size_t current_msec;
+
+/* the timers of connections waiting for their next request, in the order they
+ * went idle
+ */
+static __thread list_head idle_timers;
+
+static void idle_unlink(timer_node *node)
+{
+    if (!node->idle.next)
+        return;
+    list_del(&node->idle);
+    node->idle.next = NULL;
+}
 
 static void time_update()
 {
@@ -152,6 +168,7 @@ int timer_init()
 {
     bool ret UNUSED = prio_queue_init(&timer, timer_comp, PQ_DEFAULT_SIZE);
     assert(ret && "prio_queue_init error");
+    INIT_LIST_HEAD(&idle_timers);
 
     time_update();
     return 0;
@@ -200,6 +217,9 @@ void handle_expired_timers()
 
         if (node->key > current_msec)
             return;
+        stats_inc(timer_expirations);
+        probe_timer_expire(node->request->fd);
+        idle_unlink(node);
         if (node->callback)
             node->callback(node->request);
 
@@ -209,6 +229,23 @@ void handle_expired_timers()
     }
 }
 
+/* fire the timer of the connection idle for the longest time ahead of time.
+ * Proxied, HTTP/2 and sending connections are not on the idle list. Returns
+ * false if there was none. The heap frees the node later.
+ */
+bool expire_idle_timer()
+{
+    if (list_empty(&idle_timers))
+        return false;
+
+    timer_node *node = list_entry(idle_timers.next, timer_node, idle);
+    idle_unlink(node);
+    node->deleted = true;
+    if (node->callback)
+        node->callback(node->request);
+    return true;
+}
+
 void add_timer(http_request_t *req, size_t timeout, timer_callback cb)
 {
     timer_node *node = malloc(sizeof(timer_node));
@@ -220,11 +257,21 @@ void add_timer(http_request_t *req, size_t timeout, timer_callback cb)
     node->deleted = false;
     node->callback = cb;
     node->request = req;
+    node->idle.next = NULL;
 
     bool ret UNUSED = prio_queue_insert(&timer, node);
     assert(ret && "add_timer: prio_queue_insert error");
 }
 
+/* add_timer for a connection waiting for its next request, which may be
+ * closed early to make room
+ */
+void add_idle_timer(http_request_t *req, size_t timeout, timer_callback cb)
+{
+    add_timer(req, timeout, cb);
+    list_add_tail(&((timer_node *) req->timer)->idle, &idle_timers);
+}
+
 void del_timer(http_request_t *req)
 {
     time_update();
@@ -232,4 +279,5 @@ void del_timer(http_request_t *req)
     assert(node && "del_timer: req->timer is NULL");
 
     node->deleted = true;
+    idle_unlink(node);
 }
@@ -13,13 +13,16 @@ typedef struct {
     bool deleted; /* if remote client close socket first, set deleted true */
     timer_callback callback;
     http_request_t *request;
+    list_head idle; /* on the idle list, next is NULL otherwise */
 } timer_node;
 
 int timer_init();
 int find_timer();
 void handle_expired_timers();
+bool expire_idle_timer();
 
 void add_timer(http_request_t *req, size_t timeout, timer_callback cb);
+void add_idle_timer(http_request_t *req, size_t timeout, timer_callback cb);
 void del_timer(http_request_t *req);
 
 #endif
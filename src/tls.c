@@ -0,0 +1,246 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for the sake of accept4(2) */
+#endif
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "tls.h"
+
+#ifdef USE_TLS
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include "stats.h"
+#include "timer.h"
+
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+
+/* preferred first; a client offering h2 opens with the HTTP/2 preface */
+static const unsigned char alpn_protos[] = "\x02h2\x08http/1.1";
+
+static SSL_CTX *ctx;
+
+/* the reason of the last OpenSSL failure, appended to the message */
+static void log_ssl(const char *what)
+{
+    char reason[256];
+    ERR_error_string_n(ERR_get_error(), reason, sizeof(reason));
+    log_err("%s: %s", what, reason);
+}
+
+/* whether the kernel takes the "tls" upper layer protocol. It only attaches
+ * to an established socket, so a loopback connection is made to try it.
+ */
+static bool ktls_available()
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t len = sizeof(addr);
+    int lfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int cfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int afd = -1;
+
+    bool ok = lfd >= 0 && cfd >= 0 &&
+              !bind(lfd, (struct sockaddr *) &addr, len) && !listen(lfd, 1) &&
+              !getsockname(lfd, (struct sockaddr *) &addr, &len) &&
+              !connect(cfd, (struct sockaddr *) &addr, len) &&
+              (afd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC)) >= 0 &&
+              !setsockopt(afd, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls"));
+
+    if (afd >= 0)
+        close(afd);
+    if (cfd >= 0)
+        close(cfd);
+    if (lfd >= 0)
+        close(lfd);
+    return ok;
+}
+
+static int select_alpn(SSL *ssl UNUSED,
+                       const unsigned char **out,
+                       unsigned char *outlen,
+                       const unsigned char *in,
+                       unsigned int inlen,
+                       void *arg UNUSED)
+{
+    if (SSL_select_next_proto((unsigned char **) out, outlen, alpn_protos,
+                              sizeof(alpn_protos) - 1, in,
+                              inlen) != OPENSSL_NPN_NEGOTIATED)
+        return SSL_TLSEXT_ERR_NOACK;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+/* load the certificate chain and key; every connection speaks TLS after */
+bool tls_init(const char *cert, const char *key)
+{
+    if (!ktls_available()) {
+        log_err("tls_init: the kernel has no TLS support (modprobe tls)");
+        return false;
+    }
+
+    ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) {
+        log_ssl("tls_init: SSL_CTX_new");
+        return false;
+    }
+
+    /* only the ciphers the kernel implements */
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION |
+                                 SSL_OP_IGNORE_UNEXPECTED_EOF |
+                                 SSL_OP_CIPHER_SERVER_PREFERENCE);
+    SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+    if (!SSL_CTX_set_cipher_list(ctx, "ECDHE+AESGCM:ECDHE+CHACHA20") ||
+        !SSL_CTX_set_ciphersuites(ctx,
+                                  "TLS_AES_128_GCM_SHA256:"
+                                  "TLS_AES_256_GCM_SHA384:"
+                                  "TLS_CHACHA20_POLY1305_SHA256")) {
+        log_ssl("tls_init: ciphers");
+        goto fail;
+    }
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert) != 1) {
+        log_ssl(cert);
+        goto fail;
+    }
+    if (SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        log_ssl(key);
+        goto fail;
+    }
+
+    SSL_CTX_set_alpn_select_cb(ctx, select_alpn, NULL);
+    return true;
+
+fail:
+    SSL_CTX_free(ctx);
+    ctx = NULL;
+    return false;
+}
+
+bool tls_enabled()
+{
+    return ctx != NULL;
+}
+
+/* attach a session to a new connection; the handshake starts with its first
+ * event
+ */
+bool tls_start(http_request_t *r)
+{
+    SSL *ssl = SSL_new(ctx);
+    if (!ssl || !SSL_set_fd(ssl, r->fd)) {
+        log_ssl("tls_start");
+        SSL_free(ssl);
+        return false;
+    }
+    SSL_set_accept_state(ssl);
+    r->tls = ssl;
+    return true;
+}
+
+bool tls_handshaking(http_request_t *r)
+{
+    return r->tls && !SSL_is_init_finished((SSL *) r->tls);
+}
+
+/* advance the handshake. Once done, transmission must be in the kernel's
+ * hands; the request may already sit decrypted in OpenSSL, so it is served
+ * right away.
+ */
+void tls_event(http_request_t *r, uint32_t events)
+{
+    SSL *ssl = r->tls;
+    if (events & (EPOLLERR | EPOLLHUP))
+        goto fail;
+
+    ERR_clear_error();
+    int rc = SSL_do_handshake(ssl);
+    if (rc == 1) {
+        if (!BIO_get_ktls_send(SSL_get_wbio(ssl))) {
+            log_err("tls: the kernel does not take %s", SSL_get_cipher(ssl));
+            goto fail;
+        }
+        stats_inc(tls_handshakes);
+        do_request(r);
+        return;
+    }
+
+    int err = SSL_get_error(ssl, rc);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+        struct epoll_event event = {
+            .data.ptr = r,
+            .events = (err == SSL_ERROR_WANT_READ ? EPOLLIN : EPOLLOUT) |
+                      EPOLLET | EPOLLONESHOT,
+        };
+        epoll_ctl(r->epfd, EPOLL_CTL_MOD, r->fd, &event);
+        return;
+    }
+
+fail:
+    stats_inc(tls_handshake_errors);
+    del_timer(r);
+    http_close_conn(r);
+}
+
+/* like read(2): -1 with EAGAIN until a whole record is in, 0 at the end */
+ssize_t tls_recv(http_request_t *r, void *buf, size_t len)
+{
+    SSL *ssl = r->tls;
+
+    ERR_clear_error();
+    errno = 0;
+    int n = SSL_read(ssl, buf, len < INT_MAX ? len : INT_MAX);
+    if (n > 0)
+        return n;
+
+    switch (SSL_get_error(ssl, n)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        if (errno)
+            return -1;
+        /* fall through */
+    default:
+        errno = EIO;
+        return -1;
+    }
+}
+
+/* send close_notify if the socket takes it right away, then free */
+void tls_close(http_request_t *r)
+{
+    SSL *ssl = r->tls;
+    if (SSL_is_init_finished(ssl))
+        SSL_shutdown(ssl);
+    SSL_free(ssl);
+    r->tls = NULL;
+}
+
+#else
+
+bool tls_init(const char *cert UNUSED, const char *key UNUSED)
+{
+    log_err("tls_init: built without OpenSSL");
+    return false;
+}
+
+#endif
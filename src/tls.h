@@ -0,0 +1,49 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "http.h"
+
+/* TLS termination, compiled in when OpenSSL is installed.
+ *
+ * OpenSSL performs the handshake in user space, driven by the event loop,
+ * and then hands record encryption to the kernel (kTLS). From there on the
+ * socket takes plaintext: responses keep going out with write(2), writev(2),
+ * sendfile(2) and splice(2), and the kernel encrypts them. Client records are
+ * still read through OpenSSL, which lets the kernel decrypt them where it
+ * can. A connection whose cipher the kernel cannot take is closed, so every
+ * response is encrypted or not sent at all. ALPN offers h2 and http/1.1.
+ */
+bool tls_init(const char *cert, const char *key);
+
+#ifdef USE_TLS
+
+bool tls_enabled();
+bool tls_start(http_request_t *r);
+bool tls_handshaking(http_request_t *r);
+void tls_event(http_request_t *r, uint32_t events);
+ssize_t tls_recv(http_request_t *r, void *buf, size_t len);
+void tls_close(http_request_t *r);
+
+#else
+
+#define tls_enabled() false
+#define tls_start(r) true
+#define tls_handshaking(r) false
+#define tls_event(r, events) ((void) (events))
+#define tls_recv(r, buf, len) read((r)->fd, buf, len)
+#define tls_close(r) ((void) (r))
+
+#endif
+
+/* read(2) on a connection, through OpenSSL once it speaks TLS */
+static inline ssize_t tls_read(http_request_t *r, void *buf, size_t len)
+{
+    return r->tls ? tls_recv(r, buf, len) : read(r->fd, buf, len);
+}
+
+#endif
@@ -0,0 +1,130 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logger.h"
+#include "vhost.h"
+
+#define VHOST_LINE_MAX 1024
+
+static vhost_t default_host;
+static vhost_t *hosts;
+static size_t nhosts;
+
+/* open addressing over indexes into hosts, -1 marks an empty slot */
+static int *slots;
+static size_t mask;
+
+/* FNV-1a of the lower-cased name, stopping at the port */
+static uint32_t hash_host(const char *host, size_t *len)
+{
+    uint32_t hash = 2166136261u;
+    size_t i;
+    for (i = 0; i < *len && host[i] != ':'; i++)
+        hash = (hash ^ (uint8_t) tolower((unsigned char) host[i])) * 16777619u;
+    *len = i;
+    return hash;
+}
+
+static bool build_table()
+{
+    size_t size = 16;
+    while (size < nhosts * 2)
+        size <<= 1;
+    slots = malloc(size * sizeof(int));
+    if (!slots)
+        return false;
+    memset(slots, -1, size * sizeof(int));
+    mask = size - 1;
+
+    for (size_t i = 0; i < nhosts; i++) {
+        size_t s = hosts[i].hash & mask;
+        while (slots[s] >= 0)
+            s = (s + 1) & mask;
+        slots[s] = i;
+    }
+    return true;
+}
+
+static bool add_host(const char *name, const char *root, bool index)
+{
+    vhost_t *h = realloc(hosts, (nhosts + 1) * sizeof(vhost_t));
+    if (!h)
+        return false;
+    hosts = h;
+
+    vhost_t *host = &hosts[nhosts];
+    host->name = strdup(name);
+    host->root = strdup(root);
+    if (!host->name || !host->root)
+        return false;
+    for (char *p = host->name; *p; p++)
+        *p = tolower((unsigned char) *p);
+    host->name_len = strlen(name);
+    host->hash = hash_host(host->name, &host->name_len);
+    host->index = NULL;
+    if (index && !(host->index = file_index_init(host->root)))
+        return false;
+
+    nhosts++;
+    return true;
+}
+
+bool vhost_load(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        log_err("vhost_load: %s", path);
+        return false;
+    }
+
+    char line[VHOST_LINE_MAX];
+    int lineno = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), f)) {
+        lineno++;
+        char *comment = strchr(line, '#');
+        if (comment)
+            *comment = '\0';
+
+        char *name = strtok(line, " \t\r\n");
+        if (!name)
+            continue;
+        char *root = strtok(NULL, " \t\r\n");
+        char *opt = strtok(NULL, " \t\r\n");
+        if (!root || (opt && strcmp(opt, "index"))) {
+            log_err("vhost_load: %s:%d: expected \"name root [index]\"", path,
+                    lineno);
+            ok = false;
+            break;
+        }
+        ok = add_host(name, root, opt != NULL);
+    }
+    fclose(f);
+
+    return ok && build_table();
+}
+
+void vhost_set_default(char *root, file_index_t *index)
+{
+    default_host.name = "";
+    default_host.root = root;
+    default_host.index = index;
+}
+
+/* 'host' is the raw Host header value, NULL when there is none */
+const vhost_t *vhost_lookup(const char *host, size_t len)
+{
+    if (!host || !nhosts)
+        return &default_host;
+
+    uint32_t hash = hash_host(host, &len);
+    for (size_t s = hash & mask; slots[s] >= 0; s = (s + 1) & mask) {
+        const vhost_t *h = &hosts[slots[s]];
+        if (h->hash == hash && h->name_len == len &&
+            !strncasecmp(h->name, host, len))
+            return h;
+    }
+    return &default_host;
+}
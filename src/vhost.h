@@ -0,0 +1,32 @@
+#ifndef VHOST_H
+#define VHOST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "file_index.h"
+
+/* a site served by this process */
+typedef struct {
+    char *name; /* lower case, without a port */
+    size_t name_len;
+    uint32_t hash;
+    char *root;
+    file_index_t *index; /* NULL serves by path */
+} vhost_t;
+
+/* Virtual hosts.
+ *
+ * The table is read from a file of lines
+ *
+ *     name root [index]
+ *
+ * and looked up by a hash of the Host header. Requests without a Host header
+ * or naming an unknown host go to the default host built from --root.
+ */
+bool vhost_load(const char *path);
+void vhost_set_default(char *root, file_index_t *index);
+const vhost_t *vhost_lookup(const char *host, size_t len);
+
+#endif
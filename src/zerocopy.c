@@ -0,0 +1,103 @@
+#include <errno.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include <linux/errqueue.h>
+
+#include "logger.h"
+#include "stats.h"
+#include "zerocopy.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+/* set on the listener, inherited by accepted sockets */
+bool zerocopy_enable(int fd)
+{
+    int one = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+        log_err("setsockopt(SO_ZEROCOPY)");
+        return false;
+    }
+    return true;
+}
+
+/* like writen, but the pages of buf are handed to the kernel. Every send(2)
+ * that takes data gets one completion; when the socket runs out of option
+ * memory for them the rest goes out as a plain copy.
+ */
+ssize_t zerocopy_send(http_request_t *r, const void *buf, size_t len)
+{
+    const char *p = buf;
+    size_t left = len;
+    int flags = MSG_ZEROCOPY | MSG_NOSIGNAL;
+
+    while (left > 0) {
+        ssize_t n = send(r->fd, p, left, flags);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+                flags &= ~MSG_ZEROCOPY;
+                continue;
+            }
+            if (errno != EAGAIN)
+                log_err("errno == %d\n", errno);
+            break;
+        }
+        if (flags & MSG_ZEROCOPY) {
+            r->zc_pending++;
+            stats_inc(zerocopy_sends);
+        }
+        p += n;
+        left -= n;
+    }
+
+    stats_add(bytes_sent, len - left);
+    return len - left;
+}
+
+/* drain the completions from the error queue. Returns false when the socket
+ * also carries a real error.
+ */
+bool zerocopy_complete(http_request_t *r)
+{
+    char control[128];
+    struct msghdr msg = {0};
+
+    for (;;) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(r->fd, &msg, MSG_ERRQUEUE) < 0)
+            break;
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm;
+             cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+                continue;
+
+            struct sock_extended_err ee;
+            memcpy(&ee, CMSG_DATA(cm), sizeof(ee));
+            if (ee.ee_origin != SO_EE_ORIGIN_ZEROCOPY || ee.ee_errno)
+                continue;
+
+            /* the range of send(2) calls released, both ends included */
+            uint32_t done = ee.ee_data - ee.ee_info + 1;
+            r->zc_pending -= done < r->zc_pending ? done : r->zc_pending;
+            if (ee.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                stats_add(zerocopy_copied, done);
+        }
+    }
+
+    int err = 0;
+    socklen_t len = sizeof(err);
+    return getsockopt(r->fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && !err;
+}
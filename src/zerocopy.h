@@ -0,0 +1,23 @@
+#ifndef ZEROCOPY_H
+#define ZEROCOPY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "http.h"
+
+/* MSG_ZEROCOPY transmission of bodies that stay in memory.
+ *
+ * The kernel pins the pages of a zerocopy send and reports on the socket
+ * error queue once it has released them, which raises EPOLLERR. Until then
+ * the buffer must not change; the only buffers sent this way are pack file
+ * bodies, which are read-only and mapped for the life of the process.
+ * r->zc_pending counts the sends of a connection not yet completed so the
+ * event loop can tell these notifications from socket errors.
+ */
+bool zerocopy_enable(int fd);
+ssize_t zerocopy_send(http_request_t *r, const void *buf, size_t len);
+bool zerocopy_complete(http_request_t *r);
+
+#endif